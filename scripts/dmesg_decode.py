@@ -0,0 +1,116 @@
+# Decode the binary DMESG log of the bootloader (see src/dmesg.h).
+# The device stores format-string IDs plus raw arguments; the strings are
+# looked up in the .dmesg_fmt section of the ELF file.
+#   python scripts/dmesg_decode.py src/dapboot.elf --usb
+#   python scripts/dmesg_decode.py src/dapboot.elf --dump dmesg.bin
+# To dump over SWD instead of USB:
+#   openocd ... -c "init; halt; dump_image dmesg.bin <codalLogStore address> 1036; resume; exit"
+from __future__ import print_function
+import argparse
+import struct
+import sys
+import os
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from elfinfo import ElfFile
+
+USB_VID = 0x1209
+USB_PID = 0xdb42
+VENDOR_REQ_DMESG = 0x31    # See src/vendor.h
+HEADER_SIZE = 12           # head, tail, size
+
+def read_usb(store_size):
+    import usb.core
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("No bootloader found on USB")
+    def read(offset, length):
+        out = b""
+        while length > 0:
+            n = min(length, 256)
+            out += bytes(bytearray(dev.ctrl_transfer(0xc0, VENDOR_REQ_DMESG, offset, 0, n)))
+            offset += n
+            length -= n
+        return out
+    # The log may move on between requests, retry until head is stable
+    for attempt in range(5):
+        store = read(0, store_size)
+        if read(0, 4) == store[0:4]:
+            return store
+    return store
+
+def format_message(elf, fmt, args):
+    out = ""
+    i = 0
+    args = list(args)
+    while i < len(fmt):
+        c = fmt[i]
+        i += 1
+        if c != "%" or i >= len(fmt):
+            out += c
+            continue
+        spec = fmt[i]
+        i += 1
+        if spec == "%":
+            out += "%"
+            continue
+        val = args.pop(0) if args else 0
+        if spec == "c":
+            out += chr(val & 0xff)
+        elif spec == "d":
+            out += str(struct.unpack("<i", struct.pack("<I", val))[0])
+        elif spec == "x":
+            out += "0x%X" % val
+        elif spec in "pX":
+            out += "0x%08X" % val
+        elif spec == "s":
+            s = elf.cstring_at(val)
+            out += s if s is not None else "(str@0x%08X)" % val
+        else:
+            out += "???"
+    return out
+
+def decode(elf, store):
+    head, tail, size = struct.unpack("<III", store[0:HEADER_SIZE])
+    words = struct.unpack("<%dI" % size, store[HEADER_SIZE:HEADER_SIZE + size * 4])
+    lines = []
+    # head and tail are free-running uint32 counters, they wrap after 4 GiB of log
+    count = (head - tail) & 0xffffffff
+    if count > size:
+        return ["(log header corrupt: head 0x%08X, tail 0x%08X)" % (head, tail)]
+    offset = 0
+    while offset < count:
+        pos = (tail + offset) & 0xffffffff
+        header = words[pos % size]
+        nargs = header & 3
+        args = [words[((pos + 1 + i) & 0xffffffff) % size] for i in range(nargs)]
+        fmt = elf.cstring_at(header & ~3, ".dmesg_fmt")
+        if fmt is None:
+            lines.append("(unknown message 0x%08X) %s" % (header & ~3, " ".join("0x%X" % a for a in args)))
+        else:
+            lines.append(format_message(elf, fmt, args))
+        offset += 1 + nargs
+    return lines
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the bootloader's binary DMESG log.")
+    parser.add_argument("elf", help="bootloader ELF file, e.g. src/dapboot.elf")
+    parser.add_argument("--usb", action="store_true", help="read the log from the bootloader over USB")
+    parser.add_argument("--dump", metavar="FILE", help="read the log from a raw memory dump of codalLogStore")
+    args = parser.parse_args()
+    elf = ElfFile(args.elf)
+    if ".dmesg_fmt" not in elf.sections:
+        sys.exit("No .dmesg_fmt section in %s" % args.elf)
+    store_size = elf.symbols["codalLogStore"][1]
+    if args.usb:
+        store = read_usb(store_size)
+    elif args.dump:
+        with open(args.dump, "rb") as f:
+            store = f.read()
+    else:
+        sys.exit("Need --usb or --dump")
+    for line in decode(elf, store):
+        print(line)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,60 @@
+# Minimal ELF32 little-endian reader for the host-side decoders.
+# Only sections and symbols are needed, so avoid a pyelftools dependency.
+from __future__ import print_function
+import struct
+
+SHT_SYMTAB = 2
+SHF_ALLOC = 2
+
+class ElfFile:
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[0:4] != b"\x7fELF" or self.data[4:5] != b"\x01":
+            raise ValueError("%s is not an ELF32 file" % path)
+        (shoff,) = struct.unpack("<I", self.data[32:36])
+        shentsize, shnum, shstrndx = struct.unpack("<HHH", self.data[46:52])
+        raw = []
+        for i in range(shnum):
+            raw.append(struct.unpack("<IIIIIIIIII", self.data[shoff + i * shentsize:shoff + i * shentsize + 40]))
+        names = raw[shstrndx]
+        self.sections = {}
+        for sh in raw:
+            name = self._cstr(names[4] + sh[0])
+            self.sections[name] = {"type": sh[1], "flags": sh[2], "addr": sh[3],
+                                   "offset": sh[4], "size": sh[5], "link": sh[6]}
+        self.symbols = {}
+        for sh in raw:
+            if sh[1] != SHT_SYMTAB:
+                continue
+            strtab = raw[sh[6]]
+            for off in range(sh[4], sh[4] + sh[5], 16):
+                name, value, size, info, other, shndx = struct.unpack("<IIIBBH", self.data[off:off + 16])
+                if name:
+                    self.symbols[self._cstr(strtab[4] + name)] = (value, size)
+
+    def _cstr(self, off):
+        end = self.data.index(b"\0", off)
+        return self.data[off:end].decode("latin-1")
+
+    def section_data(self, name):
+        sec = self.sections[name]
+        return self.data[sec["offset"]:sec["offset"] + sec["size"]]
+
+    def cstring_at(self, addr, section=None):
+        """Return the string at addr in an allocated section (or the named one), else None."""
+        for name, sec in self.sections.items():
+            if section is not None and name != section:
+                continue
+            if section is None and not (sec["flags"] & SHF_ALLOC):
+                continue
+            if sec["type"] == 8:  # SHT_NOBITS
+                continue
+            if sec["addr"] <= addr < sec["addr"] + sec["size"]:
+                return self._cstr(sec["offset"] + addr - sec["addr"])
+        return None
+
+    def function_symbols(self):
+        """Sorted list of (address, size, name) for code symbols, Thumb bit cleared."""
+        funcs = [(v & ~1, s, n) for n, (v, s) in self.symbols.items() if s > 0 and v & 1]
+        return sorted(funcs)
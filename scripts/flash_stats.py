@@ -0,0 +1,38 @@
+# Show the bootloader's flash wear and flashing statistics (see src/flash_stats.h).
+#   python scripts/flash_stats.py
+from __future__ import print_function
+import argparse
+import struct
+import sys
+
+USB_VID = 0x1209
+USB_PID = 0xdb42
+VENDOR_REQ_FLASH_STATS = 0x32    # See src/vendor.h
+FLASH_START = 0x08000000
+
+def main():
+    parser = argparse.ArgumentParser(description="Show the bootloader's flash statistics over USB.")
+    parser.add_argument("--pages", type=int, default=64, help="number of flash pages tracked (FLASH_SIZE_OVERRIDE / FLASH_PAGE_SIZE)")
+    parser.add_argument("--page-size", type=int, default=1024, help="flash page size in bytes")
+    args = parser.parse_args()
+    import usb.core
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("No bootloader found on USB")
+    size = 16 + 2 * args.pages
+    data = b""
+    while len(data) < size:
+        n = min(size - len(data), 256)
+        data += bytes(bytearray(dev.ctrl_transfer(0xc0, VENDOR_REQ_FLASH_STATS, len(data), 0, n)))
+    sessions, aborted, written, skipped = struct.unpack("<IIII", data[0:16])
+    erases = struct.unpack("<%dH" % args.pages, data[16:size])
+    print("Sessions:      %d (aborted %d)" % (sessions, aborted))
+    print("Bytes written: %d" % written)
+    print("Pages skipped: %d" % skipped)
+    print("Page erases:")
+    for page, count in enumerate(erases):
+        if count:
+            print("  0x%08x  %d" % (FLASH_START + page * args.page_size, count))
+
+if __name__ == "__main__":
+    main()
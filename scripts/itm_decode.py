@@ -0,0 +1,53 @@
+# Decode the ITM (SWO) trace captured by scripts/connect_itm.ocd and print the debug log.
+# The firmware must be built with "-D DEBUG -D DEBUG_ITM", see stm32/logger/logger.cpp.
+#   python scripts/itm_decode.py swo.bin
+#   python scripts/itm_decode.py --follow swo.bin
+from __future__ import print_function
+import argparse
+import sys
+import time
+
+def decode(data, port, out):
+    """Decode ITM packets in data, writing the stimulus payload for port to out.
+    Returns the number of bytes consumed; a trailing partial packet is left for the next call."""
+    i = 0
+    while i < len(data):
+        header = data[i]
+        size = header & 3
+        if header == 0 or size == 0:
+            # Sync, overflow or timestamp packets: skip the header and any continuation bytes.
+            i += 1
+            if header & 0x80 and header & 0x0f == 0:
+                while i < len(data) and data[i] & 0x80:
+                    i += 1
+                i += 1
+            continue
+        length = 4 if size == 3 else size
+        if i + 1 + length > len(data):
+            break
+        if header & 4 == 0 and header >> 3 == port:
+            out.write(bytes(data[i + 1:i + 1 + length]).decode("latin-1"))
+        i += 1 + length
+    return i
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the ITM debug log captured from the SWO pin.")
+    parser.add_argument("file", help="SWO capture file written by openocd, e.g. swo.bin")
+    parser.add_argument("--port", type=int, default=0, help="stimulus port used by the logger (default 0)")
+    parser.add_argument("--follow", "-f", action="store_true", help="keep reading as the capture grows")
+    args = parser.parse_args()
+    pending = bytearray()
+    with open(args.file, "rb") as f:
+        while True:
+            chunk = f.read(4096)
+            if chunk:
+                pending += bytearray(chunk)
+                del pending[:decode(pending, args.port, sys.stdout)]
+                sys.stdout.flush()
+            elif args.follow:
+                time.sleep(0.1)
+            else:
+                break
+
+if __name__ == "__main__":
+    main()
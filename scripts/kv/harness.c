@@ -0,0 +1,221 @@
+//  Host harness for scripts/kv_bench.py: runs kv_store.c against a simulated flash and clock, with a
+//  workload of counters updated often and settings updated now and then, and checks every read
+//  against a model of the store.  Prints the results as key=value lines.
+//
+//  Usage: harness OPS SEED CUT_EVERY
+//    OPS        Number of writes, puts and deletes.
+//    SEED       Of the workload.
+//    CUT_EVERY  Cut the power in the middle of every CUT_EVERY-th write, 0 for never.  The store is
+//               then reopened like after a reset: the key being written must read as its old or new
+//               value, the other keys as before.
+//
+//  Device time: the STM32F103 datasheet typical page erase and half-word program times.  The naive
+//  store the results are compared to rewrites the page with all the values on each write.
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <libopencm3/stm32/flash.h>
+#include "config.h"
+#include "kv_store.h"
+
+#define FLASH_ERASE_NS   20000000  //  tERASE
+#define FLASH_PROGRAM_NS 52500     //  tPROG per half-word
+#define FLASH_BASE       0x08000000
+
+#define COUNTERS      8     //  Keys 0x100..., 4-byte values written by most operations.
+#define SETTINGS      16    //  Keys 0x200..., 4 to 32-byte values.
+#define CHECK_EVERY   1000  //  Reopen the store and check all the keys.
+
+static uint64_t nowNs;
+static uint32_t erases, halfWords, lockedWrites;
+static bool locked = true;
+static int32_t cutCountdown = -1;  //  Half-words programmed before the power cut, -1 for none.
+static jmp_buf cutJump;
+
+static struct {
+    uint16_t length;  //  0 if the key is not in the store.
+    uint8_t value[KV_MAX_VALUE];
+} model[COUNTERS + SETTINGS];
+
+static uint32_t mismatches;
+
+/*-- Simulated flash, mapped where the store expects it -----------------------------------------*/
+
+void flash_unlock(void) { locked = false; }
+void flash_lock(void) { locked = true; }
+
+void flash_erase_page(uint32_t page_address) {
+    if (locked) { lockedWrites++; return; }
+    memset((void *)(uintptr_t) page_address, 0xff, FLASH_PAGE_SIZE);
+    nowNs += FLASH_ERASE_NS;
+    erases++;
+}
+
+void flash_program_half_word(uint32_t address, uint16_t data) {
+    //  NOR flash only clears bits.
+    if (locked) { lockedWrites++; return; }
+    if (cutCountdown == 0) { longjmp(cutJump, 1); }
+    if (cutCountdown > 0) { cutCountdown--; }
+    *(uint16_t *)(uintptr_t) address &= data;
+    nowNs += FLASH_PROGRAM_NS;
+    halfWords++;
+}
+
+/*-- Workload -----------------------------------------------------------------------------------*/
+
+static uint32_t rngState;
+
+static uint32_t rng(void) {
+    //  xorshift32
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static uint16_t key_of(int i) {
+    return i < COUNTERS ? 0x100 + i : 0x200 + (i - COUNTERS);
+}
+
+static bool same(int i, const uint8_t *value, int length) {
+    return length == (model[i].length ? model[i].length : KV_ERR_NOT_FOUND) &&
+           memcmp(value, model[i].value, model[i].length) == 0;
+}
+
+static void check_all(const KvStore *kv) {
+    uint8_t value[KV_MAX_VALUE];
+    for (int i = 0; i < COUNTERS + SETTINGS; i++) {
+        if (!same(i, value, kv_get(kv, key_of(i), value, sizeof(value)))) {
+            fprintf(stderr, "harness: key 0x%x mismatch\n", key_of(i));
+            mismatches++;
+        }
+    }
+}
+
+static uint32_t naive_ns(void) {
+    //  Erase the page and program every value with a 4-byte record header.
+    uint32_t bytes = 0;
+    for (int i = 0; i < COUNTERS + SETTINGS; i++) {
+        if (model[i].length) { bytes += 4 + ((model[i].length + 3) & ~3u); }
+    }
+    return FLASH_ERASE_NS + bytes / 2 * FLASH_PROGRAM_NS;
+}
+
+static void probe_stats(const KvStore *kv, double *average, uint32_t *longest) {
+    //  Slots read by a lookup of each key in the index, as lookup() in kv_store.c.
+    uint32_t total = 0, count = 0;
+    *longest = 0;
+    for (uint32_t i = 0; i < KV_INDEX_SLOTS; i++) {
+        if (!kv->index[i].offset) { continue; }
+        uint32_t home = (uint16_t)(kv->index[i].key * 40503u) >> (16 - KV_INDEX_BITS);
+        uint32_t probes = ((i - home) & (KV_INDEX_SLOTS - 1)) + 1;
+        total += probes;
+        count++;
+        if (probes > *longest) { *longest = probes; }
+    }
+    *average = count ? (double) total / count : 0.0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: harness OPS SEED CUT_EVERY\n");
+        return 2;
+    }
+    uint32_t ops = strtoul(argv[1], NULL, 0);
+    rngState = strtoul(argv[2], NULL, 0) | 1;
+    uint32_t cutEvery = strtoul(argv[3], NULL, 0);
+    void *flash = mmap((void *)FLASH_BASE, FLASH_SIZE_OVERRIDE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (flash != (void *)FLASH_BASE) {
+        perror("harness: mmap flash");
+        return 2;
+    }
+    memset(flash, 0xff, FLASH_SIZE_OVERRIDE);
+
+    static KvStore kv;
+    kv_open(&kv);
+    uint32_t puts = 0, deletes = 0, gets = 0, cuts = 0, errors = 0;
+    uint64_t putNs = 0, putMaxNs = 0, naiveNs = 0;
+    for (uint32_t op = 1; op <= ops; op++) {
+        //  Most writes go to the counters, the rest set or delete a setting.
+        uint32_t r = rng() % 100;
+        int i = r < 85 ? (int)(rng() % COUNTERS) : COUNTERS + (int)(rng() % SETTINGS);
+        bool del = r >= 97;
+        uint8_t value[KV_MAX_VALUE];
+        uint16_t length = i < COUNTERS ? 4 : 4 + rng() % 29;
+        if (i < COUNTERS) {
+            uint32_t count = 0;
+            memcpy(&count, model[i].value, 4);
+            count++;
+            memcpy(value, &count, 4);
+        } else {
+            for (int b = 0; b < length; b++) { value[b] = rng(); }
+        }
+
+        bool cut = cutEvery && op % cutEvery == 0;
+        cutCountdown = cut ? (int32_t)(rng() % (length / 2 + 4)) : -1;
+        uint64_t start = nowNs;
+        if (setjmp(cutJump)) {
+            //  Power cut: reset and reopen.  The key written reads as the old or the new value.
+            cuts++;
+            cutCountdown = -1;
+            locked = true;
+            kv_open(&kv);
+            uint8_t got[KV_MAX_VALUE];
+            int n = kv_get(&kv, key_of(i), got, sizeof(got));
+            bool updated = del ? n == KV_ERR_NOT_FOUND : n == length && memcmp(got, value, length) == 0;
+            if (updated) {
+                model[i].length = del ? 0 : length;
+                memcpy(model[i].value, value, length);
+            } else if (!same(i, got, n)) {
+                fprintf(stderr, "harness: key 0x%x torn by the power cut\n", key_of(i));
+                mismatches++;
+            }
+            check_all(&kv);
+            continue;
+        }
+        int result = del ? kv_delete(&kv, key_of(i)) : kv_put(&kv, key_of(i), value, length);
+        cutCountdown = -1;
+        uint64_t ns = nowNs - start;
+        if (del) {
+            deletes++;
+            if (result != (model[i].length ? KV_OK : KV_ERR_NOT_FOUND)) { errors++; }
+            model[i].length = 0;
+        } else {
+            puts++;
+            putNs += ns;
+            if (ns > putMaxNs) { putMaxNs = ns; }
+            if (result != KV_OK) { errors++; }
+            model[i].length = length;
+            memcpy(model[i].value, value, length);
+            naiveNs += naive_ns();
+        }
+
+        //  Read back a random key, and everything from a reopened store now and then.
+        int j = rng() % (COUNTERS + SETTINGS);
+        uint8_t got[KV_MAX_VALUE];
+        gets++;
+        if (!same(j, got, kv_get(&kv, key_of(j), got, sizeof(got)))) { mismatches++; }
+        if (op % CHECK_EVERY == 0) {
+            kv_open(&kv);
+            check_all(&kv);
+        }
+    }
+    kv_open(&kv);
+    check_all(&kv);
+
+    double probeAverage;
+    uint32_t probeMax;
+    probe_stats(&kv, &probeAverage, &probeMax);
+    printf("puts=%u\ndeletes=%u\ngets=%u\ncuts=%u\n", puts, deletes, gets, cuts);
+    printf("errors=%u\nmismatches=%u\nlocked_writes=%u\n", errors, mismatches, lockedWrites);
+    printf("erases=%u\ncompactions=%u\nhalf_words=%u\n", erases, kv.sequence, halfWords);
+    printf("erases_per_1000=%.3f\n", 1000.0 * erases / (puts + deletes));
+    printf("put_avg_us=%.3f\nput_max_us=%.3f\n", puts ? putNs / 1e3 / puts : 0.0, putMaxNs / 1e3);
+    printf("naive_put_us=%.3f\n", puts ? naiveNs / 1e3 / puts : 0.0);
+    printf("probe_avg=%.3f\nprobe_max=%u\n", probeAverage, probeMax);
+    return 0;
+}
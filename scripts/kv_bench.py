@@ -0,0 +1,92 @@
+# Key-value store benchmark: runs src/kv_store.c built for the host against a simulated flash, with
+# simulated device time, and reports the cost of the writes and reads.
+#   python scripts/kv_bench.py                      # check against the baseline
+#   python scripts/kv_bench.py --update-baseline    # accept the current results
+#   python scripts/kv_bench.py --ops 100000 -v
+# The workload, in scripts/kv/harness.c, mostly increments counters and now and then sets or deletes
+# a setting, reads a key back after each write and reopens the store every 1000 writes to check the
+# index rebuilt from flash.  A second run cuts the power in the middle of some writes and checks
+# that each key reads as its old or new value after the reset.
+# The write times are compared to a naive store that erases and rewrites the page on each write.
+# Needs a host C compiler (cc, or set CC).  Linux only, the simulated flash is mapped at 0x08000000.
+from __future__ import print_function
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HARNESS_DIR = os.path.join(ROOT, "scripts", "kv")
+BASELINE = os.path.join(HARNESS_DIR, "baseline.json")
+
+SOURCES = ["src/kv_store.c", "scripts/kv/harness.c"]
+INCLUDES = ["scripts/replay/shim", "src", "src/stm32f103/generic"]
+CHECKED = ["put_avg_us", "erases_per_1000", "probe_avg"]  # Compared to the baseline, lower is better.
+
+def build_harness(out_dir):
+    cc = os.environ.get("CC", "cc")
+    exe = os.path.join(out_dir, "harness")
+    cmd = [cc, "-std=gnu11", "-O1", "-fno-pie", "-no-pie", "-Wall", "-Wno-unused-parameter",
+           "-Wno-pointer-to-int-cast", "-Wno-int-to-pointer-cast", "-o", exe]
+    cmd += ["-I" + os.path.join(ROOT, d) for d in INCLUDES]
+    cmd += [os.path.join(ROOT, s) for s in SOURCES]
+    subprocess.check_call(cmd)
+    return exe
+
+def run(exe, ops, seed, cut_every, verbose):
+    out = subprocess.check_output([exe, str(ops), str(seed), str(cut_every)])
+    result = {}
+    for line in out.decode().splitlines():
+        key, value = line.split("=")
+        result[key] = float(value)
+    if verbose:
+        for key in sorted(result):
+            print("  %s=%g" % (key, result[key]))
+    return result
+
+def main():
+    import tempfile
+    parser = argparse.ArgumentParser(description="Time the key-value store on a simulated flash.")
+    parser.add_argument("--ops", type=int, default=20000, help="writes in the workload")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the workload")
+    parser.add_argument("--cut-every", type=int, default=97, help="cut the power in every Nth write of the second run")
+    parser.add_argument("--threshold", type=float, default=10.0, help="regression threshold in percent")
+    parser.add_argument("--update-baseline", action="store_true", help="save the results to %s" % os.path.relpath(BASELINE, ROOT))
+    parser.add_argument("-v", "--verbose", action="store_true", help="show all the harness results")
+    args = parser.parse_args()
+    baseline = {}
+    if os.path.exists(BASELINE):
+        with open(BASELINE) as f:
+            baseline = json.load(f)
+    out_dir = tempfile.mkdtemp(prefix="kv_bench")
+    exe = build_harness(out_dir)
+    failures = 0
+    results = {}
+    print("%-8s %9s %9s %9s %9s %9s %8s %10s" % ("run", "put us", "max us", "naive us", "erases/k",
+                                                   "probes", "cuts", "baseline"))
+    for name, cut_every in (("steady", 0), ("cuts", args.cut_every)):
+        r = run(exe, args.ops, args.seed, cut_every, args.verbose)
+        results[name] = dict((key, r[key]) for key in CHECKED)
+        status = ""
+        if r["errors"] or r["mismatches"] or r["locked_writes"]:
+            status = "FAILED"
+            failures += 1
+        elif name in baseline and args.ops == 20000 and args.seed == 1:
+            changes = [100.0 * (r[key] / baseline[name][key] - 1) for key in CHECKED if baseline[name][key]]
+            worst = max(changes) if changes else 0.0
+            status = "%+.1f%%" % worst
+            if worst > args.threshold:
+                status += " REGRESSION"
+                failures += 1
+        print("%-8s %9.1f %9.1f %9.1f %9.2f %9.2f %8d %10s" % (name, r["put_avg_us"], r["put_max_us"],
+                                                             r["naive_put_us"], r["erases_per_1000"],
+                                                             r["probe_avg"], r["cuts"], status))
+    if args.update_baseline:
+        with open(BASELINE, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+    sys.exit(1 if failures and not args.update_baseline else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,148 @@
+# Flat profile of the bootloader from the PC sampler (see src/profile.h).
+# The bootloader must be built with -D PROFILE_SAMPLES.  Typical session:
+#   python scripts/pc_profile.py --reset
+#   (copy firmware.uf2 to the drive)
+#   python scripts/pc_profile.py bootloader.map
+# Symbols come from the linker map (firmware.map / bootloader.map) or the ELF file.
+from __future__ import print_function
+import argparse
+import re
+import struct
+import sys
+import os
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+USB_VID = 0x1209
+USB_PID = 0xdb42
+VENDOR_REQ_SAMPLES = 0x34    # See src/vendor.h
+HEADER_SIZE = 20             # base, shift, bucket_count, total, other
+
+def find_device():
+    import usb.core
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("No bootloader found on USB")
+    return dev
+
+def read_samples(dev):
+    def read(offset, length):
+        return bytes(bytearray(dev.ctrl_transfer(0xc0, VENDOR_REQ_SAMPLES, offset, 0, length)))
+    data = read(0, HEADER_SIZE)
+    bucket_count = struct.unpack("<I", data[8:12])[0]
+    size = HEADER_SIZE + 2 * bucket_count
+    while len(data) < size:
+        data += read(len(data), min(size - len(data), 256))
+    return data
+
+def parse_samples(data):
+    base, shift, bucket_count, total, other = struct.unpack("<IIIII", data[0:HEADER_SIZE])
+    buckets = struct.unpack("<%dH" % bucket_count, data[HEADER_SIZE:HEADER_SIZE + 2 * bucket_count])
+    return base, shift, total, other, buckets
+
+def map_symbols(path):
+    """(address, end, name) of the code in a GNU ld map file, from .text.* input sections and symbols."""
+    section_re = re.compile(r"^ (\.text\S*)\s*(?:0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(.*))?$")
+    addr_re = re.compile(r"^\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(.*)$")
+    symbol_re = re.compile(r"^\s+0x([0-9a-f]+)\s+([A-Za-z_]\w*)\s*$")
+    sections = []
+    symbols = []
+    pending = None
+    with open(path) as f:
+        started = False
+        for line in f:
+            if not started:
+                started = line.startswith("Linker script and memory map")
+                continue
+            line = line.rstrip("\r\n")
+            m = section_re.match(line)
+            if m:
+                pending = m.group(1)
+                if m.group(2):
+                    sections.append((int(m.group(2), 16), int(m.group(3), 16), pending, m.group(4)))
+                    pending = None
+                continue
+            m = addr_re.match(line)
+            if m and pending:
+                sections.append((int(m.group(1), 16), int(m.group(2), 16), pending, m.group(3)))
+                pending = None
+                continue
+            m = symbol_re.match(line)
+            if m:
+                symbols.append((int(m.group(1), 16), m.group(2)))
+    result = []
+    for addr, size, name, obj in sections:
+        if size == 0:
+            continue
+        obj = re.split(r"[\\/]", obj.strip())[-1]
+        inner = sorted(s for s in symbols if addr <= s[0] < addr + size)
+        if not inner or inner[0][0] != addr:
+            # Static functions have no symbol line, use the section name, e.g. .text.flushFlash
+            label = name[6:] if name.startswith(".text.") else name
+            inner = [(addr, label)] + inner
+        for i, (start, label) in enumerate(inner):
+            end = inner[i + 1][0] if i + 1 < len(inner) else addr + size
+            result.append((start, end, "%s (%s)" % (label, obj)))
+    return sorted(result)
+
+def elf_symbols(path):
+    from elfinfo import ElfFile
+    return [(addr, addr + size, name) for addr, size, name in ElfFile(path).function_symbols()]
+
+def symbolize(symbols, addr):
+    lo, hi = 0, len(symbols)
+    while lo < hi:
+        mid = (lo + hi) // 2
+        if symbols[mid][0] <= addr:
+            lo = mid + 1
+        else:
+            hi = mid
+    if lo and addr < symbols[lo - 1][1]:
+        return symbols[lo - 1][2]
+    return "0x%08x" % addr
+
+def main():
+    parser = argparse.ArgumentParser(description="Flat profile of the bootloader from the PC sampler.")
+    parser.add_argument("symbols", nargs="?", help="bootloader.map or ELF file to symbolize against")
+    parser.add_argument("--reset", action="store_true", help="clear the histogram on the device")
+    parser.add_argument("--save", metavar="FILE", help="save the raw histogram read from the device")
+    parser.add_argument("--load", metavar="FILE", help="read the histogram from a file saved with --save")
+    parser.add_argument("--top", type=int, default=30, help="number of functions to show")
+    args = parser.parse_args()
+    if args.reset:
+        find_device().ctrl_transfer(0x40, VENDOR_REQ_SAMPLES, 0, 0, None)
+        return
+    if args.load:
+        with open(args.load, "rb") as f:
+            data = f.read()
+    else:
+        data = read_samples(find_device())
+    if args.save:
+        with open(args.save, "wb") as f:
+            f.write(data)
+    if not args.symbols:
+        if args.save:
+            return
+        sys.exit("Need a map or ELF file to symbolize the samples")
+    base, shift, total, other, buckets = parse_samples(data)
+    if args.symbols.endswith(".map"):
+        symbols = map_symbols(args.symbols)
+    else:
+        symbols = elf_symbols(args.symbols)
+    # A bucket is attributed to the function containing its first address.
+    profile = {}
+    for i, count in enumerate(buckets):
+        if count:
+            name = symbolize(symbols, base + (i << shift))
+            profile[name] = profile.get(name, 0) + count
+    if other:
+        profile["(outside bootloader flash)"] = other
+    if total == 0:
+        sys.exit("No samples")
+    print("%d samples, %d-byte buckets" % (total, 1 << shift))
+    print("%8s %7s  %s" % ("samples", "%", "function"))
+    for name, count in sorted(profile.items(), key=lambda x: -x[1])[:args.top]:
+        print("%8d %6.2f%%  %s" % (count, 100.0 * count / total, name))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+# Dump the bootloader's span profiler table (see src/profile.h).
+# The bootloader must be built with -D PROFILE_SPANS.
+#   python scripts/profile_dump.py           # show the table
+#   python scripts/profile_dump.py --reset   # clear it, e.g. before copying a UF2 file
+from __future__ import print_function
+import argparse
+import struct
+import sys
+
+USB_VID = 0x1209
+USB_PID = 0xdb42
+VENDOR_REQ_PROFILE = 0x33    # See src/vendor.h
+
+# Same order as enum ProfileSpan in src/profile.h
+SPAN_NAMES = [
+    "scsi_command",
+    "read_block",
+    "write_block_core",
+    "flushFlash",
+    "target_flash_program_array",
+    "aggregate_callback",
+    "usbd_poll",
+]
+
+def read_table(dev):
+    def read(offset, length):
+        return bytes(bytearray(dev.ctrl_transfer(0xc0, VENDOR_REQ_PROFILE, offset, 0, length)))
+    span_count, cpu_hz = struct.unpack("<II", read(0, 8))
+    data = b""
+    size = 8 + 20 * span_count
+    while len(data) < size:
+        data += read(len(data), min(size - len(data), 256))
+    spans = []
+    for i in range(span_count):
+        count, lo, hi, total_lo, total_hi = struct.unpack("<IIIII", data[8 + 20 * i:28 + 20 * i])
+        spans.append((count, lo, hi, total_lo | (total_hi << 32)))
+    return cpu_hz, spans
+
+def main():
+    parser = argparse.ArgumentParser(description="Dump the bootloader's span profiler table over USB.")
+    parser.add_argument("--reset", action="store_true", help="clear the table")
+    args = parser.parse_args()
+    import usb.core
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("No bootloader found on USB")
+    if args.reset:
+        dev.ctrl_transfer(0x40, VENDOR_REQ_PROFILE, 0, 0, None)
+        return
+    cpu_hz, spans = read_table(dev)
+    if cpu_hz == 0:
+        sys.exit("No spans recorded")
+    us = 1e6 / cpu_hz
+    print("%-28s %8s %10s %10s %10s %12s" % ("span", "count", "min us", "avg us", "max us", "total ms"))
+    for i, (count, lo, hi, total) in enumerate(spans):
+        name = SPAN_NAMES[i] if i < len(SPAN_NAMES) else "span %d" % i
+        if count == 0:
+            print("%-28s %8d" % (name, 0))
+            continue
+        print("%-28s %8d %10.1f %10.1f %10.1f %12.2f" % (
+            name, count, lo * us, total * us / count, hi * us, total * us / 1000))
+
+if __name__ == "__main__":
+    main()
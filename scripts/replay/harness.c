@@ -0,0 +1,432 @@
+//  Host harness for scripts/replay_bench.py: runs msc.c, ghostfat.c and flash_stats.c against a
+//  simulated USB device controller, flash and clock.  Reads the host transfers from stdin and
+//  prints the simulated times as key=value lines.
+//
+//  Usage: harness [OLD_IMAGE] < records
+//    OLD_IMAGE  Application binary in flash before the replay, erased flash if none.
+//
+//  Input records, little-endian:
+//    'W' u32 us                        Host think time before the next transfer.
+//    'C' setup[8] u16 len data[len]    Control transfer, with the OUT data if any.
+//    'O' u8 ep u32 len data[len]       Bulk OUT transfer.
+//    'I' u8 ep u32 len data[len]       Bulk IN transfer and the data the host got in the capture.
+//    'E'                               End: idle until the device resets, at most IDLE_LIMIT_MS.
+//
+//  Bulk transfers to a stalled endpoint are counted in stalls and skipped, CLEAR_FEATURE
+//  (ENDPOINT_HALT) clears the stall like the libopencm3 core.
+//
+//  Device time: USB_PACKET_NS per packet on the bus, CALLBACK_NS per endpoint callback, and the
+//  STM32F103 datasheet typical page erase and half-word program times for the flash.
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/msc.h>
+#include "target.h"
+#include "uf2.h"
+#include "usb_conf.h"
+#include "flash_stats.h"
+
+#define USB_PACKET_NS    53000     //  64-byte full-speed bulk packet with token and handshake.
+#define CALLBACK_NS      10000     //  Endpoint callback work besides the flash.
+#define FLASH_ERASE_NS   20000000  //  tERASE
+#define FLASH_PROGRAM_NS 52500     //  tPROG per half-word
+#define CPU_HZ           72000000
+#define IDLE_LIMIT_MS    2000
+#define PACKET_SIZE      MAX_USB_PACKET_SIZE
+#define FLASH_BASE       0x08000000
+
+extern int read_block(uint32_t block_no, uint8_t *data);
+extern int write_block(uint32_t lba, const uint8_t *copy_from);
+extern void ghostfat_1ms(void);
+extern void ghostfat_sync(void);
+extern void ghostfat_eject(void);
+extern bool ghostfat_medium_present(void);
+extern usbd_mass_storage *custom_usb_msc_init(usbd_device *usbd_dev,
+    uint8_t ep_in, uint8_t ep_in_size, uint8_t ep_out, uint8_t ep_out_size,
+    const char *vendor_id, const char *product_id, const char *product_revision_level,
+    const uint32_t block_count,
+    int (*read_block)(uint32_t lba, uint8_t *copy_to),
+    int (*write_block)(uint32_t lba, const uint8_t *copy_from),
+    void (*sync_cache)(void), void (*eject)(void), bool (*medium_present)(void),
+    uint8_t msc_interface_index0);
+
+uint32_t rcc_ahb_frequency = CPU_HZ;
+
+static uint64_t nowNs;        //  Simulated device time.
+static uint64_t nextTickNs;   //  Next ghostfat_1ms() call.
+static uint64_t busyNs;       //  Time the device spent in callbacks, ticks and on the bus.
+static uint64_t flashStartNs; //  First UF2 block written.
+static uint64_t flashEndNs;   //  Reset into the application.
+static uint64_t copyEndNs;    //  Last UF2 block written.
+static uint64_t removedNs;    //  The host was first told the medium is removed.
+static bool flashStarted;
+static jmp_buf resetJump;
+
+static struct {
+    usbd_endpoint_callback callback;
+    uint8_t in_buf[PACKET_SIZE];
+    uint16_t in_len;          //  Packet waiting for the host, 0 if none.
+    bool in_full;
+    bool stalled;
+    const uint8_t *out_buf;   //  Packet from the host being read.
+    uint16_t out_len;
+} endpoints[16];
+
+#define MAX_CALLBACKS 8
+static struct {
+    usbd_control_callback callback;
+    uint8_t type;
+    uint8_t type_mask;
+} controlCallbacks[MAX_CALLBACKS];
+static usbd_set_config_callback configCallbacks[MAX_CALLBACKS];
+static uint8_t controlBuf[USB_CONTROL_BUF_SIZE];
+
+static uint32_t controlTransfers, controlStalls, bulkOut, bulkIn, inMismatches, inStarved, stalls;
+
+uint32_t harness_cycles(void) {
+    return (uint32_t)(nowNs * (CPU_HZ / 1000000) / 1000);
+}
+
+static void advance(uint64_t ns) {
+    //  Called outside the callbacks, like the main loop in dapboot.c calls ghostfat_1ms().  Flash
+    //  work in a tick is device time too, and the host waits for it like for a callback.
+    uint64_t end = nowNs + ns;
+    while (nextTickNs <= end) {
+        if (nowNs < nextTickNs) { nowNs = nextTickNs; }
+        uint64_t start = nowNs;
+        ghostfat_1ms();
+        busyNs += nowNs - start;
+        nextTickNs += 1000000 + (nowNs - start);
+        if (end < nowNs) { end = nowNs; }
+    }
+    nowNs = end;
+}
+
+/*-- USB device controller ----------------------------------------------------------------------*/
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type, uint16_t max_size,
+                   usbd_endpoint_callback callback) {
+    (void)usbd_dev; (void)type; (void)max_size;
+    endpoints[addr & 0x0f].callback = callback;
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr, const void *buf, uint16_t len) {
+    (void)usbd_dev;
+    typeof(endpoints[0]) *ep = &endpoints[addr & 0x0f];
+    if (ep->in_full) { return 0; }  //  Like st_usbfs, the previous packet wasn't sent yet.
+    memcpy(ep->in_buf, buf, len);
+    ep->in_len = len;
+    ep->in_full = true;
+    return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr, void *buf, uint16_t len) {
+    (void)usbd_dev;
+    typeof(endpoints[0]) *ep = &endpoints[addr & 0x0f];
+    if (len > ep->out_len) { len = ep->out_len; }
+    memcpy(buf, ep->out_buf, len);
+    ep->out_len = 0;
+    return len;
+}
+
+void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall) {
+    (void)usbd_dev;
+    typeof(endpoints[0]) *ep = &endpoints[addr & 0x0f];
+    ep->stalled = stall;
+    if (!stall) { ep->in_full = false; }  //  Like st_usbfs, a cleared IN endpoint NAKs.
+}
+
+uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr) {
+    (void)usbd_dev;
+    return endpoints[addr & 0x0f].stalled;
+}
+
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak) {
+    (void)usbd_dev; (void)addr; (void)nak;
+}
+
+int aggregate_register_config_callback(usbd_device *usbd_dev, usbd_set_config_callback callback) {
+    (void)usbd_dev;
+    for (int i = 0; i < MAX_CALLBACKS; i++) {
+        if (configCallbacks[i] == callback) { return 0; }
+        if (configCallbacks[i] == NULL) { configCallbacks[i] = callback; return 0; }
+    }
+    return -1;
+}
+
+int aggregate_register_callback(usbd_device *usbd_dev, uint8_t type, uint8_t type_mask,
+                                usbd_control_callback callback) {
+    (void)usbd_dev;
+    for (int i = 0; i < MAX_CALLBACKS; i++) {
+        if (controlCallbacks[i].callback == callback) { return 0; }
+        if (controlCallbacks[i].callback == NULL) {
+            controlCallbacks[i].callback = callback;
+            controlCallbacks[i].type = type;
+            controlCallbacks[i].type_mask = type_mask;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void run_callback(uint8_t addr) {
+    uint64_t start = nowNs;
+    endpoints[addr & 0x0f].callback(NULL, addr);
+    nowNs += CALLBACK_NS;
+    busyNs += nowNs - start;
+    nextTickNs += nowNs - start;  //  The main loop counts ms by polling, not while in callbacks.
+}
+
+/*-- Simulated flash, mapped where the bootloader expects it ------------------------------------*/
+
+static uint16_t *eraseStart, *eraseEnd;
+
+void target_flash_unlock(void) {}
+void target_flash_lock(void) {}
+
+void target_flash_erase_page(uint16_t *page) {
+    memset(page, 0xff, FLASH_PAGE_SIZE);
+    nowNs += FLASH_ERASE_NS;
+}
+
+bool target_flash_program_array(uint16_t *dest, const uint16_t *data, size_t half_word_count) {
+    //  Erases a page when writing to it first, like target_stm32f103.c.
+    while (half_word_count--) {
+        if (dest >= eraseEnd || dest < eraseStart) {
+            eraseStart = (uint16_t *)((uintptr_t)dest & ~(uintptr_t)(FLASH_PAGE_SIZE - 1));
+            eraseEnd = eraseStart + FLASH_PAGE_SIZE / sizeof(uint16_t);
+            target_flash_erase_page(eraseStart);
+            flash_stats_count_erase((uint32_t)(uintptr_t)eraseStart);
+        }
+        *dest++ = *data++;
+        eraseStart = dest;
+        nowNs += FLASH_PROGRAM_NS;
+    }
+    return true;
+}
+
+bool target_flash_append_array(uint16_t *dest, const uint16_t *data, size_t half_word_count) {
+    while (half_word_count--) {
+        *dest++ = *data++;
+        nowNs += FLASH_PROGRAM_NS;
+    }
+    return true;
+}
+
+uint32_t target_crc32(const uint32_t *data, size_t word_count) {
+    //  CRC-32/MPEG-2 over words, like the STM32 CRC unit.
+    uint32_t crc = 0xffffffff;
+    while (word_count--) {
+        crc ^= *data++;
+        for (int i = 0; i < 32; i++) { crc = (crc << 1) ^ (0x04c11db7 & -(crc >> 31)); }
+    }
+    return crc;
+}
+
+void target_manifest_app(void) {
+    longjmp(resetJump, 1);
+}
+
+void target_manifest_ram_image(void) {
+    longjmp(resetJump, 1);
+}
+
+static bool harness_medium_present(void) {
+    bool present = ghostfat_medium_present();
+    if (!present && !removedNs) { removedNs = nowNs; }
+    return present;
+}
+
+static int harness_write_block(uint32_t lba, const uint8_t *copy_from) {
+    const UF2_Block *bl = (const void *)copy_from;
+    if (!flashStarted && is_uf2_block(bl)) {
+        flashStarted = true;
+        flashStartNs = nowNs;
+    }
+    int result = write_block(lba, copy_from);
+    if (is_uf2_block(bl)) { copyEndNs = nowNs; }
+    return result;
+}
+
+/*-- Replay -------------------------------------------------------------------------------------*/
+
+static void read_exact(void *buf, size_t len) {
+    if (len && fread(buf, 1, len, stdin) != len) {
+        fprintf(stderr, "harness: truncated input\n");
+        exit(2);
+    }
+}
+
+static void control_transfer(const struct usb_setup_data *setup, const uint8_t *data, uint16_t len) {
+    //  Standard requests are answered by the libopencm3 core, only the time is counted for them.
+    struct usb_setup_data req = *setup;
+    uint8_t *buf = controlBuf;
+    uint16_t buf_len = req.wLength;
+    usbd_control_complete_callback complete = NULL;
+    uint64_t start = nowNs;
+    controlTransfers++;
+    memcpy(controlBuf, data, len);
+    int result = USBD_REQ_NEXT_CALLBACK;
+    for (int i = 0; i < MAX_CALLBACKS && controlCallbacks[i].callback; i++) {
+        if ((req.bmRequestType & controlCallbacks[i].type_mask) != controlCallbacks[i].type) { continue; }
+        result = controlCallbacks[i].callback(NULL, &req, &buf, &buf_len, &complete);
+        if (result == USBD_REQ_NOTSUPP) { controlStalls++; }
+        if (result != USBD_REQ_NEXT_CALLBACK) { break; }
+    }
+    if (result == USBD_REQ_NEXT_CALLBACK && req.bmRequestType == 0x02 &&
+        req.bRequest == USB_REQ_CLEAR_FEATURE && req.wValue == USB_FEAT_ENDPOINT_HALT) {
+        usbd_ep_stall_set(NULL, req.wIndex, 0);
+    }
+    if (req.bmRequestType == 0x00 && req.bRequest == 9) {  //  SET_CONFIGURATION
+        for (int i = 0; i < MAX_CALLBACKS && configCallbacks[i]; i++) {
+            configCallbacks[i](NULL, req.wValue);
+        }
+    }
+    if (complete) { complete(NULL, &req); }
+    nextTickNs += nowNs - start + CALLBACK_NS;
+    nowNs += CALLBACK_NS + (2 + (req.wLength + PACKET_SIZE - 1) / PACKET_SIZE) * USB_PACKET_NS;
+    busyNs += nowNs - start;
+}
+
+static void bulk_out(uint8_t addr, const uint8_t *data, uint32_t len) {
+    typeof(endpoints[0]) *ep = &endpoints[addr & 0x0f];
+    bulkOut++;
+    if (ep->stalled) {
+        stalls++;
+        return;
+    }
+    for (uint32_t offset = 0; offset < len; offset += PACKET_SIZE) {
+        nowNs += USB_PACKET_NS;
+        busyNs += USB_PACKET_NS;
+        ep->out_buf = data + offset;
+        ep->out_len = len - offset < PACKET_SIZE ? len - offset : PACKET_SIZE;
+        if (ep->callback) { run_callback(addr); }
+    }
+}
+
+static void bulk_in(uint8_t addr, const uint8_t *expected, uint32_t len) {
+    //  The host polls until it has len bytes or gets a short packet.  If the device has nothing
+    //  to send it NAKs forever, which is counted as starved.
+    typeof(endpoints[0]) *ep = &endpoints[addr & 0x0f];
+    uint8_t got[PACKET_SIZE];
+    uint32_t received = 0;
+    bool mismatch = false;
+    bulkIn++;
+    if (ep->stalled) {
+        stalls++;
+        return;
+    }
+    while (received < len) {
+        if (!ep->in_full) {
+            inStarved++;
+            break;
+        }
+        uint16_t n = ep->in_len;
+        memcpy(got, ep->in_buf, n);
+        ep->in_full = false;
+        nowNs += USB_PACKET_NS;
+        busyNs += USB_PACKET_NS;
+        if (received + n > len || memcmp(got, expected + received, n) != 0) { mismatch = true; }
+        received += n;
+        if (ep->callback) { run_callback(addr); }
+        if (n < PACKET_SIZE) { break; }
+    }
+    if (mismatch || received != len) { inMismatches++; }
+}
+
+static uint32_t crc32(const uint8_t *p, uint32_t len) {
+    //  zlib's CRC-32 of the application flash, for replay_bench.py --expect.
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) { crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1)); }
+    }
+    return ~crc;
+}
+
+int main(int argc, char **argv) {
+    void *flash = mmap((void *)FLASH_BASE, FLASH_SIZE_OVERRIDE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (flash != (void *)FLASH_BASE) {
+        perror("harness: mmap flash");
+        return 2;
+    }
+    memset(flash, 0xff, FLASH_SIZE_OVERRIDE);
+    if (argc > 1) {
+        //  The application flashed before, e.g. for a delta update.
+        FILE *f = fopen(argv[1], "rb");
+        if (!f) {
+            perror("harness: old image");
+            return 2;
+        }
+        if (fread((void *) USER_FLASH_START, 1, USER_FLASH_END - USER_FLASH_START, f) == 0) {
+            fprintf(stderr, "harness: empty old image\n");
+            return 2;
+        }
+        fclose(f);
+    }
+    flash_stats_init();
+    custom_usb_msc_init(NULL, MSC_IN, PACKET_SIZE, MSC_OUT, PACKET_SIZE, "Harness", "Replay", "1.0",
+                        UF2_NUM_BLOCKS, read_block, harness_write_block, ghostfat_sync, ghostfat_eject,
+                        harness_medium_present, 0);
+
+    static uint8_t data[1 << 20];
+    bool reset = false;
+    int type;
+    if (setjmp(resetJump)) {
+        reset = true;
+        flashEndNs = nowNs;
+        goto done;
+    }
+    while ((type = getchar()) != EOF) {
+        uint8_t ep;
+        uint16_t len16;
+        uint32_t len;
+        struct usb_setup_data setup;
+        switch (type) {
+        case 'W':
+            read_exact(&len, 4);
+            advance((uint64_t)len * 1000);
+            break;
+        case 'C':
+            read_exact(&setup, 8);
+            read_exact(&len16, 2);
+            read_exact(data, len16);
+            control_transfer(&setup, data, len16);
+            advance(0);
+            break;
+        case 'O':
+        case 'I':
+            read_exact(&ep, 1);
+            read_exact(&len, 4);
+            if (len > sizeof(data)) { fprintf(stderr, "harness: transfer too long\n"); return 2; }
+            read_exact(data, len);
+            if (type == 'O') { bulk_out(ep, data, len); }
+            else { bulk_in(ep, data, len); }
+            advance(0);
+            break;
+        case 'E':
+            for (int ms = 0; ms < IDLE_LIMIT_MS; ms++) { advance(1000000); }
+            goto done;
+        default:
+            fprintf(stderr, "harness: bad record %d\n", type);
+            return 2;
+        }
+    }
+done:
+    printf("device_ms=%.3f\n", nowNs / 1e6);
+    printf("busy_ms=%.3f\n", busyNs / 1e6);
+    printf("flash_ms=%.3f\n", reset && flashStarted ? (flashEndNs - flashStartNs) / 1e6 : -1.0);
+    printf("copy_ms=%.3f\n", flashStarted ? (copyEndNs - flashStartNs) / 1e6 : -1.0);
+    printf("removed_ms=%.3f\n", removedNs && flashStarted ? (removedNs - flashStartNs) / 1e6 : -1.0);
+    printf("reset=%d\n", reset);
+    printf("control=%u\ncontrol_stalls=%u\nbulk_out=%u\nbulk_in=%u\n",
+           controlTransfers, controlStalls, bulkOut, bulkIn);
+    printf("in_mismatches=%u\nin_starved=%u\nstalls=%u\n", inMismatches, inStarved, stalls);
+    printf("flash_sessions=%u\nbytes_written=%u\n", flashStats.sessions, flashStats.bytes_written);
+    printf("app_crc32=%u\n", crc32((const uint8_t *) USER_FLASH_START, USER_FLASH_END - USER_FLASH_START));
+    return 0;
+}
@@ -0,0 +1,5 @@
+//  Host replacement for the libopencm3 header, just what msc.c and ghostfat.c use.  See harness.c.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
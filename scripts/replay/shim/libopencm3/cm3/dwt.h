@@ -0,0 +1,5 @@
+//  Host replacement for the libopencm3 header: the cycle counter follows the simulated device time.
+#pragma once
+#include <libopencm3/cm3/common.h>
+extern uint32_t harness_cycles(void);
+#define DWT_CYCCNT harness_cycles()
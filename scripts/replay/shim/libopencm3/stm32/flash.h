@@ -0,0 +1,7 @@
+//  Host replacement for the libopencm3 header: the flash functions are simulated by the harness.
+#pragma once
+#include <libopencm3/cm3/common.h>
+extern void flash_unlock(void);
+extern void flash_lock(void);
+extern void flash_erase_page(uint32_t page_address);
+extern void flash_program_half_word(uint32_t address, uint16_t data);
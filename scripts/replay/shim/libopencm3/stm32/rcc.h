@@ -0,0 +1,4 @@
+//  Host replacement for the libopencm3 header.
+#pragma once
+#include <libopencm3/cm3/common.h>
+extern uint32_t rcc_ahb_frequency;
@@ -0,0 +1,6 @@
+//  Host replacement for the libopencm3 header.
+#pragma once
+#include <libopencm3/usb/usbd.h>
+typedef struct _usbd_mass_storage usbd_mass_storage;
+#define USB_MSC_REQ_BULK_ONLY_RESET	0xFF
+#define USB_MSC_REQ_GET_MAX_LUN		0xFE
@@ -0,0 +1,47 @@
+//  Host replacement for the libopencm3 USB device API, implemented by harness.c.
+#pragma once
+#include <libopencm3/cm3/common.h>
+
+struct usb_setup_data {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed));
+
+#define USB_REQ_TYPE_IN		0x80
+#define USB_REQ_TYPE_STANDARD	0x00
+#define USB_REQ_TYPE_CLASS	0x20
+#define USB_REQ_TYPE_VENDOR	0x40
+#define USB_REQ_TYPE_DEVICE	0x00
+#define USB_REQ_TYPE_INTERFACE	0x01
+#define USB_REQ_TYPE_ENDPOINT	0x02
+#define USB_REQ_TYPE_TYPE	0x60
+#define USB_REQ_TYPE_RECIPIENT	0x1F
+#define USB_ENDPOINT_ATTR_BULK	0x02
+#define USB_REQ_CLEAR_FEATURE	0x01
+#define USB_FEAT_ENDPOINT_HALT	0x00
+
+enum usbd_request_return_codes {
+	USBD_REQ_NOTSUPP	= 0,
+	USBD_REQ_HANDLED	= 1,
+	USBD_REQ_NEXT_CALLBACK	= 2,
+};
+
+typedef struct _usbd_driver usbd_driver;
+typedef struct _usbd_device usbd_device;
+typedef void (*usbd_control_complete_callback)(usbd_device *usbd_dev, struct usb_setup_data *req);
+typedef int (*usbd_control_callback)(usbd_device *usbd_dev, struct usb_setup_data *req,
+				     uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete);
+typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev, uint16_t wValue);
+typedef void (*usbd_endpoint_callback)(usbd_device *usbd_dev, uint8_t ep);
+typedef void (*usbd_set_altsetting_callback)(usbd_device *usbd_dev, uint16_t wIndex, uint16_t wValue);
+
+void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type, uint16_t max_size,
+		   usbd_endpoint_callback callback);
+uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr, const void *buf, uint16_t len);
+uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr, void *buf, uint16_t len);
+void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall);
+uint8_t usbd_ep_stall_get(usbd_device *usbd_dev, uint8_t addr);
+void usbd_ep_nak_set(usbd_device *usbd_dev, uint8_t addr, uint8_t nak);
@@ -0,0 +1,452 @@
+# Replay benchmark: replays the USB traffic of a Wireshark capture into msc.c and ghostfat.c built
+# for the host, with simulated device time, and reports how long each OS takes to flash.
+#   python scripts/replay_bench.py                      # replay logs/usb-*.pcapng.gz, check baseline
+#   python scripts/replay_bench.py --update-baseline    # accept the current times
+#   python scripts/replay_bench.py logs/usb-mac.pcapng.gz -v
+# The captures are Linux usbmon, Windows USBPcap and macOS XHC captures, see logs/README.md.
+# Only the requests from the host are replayed: control requests go to the callbacks registered
+# with aggregate_register_callback(), bulk OUT data is fed to the MSC endpoint 64 bytes at a
+# time, and each bulk IN transfer polls the IN endpoint for as many bytes as the host received.
+# The host's own think time between transfers comes from the capture.  The device time is
+# simulated by scripts/replay/harness.c: USB bus time per packet, a fixed cost per endpoint
+# callback, and STM32F103 datasheet page erase and half-word program times.
+# The default image fills the whole application flash, so the device's own time dominates.
+#   flash ms   first UF2 block written to the reset into the application
+#   copy ms    first to last UF2 block written, the host's think time between transfers included
+#   busy ms    device time only, over the whole replay: callbacks, 1 ms ticks and the bus.  Flash
+#              erase and programming count here, the host's think time and polling do not.
+# Both flash ms and busy ms are checked against the baseline, busy ms catches device regressions
+# that the host's timing would hide.
+# Needs a host C compiler (cc, or set CC).  Linux only, the simulated flash is mapped at 0x08000000.
+from __future__ import print_function
+import argparse
+import glob
+import gzip
+import json
+import os
+import struct
+import subprocess
+import sys
+
+USB_VID = 0x1209
+USB_PID = 0xdb42
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HARNESS_DIR = os.path.join(ROOT, "scripts", "replay")
+BASELINE = os.path.join(HARNESS_DIR, "baseline.json")
+
+LINKTYPE_USB_LINUX_MMAPPED = 220
+LINKTYPE_USBPCAP = 249
+LINKTYPE_USB_DARWIN = 266
+
+class Transfer(object):
+    """One URB / IRP of the device: submitted by the host at t_submit, completed at t_complete."""
+    def __init__(self, urb_id, t_submit, xfer, ep, device):
+        self.urb_id = urb_id
+        self.t_submit = t_submit
+        self.t_complete = None
+        self.xfer = xfer          # "control", "bulk" or "interrupt"
+        self.ep = ep              # Endpoint address, 0x80 set for IN
+        self.device = device
+        self.setup = None         # 8-byte setup packet of control transfers
+        self.out_data = b""       # Data from the host
+        self.in_data = b""        # Data from the device
+
+def pcapng_packets(path):
+    """Yields (linktype, timestamp in seconds, packet data) of the Enhanced Packet Blocks."""
+    opener = gzip.open if path.endswith(".gz") else open
+    with opener(path, "rb") as f:
+        data = f.read()
+    offset = 0
+    interfaces = []
+    endian = "<"
+    while offset + 12 <= len(data):
+        block_type, length = struct.unpack_from(endian + "II", data, offset)
+        if block_type == 0x0a0d0d0a:
+            endian = "<" if data[offset + 8:offset + 12] == b"\x4d\x3c\x2b\x1a" else ">"
+            length = struct.unpack_from(endian + "I", data, offset + 4)[0]
+            interfaces = []
+        elif block_type == 1:
+            linktype = struct.unpack_from(endian + "H", data, offset + 8)[0]
+            resolution = 1e-6
+            opt = offset + 16
+            while opt < offset + length - 4:
+                code, opt_len = struct.unpack_from(endian + "HH", data, opt)
+                if code == 0:
+                    break
+                if code == 9:
+                    res = bytearray(data[opt + 4:opt + 5])[0]
+                    resolution = 2.0 ** -(res & 0x7f) if res & 0x80 else 10.0 ** -res
+                opt += 4 + opt_len + (-opt_len % 4)
+            interfaces.append((linktype, resolution))
+        elif block_type == 6:
+            interface, ts_hi, ts_lo, cap_len = struct.unpack_from(endian + "IIII", data, offset + 8)
+            linktype, resolution = interfaces[interface]
+            yield linktype, ((ts_hi << 32) | ts_lo) * resolution, data[offset + 28:offset + 28 + cap_len]
+        offset += length
+
+XFER_USBMON = {1: "interrupt", 2: "control", 3: "bulk"}
+XFER_USBPCAP = {1: "interrupt", 2: "control", 3: "bulk"}
+XFER_DARWIN = {0: "control", 2: "bulk", 3: "interrupt"}
+
+def read_capture(path):
+    """Returns the transfers in the capture, in order of submission."""
+    pending = {}
+    transfers = []
+    def submit(key, t, xfer, ep, device):
+        tr = Transfer(key, t, xfer, ep, device)
+        pending[key] = tr
+        transfers.append(tr)
+        return tr
+    for linktype, t, pkt in pcapng_packets(path):
+        if linktype == LINKTYPE_USB_LINUX_MMAPPED:
+            (urb_id, urb_type, xfer, ep, device, bus, flag_setup, flag_data, _, _, _, length,
+             len_cap, setup) = struct.unpack_from("<QBBBBHbbqiiII8s", pkt)
+            if xfer not in XFER_USBMON:
+                continue
+            key = (bus, urb_id)
+            payload = pkt[64:64 + len_cap]
+            if urb_type == ord("S"):
+                tr = submit(key, t, XFER_USBMON[xfer], ep, device)
+                if flag_setup == 0:
+                    tr.setup = setup
+                if not ep & 0x80:
+                    tr.out_data = payload
+            elif key in pending:
+                tr = pending.pop(key)
+                tr.t_complete = t
+                if ep & 0x80:
+                    tr.in_data = payload
+        elif linktype == LINKTYPE_USBPCAP:
+            (header_len, irp_id, status, function, info, bus, device, ep, xfer,
+             data_len) = struct.unpack_from("<HQIHBHHBBI", pkt)
+            if xfer not in XFER_USBPCAP:
+                continue
+            stage = bytearray(pkt[27:28])[0] if xfer == 2 and header_len >= 28 else None
+            # Bulk IRPs are reused for the next transfer and IN submissions may be missing, so
+            # the endpoint is part of the key and a completion without a submission is kept.
+            key = (bus, irp_id, ep & 0x0f)
+            payload = pkt[header_len:header_len + data_len]
+            completion = info & 1
+            if completion and key not in pending and stage is None:
+                submit(key, t, XFER_USBPCAP[xfer], ep, device)
+            if not completion:
+                if stage == 0 or stage is None:
+                    tr = submit(key, t, XFER_USBPCAP[xfer], ep, device)
+                    if stage == 0:
+                        tr.setup = payload[:8]
+                        tr.ep = ep | (bytearray(payload[:1])[0] & 0x80)
+                    elif not ep & 0x80:
+                        tr.out_data = payload
+                elif stage == 1 and key in pending:
+                    pending[key].out_data += payload
+            elif key in pending:
+                tr = pending[key]
+                if stage == 1 or (stage is None and ep & 0x80):
+                    tr.in_data += payload
+                if stage is None or stage in (2, 3):
+                    tr.t_complete = t
+                    del pending[key]
+        elif linktype == LINKTYPE_USB_DARWIN:
+            (version, header_len, request_type, io_length, status, frames, io_id, location, speed,
+             device, ep, xfer) = struct.unpack_from("<HBBIIIQIBBBB", pkt)
+            if xfer not in XFER_DARWIN:
+                continue
+            key = (location, io_id)
+            payload = pkt[header_len:]
+            if request_type == 0:
+                tr = submit(key, t, XFER_DARWIN[xfer], ep, device)
+                if tr.xfer == "control":
+                    tr.setup = payload[:8]
+                    tr.ep = bytearray(payload[:1])[0] & 0x80
+                    tr.out_data = payload[8:]
+            elif key in pending:
+                tr = pending.pop(key)
+                tr.t_complete = t
+                if tr.xfer == "bulk" and not ep & 0x80:
+                    tr.out_data = payload  # OUT data is in the completion
+                elif tr.xfer == "control":
+                    if tr.ep & 0x80:
+                        tr.in_data = payload[8:] if len(payload) > io_length else payload
+                elif ep & 0x80:
+                    tr.in_data = payload
+    for tr in transfers:
+        if tr.t_complete is None and tr.xfer == "bulk" and not tr.ep & 0x80:
+            tr.t_complete = tr.t_submit  # USBPcap may not show OUT completions
+    return [tr for tr in transfers if tr.t_complete is not None]
+
+def find_device_transfers(transfers):
+    """Transfers of the bootloader, found by the VID and PID in its device descriptor."""
+    ids = struct.pack("<HH", USB_VID, USB_PID)
+    devices = set(tr.device for tr in transfers
+                  if tr.setup and tr.setup[:4] == b"\x80\x06\x00\x01" and tr.in_data[8:12] == ids)
+    return [tr for tr in transfers if tr.device in devices]
+
+SOURCES = ["src/msc.c", "src/ghostfat.c", "src/lz4.c", "src/delta.c", "src/md5.c", "src/flash_stats.c", "src/scsi_stats.c", "src/dmesg.c",
+           "scripts/replay/harness.c"]
+INCLUDES = ["scripts/replay/shim", "src", "src/stm32f103/generic", "stm32/logger"]
+MSC_OUT = 0x01   # See src/usb_conf.h
+MSC_IN = 0x82
+APP_BASE_ADDRESS = 0x08004000
+APP_FLASH_SIZE = 0x0800F400 - APP_BASE_ADDRESS  # To USER_FLASH_END, see src/uf2cfg.h
+UF2_FAMILY = 0x5ee21072
+FIRST_LBA = 1000  # Where the synthesized UF2 file is written, ghostfat.c doesn't care.
+
+def build_harness(out_dir):
+    cc = os.environ.get("CC", "cc")
+    exe = os.path.join(out_dir, "harness")
+    cmd = [cc, "-std=gnu11", "-O1", "-fno-pie", "-no-pie", "-Wall", "-Wno-unused-parameter",
+           "-Wno-pointer-to-int-cast", "-Wno-int-to-pointer-cast",
+           "-DUF2_FAMILY=0x%08x" % UF2_FAMILY, "-o", exe]
+    cmd += ["-I" + os.path.join(ROOT, d) for d in INCLUDES]
+    cmd += [os.path.join(ROOT, s) for s in SOURCES]
+    subprocess.check_call(cmd)
+    return exe
+
+def synth_uf2(size, seed=1):
+    """A UF2 file of size bytes of pseudo-random data at the application address."""
+    import random
+    rng = random.Random(seed)
+    blocks = []
+    count = (size + 255) // 256
+    for i in range(count):
+        payload = bytes(bytearray(rng.randrange(256) for _ in range(256)))
+        header = struct.pack("<IIIIIIII", 0x0A324655, 0x9E5D5157, 0x2000, APP_BASE_ADDRESS + 256 * i,
+                             256, i, count, UF2_FAMILY)
+        blocks.append(header + payload + b"\0" * (476 - 256) + struct.pack("<I", 0x0AB16F30))
+    return b"".join(blocks)
+
+class Stream(object):
+    """Input records for harness.c."""
+    def __init__(self):
+        self.parts = []
+    def wait(self, seconds):
+        if seconds > 0:
+            self.parts.append(b"W" + struct.pack("<I", int(seconds * 1e6)))
+    def control(self, setup, data):
+        self.parts.append(b"C" + setup + struct.pack("<H", len(data)) + data)
+    def bulk_out(self, ep, data):
+        self.parts.append(b"O" + struct.pack("<BI", ep, len(data)) + data)
+    def bulk_in(self, ep, expected):
+        self.parts.append(b"I" + struct.pack("<BI", ep, len(expected)) + expected)
+    def end(self):
+        self.parts.append(b"E")
+    def data(self):
+        return b"".join(self.parts)
+
+def replay_capture(stream, transfers):
+    """Adds the host transfers of the capture.  Returns the host's median bulk think time, the
+    largest WRITE(10) in blocks and the median TEST UNIT READY polling interval."""
+    gaps = []
+    write_blocks = 1
+    polls = []
+    last = None
+    for tr in transfers:
+        if tr.xfer == "control":
+            data = tr.out_data if not bytearray(tr.setup[:1])[0] & 0x80 else b""
+        elif tr.xfer == "bulk" and tr.ep in (MSC_OUT, MSC_IN):
+            data = None
+        else:
+            continue
+        if last is not None:
+            gap = max(0.0, tr.t_submit - last.t_complete)
+            stream.wait(gap)
+            if tr.xfer == "bulk" and last.xfer == "bulk":
+                gaps.append(gap)
+        last = tr
+        if tr.xfer == "control":
+            stream.control(tr.setup, data)
+        elif tr.ep == MSC_OUT:
+            stream.bulk_out(MSC_OUT, tr.out_data)
+            opcode = bytearray(tr.out_data)[15] if len(tr.out_data) == 31 and tr.out_data[:4] == b"USBC" else None
+            if opcode == 0x2a:
+                write_blocks = max(write_blocks, struct.unpack(">H", tr.out_data[22:24])[0])
+            elif opcode == 0x00:
+                polls.append(tr.t_submit)
+        else:
+            stream.bulk_in(MSC_IN, tr.in_data)
+    gaps.sort()
+    intervals = sorted(b - a for a, b in zip(polls, polls[1:]) if 0.5 < b - a < 5)
+    poll = intervals[len(intervals) // 2] if intervals else 1.0
+    return (gaps[len(gaps) // 2] if gaps else 0.0), write_blocks, poll
+
+def replay_flash(stream, uf2, write_blocks, gap):
+    """Adds a copy of the UF2 file to the drive, written the way the OS wrote in the capture."""
+    blocks = len(uf2) // 512
+    tag = 0x10000
+    for first in range(0, blocks, write_blocks):
+        count = min(write_blocks, blocks - first)
+        cdb = struct.pack(">BBIBHB", 0x2a, 0, FIRST_LBA + first, 0, count, 0)
+        cbw = struct.pack("<IIIBBB16s", 0x43425355, tag, count * 512, 0, 0, len(cdb), cdb)
+        stream.wait(gap)
+        stream.bulk_out(MSC_OUT, cbw)
+        stream.wait(gap)
+        stream.bulk_out(MSC_OUT, uf2[first * 512:(first + count) * 512])
+        stream.wait(gap)
+        stream.bulk_in(MSC_IN, struct.pack("<IIIB", 0x53425355, tag, 0, 0))
+        tag += 1
+
+def replay_eject(stream, gap):
+    """Adds SYNCHRONIZE CACHE and a START STOP UNIT eject, like `eject` on Linux after the copy."""
+    for tag, cdb in ((0x20000, b"\x35" + b"\0" * 9), (0x20001, b"\x1b\0\0\0\x02\0")):
+        cbw = struct.pack("<IIIBBB16s", 0x43425355, tag, 0, 0, 0, len(cdb), cdb)
+        stream.wait(gap)
+        stream.bulk_out(MSC_OUT, cbw)
+        stream.wait(gap)
+        stream.bulk_in(MSC_IN, struct.pack("<IIIB", 0x53425355, tag, 0, 0))
+
+def replay_errors(stream, gap):
+    """Adds the two Bulk-Only Transport error recoveries before the flash: an unsupported command
+    whose IN data phase is stalled, and an invalid CBW followed by a Reset Recovery.  Each transfer
+    the device stalls is counted in `stalls`, a host timeout would show up in `in_starved`."""
+    clear_in = struct.pack("<BBHHH", 0x02, 1, 0, MSC_IN, 0)
+    clear_out = struct.pack("<BBHHH", 0x02, 1, 0, MSC_OUT, 0)
+    reset = struct.pack("<BBHHH", 0x21, 0xff, 0, 0, 0)
+    cdb = b"\xc0" + b"\0" * 5
+    stream.wait(gap)
+    stream.bulk_out(MSC_OUT, struct.pack("<IIIBBB16s", 0x43425355, 0x30000, 36, 0x80, 0, len(cdb), cdb))
+    stream.wait(gap)
+    stream.bulk_in(MSC_IN, b"")
+    stream.control(clear_in, b"")
+    stream.bulk_in(MSC_IN, struct.pack("<IIIB", 0x53425355, 0x30000, 36, 1))
+    stream.wait(gap)
+    stream.bulk_out(MSC_OUT, b"\xff" * 31)
+    stream.wait(gap)
+    stream.bulk_in(MSC_IN, b"")
+    for setup in (reset, clear_in, clear_out):
+        stream.control(setup, b"")
+    cdb = b"\0" * 6
+    stream.wait(gap)
+    stream.bulk_out(MSC_OUT, struct.pack("<IIIBBB16s", 0x43425355, 0x30001, 0, 0, 0, len(cdb), cdb))
+    stream.wait(gap)
+    stream.bulk_in(MSC_IN, struct.pack("<IIIB", 0x53425355, 0x30001, 0, 0))
+
+def replay_polls(stream, gap, poll):
+    """Adds the host's TEST UNIT READY polling after the copy, and the REQUEST SENSE after each
+    failed one, until the device resets.  The expected replies report the medium removed.  The
+    copy ends at a random point of the polling interval, so the first poll is half an interval
+    later."""
+    sense = bytearray(18)
+    sense[0], sense[2], sense[7], sense[12] = 0x70, 0x02, 0x0a, 0x3a
+    for i in range(4):
+        tag = 0x40000 + 2 * i
+        stream.wait(poll / 2 if i == 0 else poll)
+        stream.bulk_out(MSC_OUT, struct.pack("<IIIBBB16s", 0x43425355, tag, 0, 0, 0, 6, b"\0" * 6))
+        stream.wait(gap)
+        stream.bulk_in(MSC_IN, struct.pack("<IIIB", 0x53425355, tag, 0, 1))
+        cdb = b"\x03\0\0\0\x12\0"
+        stream.wait(gap)
+        stream.bulk_out(MSC_OUT, struct.pack("<IIIBBB16s", 0x43425355, tag + 1, 18, 0x80, 0, 6, cdb))
+        stream.wait(gap)
+        stream.bulk_in(MSC_IN, bytes(sense))
+        stream.wait(gap)
+        stream.bulk_in(MSC_IN, struct.pack("<IIIB", 0x53425355, tag + 1, 0, 0))
+
+def run(exe, path, uf2, eject, errors, old, verbose):
+    transfers = find_device_transfers(read_capture(path))
+    stream = Stream()
+    gap, write_blocks, poll = replay_capture(stream, transfers)
+    if errors:
+        replay_errors(stream, gap)
+    replay_flash(stream, uf2, write_blocks, gap)
+    if eject:
+        replay_eject(stream, gap)
+    replay_polls(stream, gap, poll)
+    stream.end()
+    proc = subprocess.Popen([exe] + ([old] if old else []), stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    out, _ = proc.communicate(stream.data())
+    if proc.returncode != 0:
+        sys.exit("harness failed on %s" % path)
+    result = {}
+    for line in out.decode().splitlines():
+        key, value = line.split("=")
+        result[key] = float(value)
+    result["write_blocks"] = write_blocks
+    result["think_us"] = gap * 1e6
+    result["poll_ms"] = poll * 1e3
+    if verbose:
+        for key in sorted(result):
+            print("  %s=%g" % (key, result[key]))
+    return result
+
+def os_name(path):
+    name = os.path.basename(path)
+    for suffix in (".gz", ".pcapng"):
+        if name.endswith(suffix):
+            name = name[:-len(suffix)]
+    return name[4:] if name.startswith("usb-") else name
+
+def main():
+    import tempfile
+    parser = argparse.ArgumentParser(description="Replay USB captures into msc.c and ghostfat.c and time the flashing.")
+    parser.add_argument("captures", nargs="*", help="pcapng files, default logs/usb-*.pcapng.gz")
+    parser.add_argument("--uf2", help="UF2 file to flash, default random data filling the application flash")
+    parser.add_argument("--expect", metavar="BIN", help="check that the application flash holds BIN after the copy, "
+                        "e.g. with a UF2 file from uf2conv.py --compress")
+    parser.add_argument("--old", metavar="BIN", help="application in flash before the copy, e.g. for a UF2 file "
+                        "from uf2conv.py --patch-from BIN")
+    parser.add_argument("--eject", action="store_true", help="eject the drive after the copy")
+    parser.add_argument("--errors", action="store_true", help="add Bulk-Only Transport error recoveries before the copy")
+    parser.add_argument("--threshold", type=float, default=10.0, help="regression threshold in percent")
+    parser.add_argument("--update-baseline", action="store_true", help="save the times to %s" % os.path.relpath(BASELINE, ROOT))
+    parser.add_argument("-v", "--verbose", action="store_true", help="show all the harness results")
+    args = parser.parse_args()
+    captures = args.captures or sorted(glob.glob(os.path.join(ROOT, "logs", "usb-*.pcapng.gz")))
+    if args.uf2:
+        with open(args.uf2, "rb") as f:
+            uf2 = f.read()
+    else:
+        uf2 = synth_uf2(APP_FLASH_SIZE)
+    expect_crc = None
+    if args.expect:
+        import zlib
+        with open(args.expect, "rb") as f:
+            image = f.read()
+        image += b"\0" * (-len(image) % 256)  # uf2conv.py pads the last block with zeros.
+        expect_crc = zlib.crc32(image + b"\xff" * (APP_FLASH_SIZE - len(image))) & 0xffffffff
+    baseline = {}
+    if os.path.exists(BASELINE):
+        with open(BASELINE) as f:
+            baseline = json.load(f)
+    out_dir = tempfile.mkdtemp(prefix="replay_bench")
+    exe = build_harness(out_dir)
+    old = None
+    if args.old:
+        # As flashed from a UF2 file of uf2conv.py, the last block padded with zeros.
+        with open(args.old, "rb") as f:
+            image = f.read()
+        old = os.path.join(out_dir, "old.bin")
+        with open(old, "wb") as f:
+            f.write(image + b"\0" * (-len(image) % 256))
+    results = {}
+    regressions = 0
+    print("%-10s %10s %10s %10s %10s %8s %s" % ("os", "flash ms", "copy ms", "removed ms", "busy ms", "blocks",
+                                                 "baseline flash/busy"))
+    for path in captures:
+        name = os_name(path)
+        r = run(exe, path, uf2, args.eject, args.errors, old, args.verbose)
+        results[name] = {"flash_ms": r["flash_ms"], "copy_ms": r["copy_ms"], "busy_ms": r["busy_ms"]}
+        base = baseline.get(name)
+        status = ""
+        if r["flash_ms"] < 0 or not r["reset"]:
+            status = "NO RESET"
+            regressions += 1
+        elif expect_crc is not None and r["app_crc32"] != expect_crc:
+            status = "BAD FLASH"
+            regressions += 1
+        elif base and not (args.uf2 or args.eject or args.errors or args.old):
+            changes = [100.0 * (r[key] / base[key] - 1) for key in ("flash_ms", "busy_ms")]
+            status = "%+.1f%% / %+.1f%%" % tuple(changes)
+            if max(changes) > args.threshold:
+                status += " REGRESSION"
+                regressions += 1
+        print("%-10s %10.1f %10.1f %10.1f %10.1f %8d %s" % (name, r["flash_ms"], r["copy_ms"], r["removed_ms"],
+                                                           r["busy_ms"], r["write_blocks"], status))
+    if args.update_baseline:
+        with open(BASELINE, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+    sys.exit(1 if regressions and not args.update_baseline else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,178 @@
+# Convert the bootloader's USB transaction trace (see src/usb_trace.h) to pcapng for Wireshark.
+# The bootloader must be built with -D USB_TRACE.  Typical session:
+#   python scripts/usb_trace.py --reset
+#   (copy firmware.uf2 to the drive, capture on the host with Wireshark meanwhile)
+#   python scripts/usb_trace.py -o device.pcapng
+#   mergecap -w merged.pcapng host.pcapng device.pcapng
+# Timestamps are host time: the bootloader latches its cycle counter when the trace is read, so
+# device events line up with a host capture made at the same time to within a millisecond or so.
+# The cycle counter wraps every minute at 72 MHz, older events are placed a multiple of that late.
+# Setup packets, CBWs and CSWs are written as Linux usbmon packets, so Wireshark decodes the SCSI
+# commands.  Only the fields the trace keeps are filled in the CBW.  Block reads and writes and
+# slow endpoint callbacks go to a second interface as text, with their duration.
+# Without -o the events are listed as text.
+from __future__ import print_function
+import argparse
+import binascii
+import struct
+import sys
+import time
+
+USB_VID = 0x1209
+USB_PID = 0xdb42
+VENDOR_REQ_TRACE = 0x35      # See src/vendor.h
+TRACE_MAGIC = 0x43525455     # "UTRC"
+HEADER_SIZE = 20
+ENTRY_SIZE = 20
+
+# Same values as enum UsbTraceType in src/usb_trace.h
+TRACE_SETUP = 1
+TRACE_CBW = 2
+TRACE_CSW = 3
+TRACE_READ_BLOCK = 4
+TRACE_WRITE_BLOCK = 5
+TRACE_CALLBACK = 6
+
+LINKTYPE_USB_LINUX_MMAPPED = 220
+LINKTYPE_USER0 = 147
+
+def find_device():
+    import usb.core
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        sys.exit("No bootloader found on USB")
+    return dev
+
+def read_trace(dev):
+    """Returns the host time when the header was read, and the raw UsbTrace struct."""
+    def read(offset, length):
+        return bytes(bytearray(dev.ctrl_transfer(0xc0, VENDOR_REQ_TRACE, offset, 0, length)))
+    host_time = time.time()
+    data = read(0, HEADER_SIZE)
+    entry_count = struct.unpack("<I", data[12:16])[0]
+    size = HEADER_SIZE + ENTRY_SIZE * entry_count
+    while len(data) < size:
+        data += read(len(data), min(size - len(data), 256))
+    return host_time, data
+
+def parse_trace(host_time, data):
+    """Returns the events, oldest recorded first, as (host time, type, flags, arg16, payload)."""
+    magic, cpu_hz, now, entry_count, count = struct.unpack("<IIIII", data[:HEADER_SIZE])
+    if magic != TRACE_MAGIC:
+        sys.exit("No trace, is the bootloader built with -D USB_TRACE?")
+    first = max(0, count - entry_count)
+    events = []
+    for n in range(first, count):
+        offset = HEADER_SIZE + ENTRY_SIZE * (n % entry_count)
+        cycles, typ, flags, arg16 = struct.unpack("<IBBH", data[offset:offset + 8])
+        age = ((now - cycles) & 0xffffffff) / float(cpu_hz)
+        events.append((host_time - age, typ, flags, arg16, data[offset + 8:offset + ENTRY_SIZE]))
+    return cpu_hz, sorted(events, key=lambda e: e[0])
+
+def usbmon(t, urb_type, xfer_type, ep, payload, setup=None, length=None):
+    """Linux usbmon packet (struct usbmon_packet with the mmap fields) followed by the data."""
+    sec = int(t)
+    usec = int((t - sec) * 1000000)
+    header = struct.pack("<QBBBBHbbqiiII8siiII",
+                         0, ord(urb_type), xfer_type, ep, 1, 1,
+                         0 if setup else ord("-"), 0 if payload else ord("<"),
+                         sec, usec, 0, len(payload) if length is None else length, len(payload),
+                         setup or b"\0" * 8, 0, 0, 0, 0)
+    return header + payload
+
+def build_cbw(tag, data_length, flags, opcode, lba):
+    """Rebuild a CBW from the fields in the trace.  READ/WRITE get their LBA and block count."""
+    if opcode in (0x28, 0x2a):
+        cdb = struct.pack(">BBIBHB", opcode, 0, lba, 0, data_length // 512, 0)
+    elif opcode in (0x08, 0x0a):
+        cdb = struct.pack(">BBHBB", opcode, (lba >> 16) & 0x1f, lba & 0xffff, (data_length // 512) & 0xff, 0)
+    else:
+        cdb = struct.pack(">BBBBBB", opcode, 0, 0, 0, min(data_length, 255), 0)
+    return struct.pack("<IIIBBB16s", 0x43425355, tag, data_length, flags, 0, len(cdb), cdb)
+
+def to_packets(cpu_hz, events, msc_out, msc_in):
+    """Returns (interface, time, data, comment) for each event."""
+    packets = []
+    for t, typ, flags, arg16, payload in events:
+        args = struct.unpack("<III", payload)
+        if typ == TRACE_SETUP:
+            setup = payload[:8]
+            ep = bytearray(setup)[0] & 0x80
+            packets.append((0, t, usbmon(t, "S", 2, ep, b"", setup, struct.unpack("<H", setup[6:8])[0]),
+                            "setup " + binascii.hexlify(setup).decode()))
+        elif typ == TRACE_CBW:
+            cbw = build_cbw(args[0], args[1], flags, arg16, args[2])
+            packets.append((0, t, usbmon(t, "C", 3, msc_out, cbw),
+                            "CBW tag=%d opcode=0x%02x length=%d lba=%d" % (args[0], arg16, args[1], args[2])))
+        elif typ == TRACE_CSW:
+            csw = struct.pack("<IIIB", 0x53425355, args[0], args[1], flags)
+            packets.append((0, t, usbmon(t, "C", 3, msc_in, csw),
+                            "CSW tag=%d status=%d residue=%d, %d data bytes" % (args[0], flags, args[1], args[2])))
+        elif typ in (TRACE_READ_BLOCK, TRACE_WRITE_BLOCK):
+            name = "read_block" if typ == TRACE_READ_BLOCK else "write_block"
+            text = "%s lba=%d %.3f ms" % (name, args[0], args[1] * 1000.0 / cpu_hz)
+            packets.append((1, t, text.encode(), text))
+        elif typ == TRACE_CALLBACK:
+            text = "ep 0x%02x callback %.3f ms, data bytes %d -> %d" % (
+                flags, args[0] * 1000.0 / cpu_hz, args[1], args[2])
+            packets.append((1, t, text.encode(), text))
+    return packets
+
+def pcapng_block(block_type, body):
+    body += b"\0" * (-len(body) % 4)
+    length = len(body) + 12
+    return struct.pack("<II", block_type, length) + body + struct.pack("<I", length)
+
+def pcapng_option(code, value):
+    return struct.pack("<HH", code, len(value)) + value + b"\0" * (-len(value) % 4)
+
+def write_pcapng(path, packets):
+    with open(path, "wb") as f:
+        f.write(pcapng_block(0x0a0d0d0a, struct.pack("<IHHq", 0x1a2b3c4d, 1, 0, -1) +
+                             pcapng_option(4, b"scripts/usb_trace.py") + pcapng_option(0, b"")))
+        for linktype, name in ((LINKTYPE_USB_LINUX_MMAPPED, b"dapboot usb"),
+                               (LINKTYPE_USER0, b"dapboot events")):
+            f.write(pcapng_block(1, struct.pack("<HHI", linktype, 0, 0) +
+                                 pcapng_option(2, name) + pcapng_option(9, b"\x09") +
+                                 pcapng_option(0, b"")))
+        for interface, t, data, comment in packets:
+            ns = int(round(t * 1e9))
+            options = b""
+            if comment:
+                options = pcapng_option(1, comment.encode()) + pcapng_option(0, b"")
+            f.write(pcapng_block(6, struct.pack("<IIIII", interface, ns >> 32, ns & 0xffffffff,
+                                                len(data), len(data)) +
+                                 data + b"\0" * (-len(data) % 4) + options))
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert the bootloader's USB trace to pcapng.")
+    parser.add_argument("-o", "--output", help="pcapng file to write")
+    parser.add_argument("--reset", action="store_true", help="clear the trace on the device")
+    parser.add_argument("--save", metavar="FILE", help="save the raw trace read from the device")
+    parser.add_argument("--load", metavar="FILE", help="read the trace from a file saved with --save")
+    parser.add_argument("--msc-out", type=lambda x: int(x, 0), default=0x01, help="MSC OUT endpoint, see src/usb_conf.h")
+    parser.add_argument("--msc-in", type=lambda x: int(x, 0), default=0x82, help="MSC IN endpoint, see src/usb_conf.h")
+    args = parser.parse_args()
+    if args.reset:
+        find_device().ctrl_transfer(0x40, VENDOR_REQ_TRACE, 0, 0, None)
+        return
+    if args.load:
+        with open(args.load, "rb") as f:
+            host_time = struct.unpack("<d", f.read(8))[0]
+            data = f.read()
+    else:
+        host_time, data = read_trace(find_device())
+    if args.save:
+        with open(args.save, "wb") as f:
+            f.write(struct.pack("<d", host_time) + data)
+    cpu_hz, events = parse_trace(host_time, data)
+    packets = to_packets(cpu_hz, events, args.msc_out, args.msc_in)
+    if args.output:
+        write_pcapng(args.output, packets)
+        print("%d events written to %s" % (len(packets), args.output))
+    else:
+        for interface, t, data, comment in packets:
+            print(time.strftime("%H:%M:%S", time.localtime(t)) + ("%.6f" % (t % 1))[1:], comment)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,29 @@
+//  Application image header, placed right after the vector table so the bootloader can check that
+//  the whole image was flashed.  The application fills in magic and version, uf2conv.py fills in
+//  length and crc32 when converting a .bin or .hex file, or with uf2conv.py --fill-header after linking.
+//  An image without a header, or whose length is still 0, fails validation unless the bootloader is built
+//  with -D ALLOW_HEADERLESS_APP=1: then only its stack pointer is checked, and a half-written image boots.
+#ifndef APP_HEADER_H_INCLUDED
+#define APP_HEADER_H_INCLUDED
+
+#include <stdint.h>
+
+#ifndef ALLOW_HEADERLESS_APP
+#define ALLOW_HEADERLESS_APP 0
+#endif
+
+#define APP_HEADER_MAGIC  0x48505041  //  "APPH"
+#define APP_HEADER_OFFSET 0x150       //  sizeof(vector_table_t) on STM32F1: 16 + 68 vectors.
+
+typedef struct {
+    uint32_t magic;    //  APP_HEADER_MAGIC
+    uint32_t version;  //  Application version, not checked by the bootloader.
+    uint32_t length;   //  Image length in bytes from the start of the vector table, multiple of 4.
+    uint32_t crc32;    //  CRC-32/MPEG-2 of the image words, skipping this field.  Must be last.
+} AppHeader;
+
+//  Declare the header in the application like this, the linker script places it after the vectors:
+//    const AppHeader app_header __attribute__((section(".app_header"), used)) = { APP_HEADER_MAGIC, 1, 0, 0 };
+#define APP_HEADER_SECTION ".app_header"
+
+#endif  //  APP_HEADER_H_INCLUDED
@@ -21,31 +21,115 @@
 #include <bluepill.h>
 #include <logger.h>
 #include "target.h"
+#include "boot_timeline.h"
+#include "app_header.h"
+#include "usb_drive.h"
+#include "flash_services.h"
+#ifdef BLINK_OWN_FLASH
+#include <libopencm3/stm32/flash.h>
+#endif  //  BLINK_OWN_FLASH
 
-static void delay(int n) {
-    for (int i = 0; i < n*1000000; ++i)
-        asm("nop");
+//  Checked by the bootloader before starting us.  Bump the version for each release.
+const AppHeader app_header __attribute__((section(APP_HEADER_SECTION), used)) = {
+    APP_HEADER_MAGIC,
+    1,  //  version
+    0,  //  length, filled in by uf2conv.py
+    0,  //  crc32, filled in by uf2conv.py
+};
+
+//  The page after the firmware, see stm32f103x8.ld.  Each "c" received on the serial port appends the count
+//  to it, so the flash is only programmed on request and not on every boot.
+#define COUNT_PAGE (APP_BASE_ADDRESS + 44 * 1024)
+
+#ifdef BLINK_OWN_FLASH
+//  Build with BLINK_OWN_FLASH=1 to write the flash with libopencm3 instead of the bootloader's flash
+//  services, and compare "make size" to see the flash saved by the services.
+static void count_erase(void) {
+    flash_unlock();
+    flash_erase_page(COUNT_PAGE);
+    flash_lock();
+}
+
+static void count_program(uint32_t address, uint32_t count) {
+    flash_unlock();
+    flash_program_half_word(address, (uint16_t) count);
+    flash_program_half_word(address + 2, (uint16_t) (count >> 16));
+    flash_lock();
+}
+#else
+static void count_erase(void) {
+    const FlashServices *services = flash_services(1);
+    if (services) { services->flash_erase_page(COUNT_PAGE); }
+}
+
+static void count_program(uint32_t address, uint32_t count) {
+    const FlashServices *services = flash_services(1);
+    if (services) { services->flash_program(address, &count, sizeof(count)); }
 }
+#endif  //  BLINK_OWN_FLASH
+
+static uint32_t count_words(void) {
+    //  The count is the last word written, the page is erased when full.
+    const uint32_t *page = (const uint32_t *) COUNT_PAGE;
+    uint32_t n = 0;
+    while (n < FLASH_PAGE_SIZE / 4 && page[n] != 0xffffffff) { n++; }
+    return n;
+}
+
+static uint32_t read_count(void) {
+    uint32_t n = count_words();
+    return n > 0 ? ((const uint32_t *) COUNT_PAGE)[n - 1] : 0;
+}
+
+static void bump_count(uint8_t ch) {
+    //  Called by usb_drive.c for each byte received on the serial port.
+    if (ch != 'c') { return; }
+    uint32_t count = read_count() + 1;
+    uint32_t n = count_words();
+    if (n == FLASH_PAGE_SIZE / 4) {
+        count_erase();
+        n = 0;
+    }
+    count_program(COUNT_PAGE + n * 4, count);
+    debug_print("count "); debug_print_unsigned(count); debug_println(""); debug_flush();
+}
+
+//  USB polls per LED toggle, roughly the half second of the previous delay loop.
+#define POLLS_PER_TOGGLE 200000
 
 int main(void) {
+    boot_timeline_mark(BOOT_PHASE_APP_MAIN);  //  Before platform_setup() changes the clock.
     enable_debug();       //  Uncomment to allow display of debug messages in development devices. NOTE: This will hang if no debugger is attached.
     //  disable_debug();  //  Uncomment to disable display of debug messages.  For use in production devices.
     platform_setup();     //  STM32 platform setup.
     debug_println("----firmware");  debug_flush();
+    if (BOOT_TIMELINE->magic == BOOT_TIMELINE_MAGIC) {
+        debug_print("time to main us "); debug_print_unsigned(BOOT_TIMELINE->phase_us[BOOT_PHASE_APP_MAIN]);
+        debug_println(""); debug_flush();
+    }
 
     //  Clock already setup in platform_setup()
     //  target_clock_setup();
 
     /* Initialize GPIO/LEDs if needed */
     target_gpio_setup();
+    debug_print("count "); debug_print_unsigned(read_count()); debug_println(""); debug_flush();
+    //  The session the flashing tool or the previous firmware put in the boot mailbox, see boot_mailbox.h.
+    const FlashServices *services = flash_services(3);
+    if (services) {
+        debug_print("flash session "); debug_print_unsigned(services->boot_session()); debug_println(""); debug_flush();
+    }
 
-        while (1) {
-            debug_println("firmware loop");  debug_flush();
-            target_set_led(1);
-            delay(1);
-            target_set_led(0);
-            delay(1);
-        }
+    //  Copying a UF2 file to the drive flashes it through the bootloader, see usb_drive.c.
+    usbd_device* usbd_dev = usb_drive_setup(bump_count);
+    int polls = 0, led = 0;
+    while (1) {
+        usbd_poll(usbd_dev);
+        if (++polls < POLLS_PER_TOGGLE) { continue; }
+        polls = 0;
+        led = !led;
+        target_set_led(led);
+    }
     
     return 0;
 }
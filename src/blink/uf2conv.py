@@ -9,13 +9,34 @@ import re
 import os
 import os.path
 import argparse
+import time
+import hashlib
 
 UF2_MAGIC_START0 = 0x0A324655 # "UF2\n"
 UF2_MAGIC_START1 = 0x9E5D5157 # Randomly selected
 UF2_MAGIC_END    = 0x0AB16F30 # Ditto
+UF2_FLAG_NOFLASH = 0x00000001
+UF2_FLAG_MD5     = 0x00004000
+UF2_FLAG_LZ4     = 0x00010000 # See src/uf2.h
+UF2_FLAG_PATCH   = 0x00020000
+UF2_PAYLOAD_MAX  = 476
 
 INFO_FILE = "/INFO_UF2.TXT"
 
+USB_VID = 0x1209
+USB_PID = 0xdb42
+VENDOR_REQ_PAGE_CRC = 0x30    # See src/vendor.h
+FLASH_START = 0x08000000
+FLASH_PAGE_SIZE = 1024
+USER_FLASH_END = 0x0800F400    # Below the bootloader's reserved pages, see src/uf2cfg.h
+APP_HEADER_MAGIC = 0x48505041  # See src/app_header.h
+APP_HEADER_OFFSET = 0x150
+TOUCH_BAUD_RATE = 1200         # See src/blink/usb_drive.c
+DFU_DETACH = 0
+RESET_TIMEOUT = 10             # Seconds for the bootloader drive to show up after a reset
+RAM_IMAGE_START = 0x20002000   # SRAM window the bootloader runs images from, see src/uf2cfg.h
+RAM_IMAGE_END = 0x20004F00
+
 appstartaddr = 0x2000
 
 def isUF2(buf):
@@ -40,12 +61,15 @@ def convertFromUF2(buf):
         if hd[0] != UF2_MAGIC_START0 or hd[1] != UF2_MAGIC_START1:
             print "Skipping block at " + ptr + "; bad magic"
             continue
-        if hd[2] & 1:
-            # NO-flash flag set; skip block
-            continue
         datalen = hd[4]
         if datalen > 476:
             assert False, "Invalid UF2 data size at " + ptr
+        if hd[2] & UF2_FLAG_LZ4:
+            block = block[0:32] + lz4Decompress(block[32 : 32 + datalen])
+            datalen = len(block) - 32
+        elif hd[2] & UF2_FLAG_NOFLASH:
+            # NO-flash flag set; skip block
+            continue
         newaddr = hd[3]
         if curraddr == None:
             appstartaddr = newaddr
@@ -83,6 +107,249 @@ def convertToUF2(fileContent):
         outp += block
     return outp
 
+def lz4Compress(data):
+    # Greedy LZ4 block, matching the last position of each 4-byte sequence.  The window is the data
+    # itself, the bootloader expands each block on its own, see src/lz4.c.  Keeps the LZ4 end rules
+    # for other decoders: the last 5 bytes are literals, the last match starts 12 bytes before the end.
+    data = bytearray(data)
+    n = len(data)
+    out = bytearray()
+    def length(value):
+        while value >= 255:
+            out.append(255)
+            value -= 255
+        out.append(value)
+    def sequence(literals, matchlen, offset):
+        token = min(len(literals), 15) << 4
+        if matchlen:
+            token |= min(matchlen - 4, 15)
+        out.append(token)
+        if len(literals) >= 15:
+            length(len(literals) - 15)
+        out.extend(literals)
+        if matchlen:
+            out.extend(struct.pack("<H", offset))
+            if matchlen - 4 >= 15:
+                length(matchlen - 4 - 15)
+    last = {}
+    anchor = 0
+    i = 0
+    while i + 12 <= n:
+        key = str(data[i:i + 4])
+        cand = last.get(key)
+        last[key] = i
+        if cand is None or i - cand > 0xffff:
+            i += 1
+            continue
+        m = 4
+        while i + m < n - 5 and data[cand + m] == data[i + m]:
+            m += 1
+        sequence(data[anchor:i], m, i - cand)
+        for j in range(i + 1, min(i + m, n - 3)):
+            last[str(data[j:j + 4])] = j
+        i += m
+        anchor = i
+    sequence(data[anchor:], 0, 0)
+    return str(out)
+
+def lz4Decompress(data):
+    data = bytearray(data)
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        n = token >> 4
+        if n == 15:
+            while True:
+                n += data[i]
+                i += 1
+                if data[i - 1] != 255:
+                    break
+        out.extend(data[i:i + n])
+        i += n
+        if i >= len(data):
+            break
+        offset = data[i] | (data[i + 1] << 8)
+        i += 2
+        n = (token & 15) + 4
+        if token & 15 == 15:
+            while True:
+                n += data[i]
+                i += 1
+                if data[i - 1] != 255:
+                    break
+        for _ in range(n):
+            out.append(out[-offset])
+    return str(out)
+
+def compressUF2(buf):
+    # Replace runs of 256-byte flash blocks in the same page by an LZ4 block that expands to as much
+    # of the run as fits in 476 bytes, see UF2_FLAG_LZ4 in src/uf2.h.  Blocks that don't shrink stay.
+    def plain(hd):
+        return hd[4] == 256 and not hd[2] & UF2_FLAG_NOFLASH and hd[3] % 256 == 0 and \
+            FLASH_START <= hd[3] < RAM_IMAGE_START
+    blocks = []
+    for ptr in range(0, len(buf), 512):
+        hd = struct.unpack("<IIIIIIII", buf[ptr:ptr + 32])
+        blocks.append((hd, buf[ptr + 32:ptr + 32 + hd[4]]))
+    packed = []
+    i = 0
+    while i < len(blocks):
+        hd, data = blocks[i]
+        run = [data]
+        while plain(hd) and i + len(run) < len(blocks):
+            nhd = blocks[i + len(run)][0]
+            if not plain(nhd) or nhd[2] != hd[2] or nhd[7] != hd[7] or nhd[3] != hd[3] + 256 * len(run) or \
+                    nhd[3] / FLASH_PAGE_SIZE != hd[3] / FLASH_PAGE_SIZE:
+                break
+            run.append(blocks[i + len(run)][1])
+        for k in range(len(run), 1, -1):
+            payload = lz4Compress("".join(run[:k]))
+            if len(payload) <= UF2_PAYLOAD_MAX:
+                packed.append((hd[2] | UF2_FLAG_NOFLASH | UF2_FLAG_LZ4, hd[3], payload, hd[7]))
+                i += k
+                break
+        else:
+            packed.append((hd[2], hd[3], data, hd[7]))
+            i += 1
+    outp = ""
+    for blockno, (flags, addr, payload, family) in enumerate(packed):
+        hd = struct.pack("<IIIIIIII", UF2_MAGIC_START0, UF2_MAGIC_START1,
+            flags, addr, len(payload), blockno, len(packed), family)
+        outp += hd + payload + "\x00" * (UF2_PAYLOAD_MAX - len(payload)) + struct.pack("<I", UF2_MAGIC_END)
+    print "LZ4: %d blocks instead of %d" % (len(packed), len(blocks))
+    return outp
+
+def deltaPage(page, source, candidates, limit):
+    # Instructions that rebuild page from source, see src/delta.c: the longest COPY of at least 6
+    # bytes from the source positions candidates() gives for the next 4 bytes, ADD for the rest.
+    # None if longer than limit.
+    out = bytearray()
+    literals = bytearray()
+    def flush():
+        for i in range(0, len(literals), 128):
+            chunk = literals[i:i + 128]
+            out.append(len(chunk) - 1)
+            out.extend(chunk)
+        del literals[:]
+    i = 0
+    while i < len(page):
+        best, bestpos = 0, 0
+        for pos in candidates(str(page[i:i + 4])):
+            n = 0
+            while i + n < len(page) and pos + n < len(source) and source[pos + n] == page[i + n]:
+                n += 1
+            if n > best:
+                best, bestpos = n, pos
+        if best >= 6:
+            flush()
+            out.extend(struct.pack("<BBH", 0x80 | ((best - 1) >> 8), (best - 1) & 0xff, bestpos))
+            i += best
+        else:
+            literals.append(page[i])
+            i += 1
+        if len(out) + len(literals) > limit:
+            return None
+    flush()
+    return out if len(out) <= limit else None
+
+def patchUF2(buf, old):
+    # Replace the flash pages of the UF2 file by patches against old, the image in flash now at the
+    # same address: pages that don't change are left out, the others rebuilt by the bootloader from
+    # the flash and a UF2_FLAG_PATCH block, see src/uf2.h.  Pages whose patch doesn't fit in a block
+    # keep their blocks.  The bootloader sees the pages in order, so a page copies from the new
+    # contents of the pages before it and the old contents of the others.
+    base = appstartaddr
+    size = USER_FLASH_END - base
+    old = bytearray(old + "\x00" * (-len(old) % 256))
+    oldimg = old + bytearray("\xff" * (size - len(old)))
+    newimg = bytearray(oldimg)
+    blocks = []
+    pages = {}
+    for ptr in range(0, len(buf), 512):
+        hd = struct.unpack("<IIIIIIII", buf[ptr:ptr + 32])
+        blocks.append((hd, buf[ptr + 32:ptr + 32 + hd[4]]))
+        if not hd[2] & UF2_FLAG_NOFLASH and base <= hd[3] and hd[3] + hd[4] <= USER_FLASH_END:
+            newimg[hd[3] - base:hd[3] - base + hd[4]] = bytearray(blocks[-1][1])
+            pages.setdefault((hd[3] - base) / FLASH_PAGE_SIZE, []).append(len(blocks) - 1)
+    def indexOf(img):
+        index = {}
+        for i in range(0, len(img) - 3):
+            index.setdefault(str(img[i:i + 4]), []).append(i)
+        return index
+    oldindex, newindex = indexOf(oldimg), indexOf(newimg)
+    packed = []
+    unchanged = patched = 0
+    for i, (hd, data) in enumerate(blocks):
+        p = (hd[3] - base) / FLASH_PAGE_SIZE
+        if p not in pages or i not in pages[p]:
+            packed.append((hd[2], hd[3], data, hd[7]))
+            continue
+        if i != pages[p][0]:
+            continue
+        start = p * FLASH_PAGE_SIZE
+        page = newimg[start:start + FLASH_PAGE_SIZE]
+        if page == oldimg[start:start + FLASH_PAGE_SIZE]:
+            unchanged += 1
+            continue
+        # The flash when the page is rebuilt: new before it, old from it on
+        source = newimg[:start] + oldimg[start:]
+        def candidates(key):
+            return [q for q in newindex.get(key, []) if q + 4 <= start][-16:] + \
+                [q for q in oldindex.get(key, []) if q >= start][:16]
+        patch = deltaPage(page, source, candidates, UF2_PAYLOAD_MAX - 4)
+        if patch is None:
+            for j in pages[p]:
+                packed.append((blocks[j][0][2], blocks[j][0][3], blocks[j][1], blocks[j][0][7]))
+            continue
+        payload = struct.pack("<I", stm32crc(str(page))) + str(patch)
+        packed.append((hd[2] | UF2_FLAG_NOFLASH | UF2_FLAG_PATCH, base + start, payload, hd[7]))
+        patched += 1
+    outp = ""
+    for blockno, (flags, addr, payload, family) in enumerate(packed):
+        hd = struct.pack("<IIIIIIII", UF2_MAGIC_START0, UF2_MAGIC_START1,
+            flags, addr, len(payload), blockno, len(packed), family)
+        outp += hd + payload + "\x00" * (UF2_PAYLOAD_MAX - len(payload)) + struct.pack("<I", UF2_MAGIC_END)
+    print "Patch: %d blocks instead of %d, %d pages unchanged, %d patched" % (len(packed), len(blocks),
+                                                                             unchanged, patched)
+    return outp
+
+def md5UF2(buf):
+    # Add the UF2 MD5 region to the flash blocks: the blocks of a flash page share the region they
+    # cover in it, and the bootloader skips them if the flash already matches, see src/ghostfat.c.
+    def plain(hd):
+        return not hd[2] & UF2_FLAG_NOFLASH and hd[4] <= UF2_PAYLOAD_MAX - 24 and \
+            FLASH_START <= hd[3] < RAM_IMAGE_START
+    blocks = []
+    for ptr in range(0, len(buf), 512):
+        hd = struct.unpack("<IIIIIIII", buf[ptr:ptr + 32])
+        blocks.append((hd, buf[ptr + 32:ptr + 32 + hd[4]]))
+    outp = ""
+    i = 0
+    while i < len(blocks):
+        hd, data = blocks[i]
+        run = [(hd, data)]
+        while plain(hd) and i + len(run) < len(blocks):
+            nhd, ndata = blocks[i + len(run)]
+            last = run[-1][0]
+            if not plain(nhd) or nhd[3] != last[3] + last[4] or \
+                    nhd[3] / FLASH_PAGE_SIZE != hd[3] / FLASH_PAGE_SIZE:
+                break
+            run.append((nhd, ndata))
+        if not plain(hd):
+            outp += buf[i * 512:(i + 1) * 512]
+            i += 1
+            continue
+        content = "".join(d for _, d in run)
+        region = struct.pack("<II", hd[3], len(content)) + hashlib.md5(content).digest()
+        for rhd, rdata in run:
+            outp += struct.pack("<IIIIIIII", rhd[0], rhd[1], rhd[2] | UF2_FLAG_MD5, rhd[3], rhd[4],
+                                rhd[5], rhd[6], rhd[7])
+            outp += rdata + "\x00" * (UF2_PAYLOAD_MAX - 24 - len(rdata)) + region + struct.pack("<I", UF2_MAGIC_END)
+        i += len(run)
+    return outp
+
 class Block:
     def __init__(self, addr):
         self.addr = addr
@@ -107,6 +374,7 @@ def convertFromHexToUF2(buf):
     upper = 0
     currblock = None
     blocks = []
+    imageend = 0
     for line in buf.split('\n'):
         if line[0] != ":":
             continue
@@ -135,6 +403,13 @@ def convertFromHexToUF2(buf):
                 currblock.bytes[addr & 0xff] = rec[i]
                 addr += 1
                 i += 1
+            imageend = max(imageend, addr)
+    # A contiguous image, like objcopy makes, is converted like a .bin file so its app header is filled in
+    if blocks and blocks[0].addr == appstartaddr and \
+            all(blocks[i].addr == appstartaddr + 256 * i for i in range(len(blocks))):
+        image = "".join("".join(chr(b) for b in block.bytes) for block in blocks)
+        return convertToUF2(fillAppHeader(image[:imageend - appstartaddr]))
+    print "HEX file has gaps, app header left as it is"
     numblocks = len(blocks)
     resfile = ""
     for i in range(0, numblocks):
@@ -142,6 +417,94 @@ def convertFromHexToUF2(buf):
     return resfile
 
 
+def stm32crc(buf):
+    # CRC-32/MPEG-2 over little-endian words, same as the STM32 hardware CRC unit
+    crc = 0xffffffff
+    for i in range(0, len(buf), 4):
+        crc ^= struct.unpack("<I", buf[i:i + 4])[0]
+        for b in range(0, 32):
+            if crc & 0x80000000:
+                crc = ((crc << 1) ^ 0x04C11DB7) & 0xffffffff
+            else:
+                crc = (crc << 1) & 0xffffffff
+    return crc
+
+def fillAppHeader(buf):
+    # Fill in the length and CRC of the app header after the vector table, if the app has one
+    if len(buf) < APP_HEADER_OFFSET + 16:
+        return buf
+    magic, version = struct.unpack("<II", buf[APP_HEADER_OFFSET:APP_HEADER_OFFSET + 8])
+    if magic != APP_HEADER_MAGIC:
+        return buf
+    while len(buf) % 4 != 0:
+        buf += "\x00"
+    crcfield = APP_HEADER_OFFSET + 12
+    buf = buf[:APP_HEADER_OFFSET + 8] + struct.pack("<I", len(buf)) + buf[crcfield:]
+    crc = stm32crc(buf[:crcfield] + buf[crcfield + 4:])
+    print "App header: version %d, length %d, CRC 0x%08x" % (version, len(buf), crc)
+    return buf[:crcfield] + struct.pack("<I", crc) + buf[crcfield + 4:]
+
+def checkRamImage(buf):
+    # Every block of an image run from RAM must land in the bootloader's SRAM window, the
+    # bootloader would flash or skip the others.
+    for ptr in range(0, len(buf), 512):
+        hd = struct.unpack("<IIIIIIII", buf[ptr:ptr + 32])
+        if hd[3] < RAM_IMAGE_START or hd[3] + hd[4] > RAM_IMAGE_END:
+            return "Block at 0x%x is outside the SRAM window 0x%x-0x%x, link with stm32f103x8_ram.ld" % \
+                (hd[3], RAM_IMAGE_START, RAM_IMAGE_END)
+    print "RAM image: %d of %d bytes of the SRAM window" % (len(buf) / 2, RAM_IMAGE_END - RAM_IMAGE_START)
+    return None
+
+def readPageCRCs(firstpage, numpages):
+    import usb.core
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        return None
+    crcs = []
+    # The bootloader answers at most 64 pages per request (256-byte control buffer)
+    while numpages > 0:
+        n = min(numpages, 64)
+        resp = dev.ctrl_transfer(0xc0, VENDOR_REQ_PAGE_CRC, firstpage, 0, n * 4)
+        crcs += struct.unpack("<%dI" % n, resp.tostring())
+        firstpage += n
+        numpages -= n
+    return crcs
+
+def skipUnchangedPages(buf):
+    # Drop the UF2 blocks of flash pages whose CRC on the device already matches.
+    # Only pages fully covered by the UF2 file can be compared.
+    blocks = []
+    pages = {}
+    for ptr in range(0, len(buf), 512):
+        block = buf[ptr:ptr + 512]
+        hd = struct.unpack("<IIIIIIII", block[0:32])
+        blocks.append((hd, block))
+        if hd[2] & 1:
+            continue
+        page = (hd[3] - FLASH_START) / FLASH_PAGE_SIZE
+        pages.setdefault(page, {})[hd[3] % FLASH_PAGE_SIZE] = block[32:32 + hd[4]]
+    if len(pages) == 0:
+        return buf
+    firstpage = min(pages.keys())
+    crcs = readPageCRCs(firstpage, max(pages.keys()) - firstpage + 1)
+    if crcs is None:
+        print "No bootloader found on USB, sending all pages"
+        return buf
+    same = set()
+    for page, chunks in pages.items():
+        data = "".join([chunks[off] for off in sorted(chunks.keys())])
+        if len(data) == FLASH_PAGE_SIZE and stm32crc(data) == crcs[page - firstpage]:
+            same.add(page)
+    keep = [b for b in blocks if b[0][2] & 1 or (b[0][3] - FLASH_START) / FLASH_PAGE_SIZE not in same]
+    print "Skipping %d unchanged of %d pages" % (len(same), len(pages))
+    outp = ""
+    for blockno in range(0, len(keep)):
+        hd = list(keep[blockno][0])
+        hd[5] = blockno
+        hd[6] = len(keep)
+        outp += struct.pack("<IIIIIIII", *hd) + keep[blockno][1][32:]
+    return outp
+
 def getdrives():
     drives = []
     if sys.platform == "win32":
@@ -169,6 +532,45 @@ def getdrives():
     
     return filter(hasInfo, drives)
 
+def resetToBootloader():
+    # Reset a running application into the bootloader without a button press, see src/blink/usb_drive.c:
+    # the 1200 baud touch on its serial port, else DFU_DETACH on its DFU runtime interface.
+    try:
+        import serial.tools.list_ports
+        for port in serial.tools.list_ports.comports():
+            if port.vid == USB_VID and port.pid == USB_PID:
+                print "Resetting %s into the bootloader" % port.device
+                serial.Serial(port.device, TOUCH_BAUD_RATE).close()  # Closing drops DTR
+                return True
+    except ImportError:
+        pass
+    try:
+        import usb.core
+    except ImportError:
+        return False
+    dev = usb.core.find(idVendor=USB_VID, idProduct=USB_PID)
+    if dev is None:
+        return False
+    for intf in dev.get_active_configuration():
+        if (intf.bInterfaceClass, intf.bInterfaceSubClass, intf.bInterfaceProtocol) == (0xfe, 1, 1):
+            print "Detaching the DFU runtime interface"
+            try:
+                dev.ctrl_transfer(0x21, DFU_DETACH, 1000, intf.bInterfaceNumber)
+            except usb.core.USBError:
+                pass  # The device may reset before the status stage
+            return True
+    return False
+
+def waitForDrives(timeout):
+    start = time.time()
+    while time.time() - start < timeout:
+        drives = getdrives()
+        if len(drives) > 0:
+            print "Bootloader drive found after %.1f s" % (time.time() - start)
+            return drives
+        time.sleep(0.1)
+    return []
+
 def boardID(path):
     with open(path + INFO_FILE, mode='r') as file:
         fileContent = file.read()
@@ -202,8 +604,28 @@ def main():
                         help='list connected devices')
     parser.add_argument('-c' , '--convert', action='store_true',
                         help='do not flash, just convert')
+    parser.add_argument('-s' , '--skip-unchanged', action='store_true',
+                        help='query page CRCs from the bootloader over USB and leave out pages that are already flashed')
+    parser.add_argument('-r' , '--ram', action='store_true',
+                        help='load the image into the bootloader\'s SRAM window and run it without flashing; '
+                             'sets the base address to 0x%x' % RAM_IMAGE_START)
+    parser.add_argument('-z' , '--compress', action='store_true',
+                        help='compress the flash blocks with LZ4, for bootloaders that expand UF2_FLAG_LZ4 blocks')
+    parser.add_argument('-p' , '--patch-from', metavar="BIN", dest='patch_from',
+                        help='send only patches against BIN, the image flashed now, for bootloaders that apply '
+                             'UF2_FLAG_PATCH blocks')
+    parser.add_argument('-m' , '--md5', action='store_true',
+                        help='add an MD5 of each flash page to its blocks, so that the bootloader skips pages that match')
+    parser.add_argument('-f' , '--fill-header', action='store_true',
+                        help='fill in the app header of a BIN file and write it out as BIN, e.g. after linking')
+    parser.add_argument('-n' , '--no-reset', action='store_true',
+                        help='do not reset a running application into the bootloader when no bootloader drive is found')
     args = parser.parse_args()
     appstartaddr = int(args.base, 0)
+    if args.ram:
+        appstartaddr = RAM_IMAGE_START
+        if args.skip_unchanged or args.patch_from:
+            error("--skip-unchanged and --patch-from work on flash pages, not an image run from RAM")
     if args.list:
         listdrives()
     else:
@@ -213,21 +635,44 @@ def main():
             inpbuf = file.read()
         fromUF2 = isUF2(inpbuf)
         ext = "uf2"
+        if args.fill_header:
+            if fromUF2 or isHEX(inpbuf):
+                error("--fill-header needs a BIN file")
+            writeFile(args.output or args.input, fillAppHeader(inpbuf))
+            return
         if fromUF2:
             outbuf = convertFromUF2(inpbuf)
             ext = "bin"
         elif isHEX(inpbuf):
             outbuf = convertFromHexToUF2(inpbuf)
         else:
-            outbuf = convertToUF2(inpbuf)
+            outbuf = convertToUF2(fillAppHeader(inpbuf))
         print "Converting to %s, output size: %d, start address: 0x%x" % (ext, len(outbuf), appstartaddr)
+        if args.ram and ext == "uf2":
+            msg = checkRamImage(outbuf)
+            if msg:
+                error(msg)
+        drives = []
+        if not args.convert:
+            drives = getdrives()
+            if len(drives) == 0 and not args.no_reset and resetToBootloader():
+                drives = waitForDrives(RESET_TIMEOUT)
+        if args.skip_unchanged and ext == "uf2":
+            outbuf = skipUnchangedPages(outbuf)
+            if len(outbuf) == 0:
+                print "All pages unchanged, nothing to flash."
+                return
+        if args.patch_from and ext == "uf2":
+            with open(args.patch_from, mode='rb') as file:
+                outbuf = patchUF2(outbuf, fillAppHeader(file.read()))
+        if args.compress and ext == "uf2":
+            outbuf = compressUF2(outbuf)
+        if args.md5 and ext == "uf2":
+            outbuf = md5UF2(outbuf)
 
         if args.convert:
-            drives = []
             if args.output == None:
                 args.output = "flash." + ext
-        else:
-            drives = getdrives()
         
         if args.output:
             writeFile(args.output, outbuf)
@@ -236,7 +681,7 @@ def main():
                 error("No drive to deploy.")
         for d in drives:
             print "Flashing %s (%s)" % (d, boardID(d))
-            writeFile(outbuf, d + "/NEW.UF2")
+            writeFile(d + "/NEW.UF2", outbuf)
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,389 @@
+//  USB device of the blink sample.  Copying a UF2 file to its drive hands the transfer over to the bootloader,
+//  which flashes it without the drive disconnecting, see check_uf2_handover() in uf2.h.  Flashing tools can also
+//  reset it into the bootloader without a button press: DFU_DETACH on the DFU runtime interface, or the
+//  "1200 baud touch" on the serial port, i.e. opening it at 1200 baud and closing it.
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/msc.h>
+#include <libopencm3/usb/cdc.h>
+#include <libopencm3/usb/dfu.h>
+#include <libopencm3/cm3/scb.h>
+#include <logger.h>
+#include "msc.h"  //  Before usb_conf.h, whose DATA_IN and DATA_OUT clash with the control states in it.
+#include "target.h"
+#include "usb_conf.h"
+#include "cdc.h"
+#include "uf2.h"
+#include "backup.h"
+#include "boot_mailbox.h"
+#include "flash_services.h"
+#include "usb_drive.h"
+
+#define DRIVE_INTERFACE 0
+#define COMM_INTERFACE  1  //  COMM must be immediately before DATA because of the Interface Association Descriptor.
+#define DATA_INTERFACE  2
+#define DFU_INTERFACE   3
+
+#define TOUCH_BAUD_RATE 1200  //  As the Arduino tools.
+#define USB_CDC_REQ_GET_LINE_CODING 0x21
+#define CMD_BOOT 0x544F4F42UL  //  In BKP0, see target_stm32f103.c.
+
+//  Same geometry as the bootloader's drive, see ghostfat.c, but empty.
+#define RESERVED_SECTORS 1
+#define ROOT_DIR_SECTORS 4
+#define SECTORS_PER_FAT ((UF2_NUM_BLOCKS * 2 + 511) / 512)
+#define START_FAT0 RESERVED_SECTORS
+#define START_FAT1 (START_FAT0 + SECTORS_PER_FAT)
+#define START_ROOTDIR (START_FAT1 + SECTORS_PER_FAT)
+
+static const uint8_t boot_sector[] = {
+    0xeb, 0x3c, 0x90,                         //  Jump instruction
+    'U', 'F', '2', ' ', 'U', 'F', '2', ' ',   //  OEM name
+    0x00, 0x02,                               //  Sector size 512
+    1,                                        //  Sectors per cluster
+    RESERVED_SECTORS, 0,
+    2,                                        //  FAT copies
+    (ROOT_DIR_SECTORS * 16) & 0xff, (ROOT_DIR_SECTORS * 16) >> 8,
+    (UF2_NUM_BLOCKS - 2) & 0xff, (UF2_NUM_BLOCKS - 2) >> 8,
+    0xf8,                                     //  Media descriptor
+    SECTORS_PER_FAT & 0xff, SECTORS_PER_FAT >> 8,
+    1, 0,                                     //  Sectors per track
+    1, 0,                                     //  Heads
+    0, 0, 0, 0,                               //  Hidden sectors
+    0, 0, 0, 0,                               //  Total sectors 32
+    0, 0,                                     //  Drive number, reserved
+    0x29,                                     //  Extended boot signature
+    0x43, 0x00, 0x42, 0x00,                   //  Volume serial number
+    'B', 'L', 'I', 'N', 'K', ' ', ' ', ' ', ' ', ' ', ' ',
+    'F', 'A', 'T', '1', '6', ' ', ' ', ' ',
+};
+
+static int drive_read(uint32_t lba, uint8_t *copy_to) {
+    memset(copy_to, 0, 512);
+    if (lba == 0) {
+        memcpy(copy_to, boot_sector, sizeof(boot_sector));
+        copy_to[510] = 0x55;
+        copy_to[511] = 0xaa;
+    } else if (lba == START_FAT0 || lba == START_FAT1) {
+        copy_to[0] = 0xf8;
+        memset(copy_to + 1, 0xff, 3);
+    } else if (lba == START_ROOTDIR) {
+        memcpy(copy_to, boot_sector + 43, 11);  //  Volume label
+        copy_to[11] = 0x28;
+    }
+    return 0;
+}
+
+static int drive_write(uint32_t lba, const uint8_t *copy_from) {
+    //  Only reached for blocks that are not UF2, which are dropped like in the bootloader.
+    (void) lba; (void) copy_from;
+    return 0;
+}
+
+static const struct usb_device_descriptor dev = {
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = 0xef,      //  Miscellaneous: composite device with an Interface Association Descriptor.
+    .bDeviceSubClass = 2,
+    .bDeviceProtocol = 1,
+    .bMaxPacketSize0 = MAX_USB_PACKET_SIZE,
+    .idVendor = USB_VID,
+    .idProduct = USB_PID,
+    .bcdDevice = 0x0220,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 0,
+    .bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor msc_endp[] = {{
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = MSC_OUT,
+    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+    .wMaxPacketSize = MAX_USB_PACKET_SIZE,
+    .bInterval = 0,
+}, {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = MSC_IN,
+    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+    .wMaxPacketSize = MAX_USB_PACKET_SIZE,
+    .bInterval = 0,
+}};
+
+static const struct usb_interface_descriptor msc_iface = {
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = DRIVE_INTERFACE,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 2,
+    .bInterfaceClass = USB_CLASS_MSC,
+    .bInterfaceSubClass = USB_MSC_SUBCLASS_SCSI,
+    .bInterfaceProtocol = USB_MSC_PROTOCOL_BBB,
+    .iInterface = 0,
+    .endpoint = msc_endp,
+    .extra = NULL,
+    .extralen = 0,
+};
+
+//  Serial port, for the 1200 baud touch and the commands of the app: each byte received is passed to
+//  the callback of usb_drive_setup().
+static const struct usb_endpoint_descriptor comm_endp[] = {{
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = COMM_IN,
+    .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+    .wMaxPacketSize = COMM_PACKET_SIZE,
+    .bInterval = 255,
+}};
+
+static const struct usb_endpoint_descriptor data_endp[] = {{
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = DATA_OUT,
+    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+    .wMaxPacketSize = MAX_USB_PACKET_SIZE,
+    .bInterval = 1,
+}, {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = DATA_IN,
+    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+    .wMaxPacketSize = MAX_USB_PACKET_SIZE,
+    .bInterval = 1,
+}};
+
+static const struct {
+    struct usb_cdc_header_descriptor header;
+    struct usb_cdc_call_management_descriptor call_mgmt;
+    struct usb_cdc_acm_descriptor acm;
+    struct usb_cdc_union_descriptor cdc_union;
+} __attribute__((packed)) cdcacm_functional_descriptors = {
+    .header = {
+        .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_HEADER,
+        .bcdCDC = 0x0110,
+    },
+    .call_mgmt = {
+        .bFunctionLength = sizeof(struct usb_cdc_call_management_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
+        .bmCapabilities = 0,
+        .bDataInterface = DATA_INTERFACE,
+    },
+    .acm = {
+        .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_ACM,
+        .bmCapabilities = 2,  //  SET_LINE_CODING and SET_CONTROL_LINE_STATE, for the touch.
+    },
+    .cdc_union = {
+        .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_UNION,
+        .bControlInterface = COMM_INTERFACE,
+        .bSubordinateInterface0 = DATA_INTERFACE,
+    },
+};
+
+static const struct usb_iface_assoc_descriptor cdc_iface_assoc = {
+    .bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+    .bFirstInterface = COMM_INTERFACE,
+    .bInterfaceCount = 2,
+    .bFunctionClass = USB_CLASS_CDC,
+    .bFunctionSubClass = USB_CDC_SUBCLASS_ACM,
+    .bFunctionProtocol = USB_CDC_PROTOCOL_AT,
+    .iFunction = 0,
+};
+
+static const struct usb_interface_descriptor comm_iface = {
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = COMM_INTERFACE,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 1,
+    .bInterfaceClass = USB_CLASS_CDC,
+    .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
+    .bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
+    .iInterface = 0,
+    .endpoint = comm_endp,
+    .extra = &cdcacm_functional_descriptors,
+    .extralen = sizeof(cdcacm_functional_descriptors),
+};
+
+static const struct usb_interface_descriptor data_iface = {
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = DATA_INTERFACE,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 2,
+    .bInterfaceClass = USB_CLASS_DATA,
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,
+    .iInterface = 0,
+    .endpoint = data_endp,
+};
+
+//  DFU runtime interface: only DFU_DETACH, the bootloader does the download.
+static const struct usb_dfu_descriptor dfu_function = {
+    .bLength = sizeof(struct usb_dfu_descriptor),
+    .bDescriptorType = DFU_FUNCTIONAL,
+    .bmAttributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_WILL_DETACH,
+    .wDetachTimeout = 255,
+    .wTransferSize = USB_CONTROL_BUF_SIZE,
+    .bcdDFUVersion = 0x0110,
+};
+
+static const struct usb_interface_descriptor dfu_iface = {
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = DFU_INTERFACE,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 0,
+    .bInterfaceClass = 0xfe,    //  Application specific
+    .bInterfaceSubClass = 1,    //  DFU
+    .bInterfaceProtocol = 1,    //  Runtime
+    .iInterface = 0,
+    .endpoint = NULL,
+    .extra = &dfu_function,
+    .extralen = sizeof(dfu_function),
+};
+
+static const struct usb_interface interfaces[] = {{
+    .num_altsetting = 1,
+    .altsetting = &msc_iface,
+}, {
+    .num_altsetting = 1,
+    .iface_assoc = &cdc_iface_assoc,
+    .altsetting = &comm_iface,
+}, {
+    .num_altsetting = 1,
+    .altsetting = &data_iface,
+}, {
+    .num_altsetting = 1,
+    .altsetting = &dfu_iface,
+}};
+
+static const struct usb_config_descriptor config = {
+    .bLength = USB_DT_CONFIGURATION_SIZE,
+    .bDescriptorType = USB_DT_CONFIGURATION,
+    .wTotalLength = 0,
+    .bNumInterfaces = sizeof(interfaces) / sizeof(interfaces[0]),
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = 0x80,
+    .bMaxPower = 0x32,
+    .interface = interfaces,
+};
+
+static const char *usb_strings[] = {
+    "Devanarchy",
+    "Blink",
+};
+
+static uint8_t usbd_control_buffer[USB_CONTROL_BUF_SIZE] __attribute__ ((aligned (2)));
+
+//  msc.c registers its callbacks through the bootloader's aggregator, see usb_conf.c.  The sample has no
+//  other interface, so they go to libopencm3 directly.
+int aggregate_register_config_callback(usbd_device *usbd_dev, usbd_set_config_callback callback) {
+    return usbd_register_set_config_callback(usbd_dev, callback);
+}
+
+int aggregate_register_callback(usbd_device *usbd_dev, uint8_t type, uint8_t type_mask,
+    usbd_control_callback callback) {
+    return usbd_register_control_callback(usbd_dev, type, type_mask, callback);
+}
+
+static void reboot_to_bootloader(usbd_device *usbd_dev, struct usb_setup_data *req) {
+    //  After the status stage of the request.  The bootloader's flash services pick the bootloader's way: the
+    //  boot mailbox since version 3, CMD_BOOT in the backup register before.
+    (void) usbd_dev;
+    const FlashServices *services = flash_services(3);
+    uint32_t command = (req->wIndex == DFU_INTERFACE) ? BOOT_CMD_DFU_ONLY : BOOT_CMD_MSC_ONLY;
+    if (services) { services->reboot_with_command(command, 0); }
+    services = flash_services(1);
+    if (services) { services->reboot_to_bootloader(); }
+    //  Without flash services: a bootloader that only reads BKP0.
+    backup_write(BKP0, CMD_BOOT);
+    scb_reset_system();
+}
+
+static struct usb_cdc_line_coding line_coding = {
+    .dwDTERate = 115200,
+    .bCharFormat = USB_CDC_1_STOP_BITS,
+    .bParityType = USB_CDC_NO_PARITY,
+    .bDataBits = 8,
+};
+
+static int reboot_control_request(usbd_device *usbd_dev, struct usb_setup_data *req,
+    uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete) {
+    //  Class requests of the serial port and the DFU runtime interface.  The drive's are handled by msc.c.
+    (void) usbd_dev;
+    if (req->wIndex == COMM_INTERFACE) {
+        switch (req->bRequest) {
+        case USB_CDC_REQ_SET_LINE_CODING:
+            if (*len < sizeof(line_coding)) { return USBD_REQ_NOTSUPP; }
+            memcpy(&line_coding, *buf, sizeof(line_coding));
+            return USBD_REQ_HANDLED;
+        case USB_CDC_REQ_GET_LINE_CODING:
+            *buf = (uint8_t *) &line_coding;
+            *len = sizeof(line_coding);
+            return USBD_REQ_HANDLED;
+        case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+            //  The touch: DTR dropped when the port is closed at 1200 baud.
+            if (!(req->wValue & 1) && line_coding.dwDTERate == TOUCH_BAUD_RATE) { *complete = reboot_to_bootloader; }
+            return USBD_REQ_HANDLED;
+        }
+    } else if (req->wIndex == DFU_INTERFACE) {
+        static uint8_t status[6];  //  bStatus OK, bwPollTimeout 0, bState appIDLE, iString 0
+        switch (req->bRequest) {
+        case DFU_DETACH:
+            *complete = reboot_to_bootloader;
+            return USBD_REQ_HANDLED;
+        case DFU_GETSTATUS:
+            *buf = status;
+            *len = sizeof(status);
+            return USBD_REQ_HANDLED;
+        case DFU_GETSTATE:
+            *buf = &status[4];
+            *len = 1;
+            return USBD_REQ_HANDLED;
+        }
+    }
+    return USBD_REQ_NEXT_CALLBACK;
+}
+
+static usb_drive_serial_callback serial_callback;
+
+static void serial_rx(usbd_device *usbd_dev, uint8_t ep) {
+    uint8_t packet[MAX_USB_PACKET_SIZE];
+    uint16_t len = usbd_ep_read_packet(usbd_dev, ep, packet, sizeof(packet));
+    for (uint16_t i = 0; serial_callback && i < len; i++) { serial_callback(packet[i]); }
+}
+
+static void reboot_set_config(usbd_device *usbd_dev, uint16_t wValue) {
+    (void) wValue;
+    usbd_ep_setup(usbd_dev, DATA_OUT, USB_ENDPOINT_ATTR_BULK, MAX_USB_PACKET_SIZE, serial_rx);
+    usbd_ep_setup(usbd_dev, DATA_IN, USB_ENDPOINT_ATTR_BULK, MAX_USB_PACKET_SIZE, NULL);
+    usbd_ep_setup(usbd_dev, COMM_IN, USB_ENDPOINT_ATTR_INTERRUPT, COMM_PACKET_SIZE, NULL);
+    usbd_register_control_callback(usbd_dev, USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+        USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT, reboot_control_request);
+}
+
+usbd_device* usb_drive_setup(usb_drive_serial_callback callback) {
+    serial_callback = callback;
+    usbd_device* usbd_dev = usbd_init(target_usb_init(), &dev, &config,
+        usb_strings, sizeof(usb_strings) / sizeof(const char*),
+        usbd_control_buffer, sizeof(usbd_control_buffer));
+    custom_usb_msc_init(usbd_dev, MSC_IN, MAX_USB_PACKET_SIZE, MSC_OUT, MAX_USB_PACKET_SIZE,
+        "Blink", "Blink drive", "1.0",
+        UF2_NUM_BLOCKS, drive_read, drive_write, NULL, NULL, NULL,
+        DRIVE_INTERFACE);
+    usbd_register_set_config_callback(usbd_dev, reboot_set_config);
+    debug_print("bootloader "); debug_println(uf2_info()); debug_flush();
+    return usbd_dev;
+}
@@ -0,0 +1,12 @@
+//  USB drive of the blink sample, see usb_drive.c.
+#ifndef USB_DRIVE_H_INCLUDED
+#define USB_DRIVE_H_INCLUDED
+
+#include <libopencm3/usb/usbd.h>
+
+//  Called for each byte received on the serial port, NULL to drop them.
+typedef void (*usb_drive_serial_callback)(uint8_t ch);
+
+extern usbd_device* usb_drive_setup(usb_drive_serial_callback callback);
+
+#endif  //  USB_DRIVE_H_INCLUDED
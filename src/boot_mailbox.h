@@ -0,0 +1,34 @@
+//  Boot mailbox in no-init RAM, after the boot timeline: the command for the bootloader at the next reset, e.g.
+//  from the application through the flash services, and the flash session it belongs to.  SRAM keeps its content
+//  across a reset, but the CRC is checked since an application may have used that RAM.  The bootloader falls back
+//  to the RTC backup register BKP0 when the mailbox is not valid, e.g. after a power cycle or for applications
+//  that write BKP0 themselves.  See target_stm32f103.c.
+#ifndef BOOT_MAILBOX_H_INCLUDED
+#define BOOT_MAILBOX_H_INCLUDED
+
+#include <stdint.h>
+#include "boot_timeline.h"
+
+#define BOOT_MAILBOX_BASE  (BOOT_NOINIT_BASE + 64)  //  Section .noinit of the bootloader's stm32f103x8.ld.
+#define BOOT_MAILBOX_MAGIC 0x584f424d               //  "MBOX"
+
+enum BootCommand {
+    BOOT_CMD_NONE = 0,      //  Consumed by the bootloader, only the session is left.
+    BOOT_CMD_BOOTLOADER,    //  Stay in the bootloader with all its USB interfaces.
+    BOOT_CMD_MSC_ONLY,      //  Stay in the bootloader with only the USB drive.
+    BOOT_CMD_DFU_ONLY,      //  Stay in the bootloader with only DFU.
+    BOOT_CMD_FAST_BOOT,     //  Jump to a valid application before any clock or USB setup.
+    BOOT_CMD_RUN_RAM,       //  Jump to the image a UF2 file loaded into the SRAM window, see uf2cfg.h.
+};
+
+typedef struct {
+    uint32_t magic;    //  BOOT_MAILBOX_MAGIC
+    uint32_t command;  //  enum BootCommand
+    uint32_t session;  //  Flash session chosen by the host tool or the application, 0 if none.  Passed back to
+                       //  the application started after the flashing.
+    uint32_t crc;      //  CRC-32/MPEG-2 of the words above, see target_crc32().
+} BootMailbox;
+
+#define BOOT_MAILBOX ((volatile BootMailbox *) BOOT_MAILBOX_BASE)
+
+#endif  //  BOOT_MAILBOX_H_INCLUDED
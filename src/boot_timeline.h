@@ -0,0 +1,55 @@
+//  Boot timeline kept in no-init RAM, so that the application can report the time from reset to its main().
+//  The bootloader starts the timeline and marks each boot phase, the application marks BOOT_PHASE_APP_MAIN.
+//  Both linker scripts reserve BOOT_NOINIT_BASE...BOOT_NOINIT_END so neither startup code clears it.
+#ifndef BOOT_TIMELINE_H_INCLUDED
+#define BOOT_TIMELINE_H_INCLUDED
+
+#include <stdint.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+#define BOOT_NOINIT_BASE    0x20004F00  //  Last 256 bytes of the 20 KB SRAM.
+#define BOOT_NOINIT_END     0x20005000
+#define BOOT_TIMELINE_MAGIC 0x454d4954  //  "TIME"
+#define BOOT_PHASE_NOT_REACHED 0xffffffff
+
+enum BootPhase {
+    BOOT_PHASE_MAIN = 0,   //  Bootloader main() entered.  The C runtime init before it is not counted.
+    BOOT_PHASE_DECIDED,    //  Decided between app and bootloader, before any clock/GPIO/USB setup.
+    BOOT_PHASE_CLOCK,      //  Bootloader clocks and GPIO set up (bootloader path only).
+    BOOT_PHASE_USB,        //  USB set up and polling (bootloader path only).
+    BOOT_PHASE_JUMP,       //  About to jump to the application.
+    BOOT_PHASE_APP_MAIN,   //  Application main() entered, marked by the application.
+    BOOT_PHASE_COUNT
+};
+
+typedef struct {
+    uint32_t magic;                        //  BOOT_TIMELINE_MAGIC if the timeline below is valid.
+    uint32_t reset_flags;                  //  RCC_CSR at reset, e.g. RCC_CSR_PORRSTF for power on.
+    uint32_t last_cycles;                  //  DWT_CYCCNT at the last mark.
+    uint32_t elapsed_us;                   //  Microseconds since BOOT_PHASE_MAIN at the last mark.
+    uint32_t jump_cycles_per_us;           //  Bootloader's AHB clock at BOOT_PHASE_JUMP, still running at APP_MAIN.
+    uint32_t phase_us[BOOT_PHASE_COUNT];   //  Microseconds since BOOT_PHASE_MAIN, or BOOT_PHASE_NOT_REACHED.
+} BootTimeline;
+
+_Static_assert(sizeof(BootTimeline) <= 64, "Boot timeline too big");
+
+#define BOOT_TIMELINE ((volatile BootTimeline *) BOOT_NOINIT_BASE)
+
+static inline void boot_timeline_mark(enum BootPhase phase) {
+    //  Record the time of the phase.  The cycle counter is converted at the current AHB clock,
+    //  so mark a phase right after every clock change.  The application's rcc_ahb_frequency is
+    //  still its reset default at APP_MAIN, while the clock is the one the bootloader jumped with.
+    volatile BootTimeline *t = BOOT_TIMELINE;
+    if (t->magic != BOOT_TIMELINE_MAGIC) { return; }
+    uint32_t cycles_per_us = (phase == BOOT_PHASE_APP_MAIN) ? t->jump_cycles_per_us
+                                                            : rcc_ahb_frequency / 1000000;
+    if (phase == BOOT_PHASE_JUMP) { t->jump_cycles_per_us = cycles_per_us; }
+    if (cycles_per_us == 0) { return; }  //  APP_MAIN without a jump from the bootloader.
+    uint32_t now = DWT_CYCCNT;
+    t->elapsed_us += (now - t->last_cycles) / cycles_per_us;
+    t->last_cycles = now;
+    t->phase_us[phase] = t->elapsed_us;
+}
+
+#endif  //  BOOT_TIMELINE_H_INCLUDED
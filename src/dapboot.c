@@ -32,25 +32,66 @@
 #include "config.h"
 #include "uf2.h"
 #include "backup.h"
+#include "boot_timeline.h"
+#include "boot_mailbox.h"
+#include "app_header.h"
+#include "flash_stats.h"
+#include "profile.h"
 
 static inline void __set_MSP(uint32_t topOfMainStack) {
     asm("msr msp, %0" : : "r" (topOfMainStack));
 }
 
+_Static_assert(sizeof(vector_table_t) == APP_HEADER_OFFSET, "App header must follow the vector table");
+
 bool validate_application(void) {
-    if ((*(volatile uint32_t *)APP_BASE_ADDRESS & 0x2FFE0000) == 0x20000000) {
+    if ((*(volatile uint32_t *)APP_BASE_ADDRESS & 0x2FFE0000) != 0x20000000) {
+        return false;
+    }
+    const AppHeader* header = (const AppHeader*)(APP_BASE_ADDRESS + APP_HEADER_OFFSET);
+    if (header->magic != APP_HEADER_MAGIC || header->length == 0) {
+        //  Image without a header, or one that wasn't filled in: there is nothing to check it against
+        //  but the stack pointer, see ALLOW_HEADERLESS_APP in app_header.h.
+        return ALLOW_HEADERLESS_APP;
+    }
+    //  The full CRC check only runs after the flash has been written, otherwise the verdict is cached.
+    if (target_get_app_valid_cache(header->crc32)) {
         return true;
     }
-    return false;
+    if (header->length < APP_HEADER_OFFSET + sizeof(AppHeader) || (header->length & 3) ||
+        header->length > target_get_max_firmware_size()) {
+        return false;
+    }
+    const uint32_t* image = (const uint32_t*)APP_BASE_ADDRESS;
+    const uint32_t* crc_field = &header->crc32;
+    target_crc32(image, (size_t)(crc_field - image));
+    uint32_t crc = target_crc32_update(crc_field + 1, header->length / 4 - (size_t)(crc_field + 1 - image));
+    if (crc != header->crc32) {
+        return false;
+    }
+    target_set_app_valid_cache(crc);
+    return true;
 }
 
-static void jump_to_application(void) __attribute__ ((noreturn));
+static bool validate_ram_image(void) {
+    //  An image a UF2 file loaded into the SRAM window, see ghostfat.c: a stack in SRAM and a Thumb entry point
+    //  inside the window.  The window itself is checked, the image has no app header CRC.
+    const vector_table_t* ram_vector_table = (const vector_table_t*)RAM_IMAGE_START;
+    uint32_t sp = (uint32_t)ram_vector_table->initial_sp_value;
+    uint32_t pc = (uint32_t)ram_vector_table->reset;
+    return sp > 0x20000000 && sp <= BOOT_NOINIT_BASE && (sp & 3) == 0 &&
+           (pc & 1) && pc >= RAM_IMAGE_START && pc < RAM_IMAGE_END;
+}
 
-static void jump_to_application(void) {
-    vector_table_t* app_vector_table = (vector_table_t*)APP_BASE_ADDRESS;
+static void jump_to_image(uint32_t base) __attribute__ ((noreturn));
+
+static void jump_to_image(uint32_t base) {
+    vector_table_t* app_vector_table = (vector_table_t*)base;
     
+    PROFILE_SAMPLER_STOP();
+
     /* Use the application's vector table */
-    target_relocate_vector_table();
+    target_relocate_vector_table(base);
 
     /* Do any necessary early setup for the application */
     target_pre_main();
@@ -64,67 +105,114 @@ static void jump_to_application(void) {
     while (1);
 }
 
+static void jump_to_application(void) __attribute__ ((noreturn));
+
+static void jump_to_application(void) {
+    jump_to_image(APP_BASE_ADDRESS);
+}
+
 uint32_t msTimer;
 extern int msc_started;
 
+void bootloader_poll(usbd_device* usbd_dev, bool appValid) {
+    //  Poll USB until the flashing is done and ghostfat_1ms() resets.  Also runs after a UF2 handover, see handover.c.
+    uint32_t cycleCount = 0;        
+    while (1) {
+        cycleCount++;
+        if (cycleCount >= 700) {
+            msTimer++;
+            cycleCount = 0;
+
+            int v = msTimer % 500;
+            target_set_led(v < 50);
+
+            ghostfat_1ms();
+
+            if (appValid && !msc_started && msTimer > 1000) {
+                log_info("target_manifest_app");  log_flush();
+                target_manifest_app();
+            }
+        }
+
+        PROFILE_BEGIN(SPAN_USBD_POLL);
+        usbd_poll(usbd_dev);
+        PROFILE_END(SPAN_USBD_POLL);
+    }
+}
+
+static void boot_timeline_start(void) {
+    //  Start the boot timeline in no-init RAM.  The cycle counter keeps running after a software reset, so restart it.
+    volatile BootTimeline *t = BOOT_TIMELINE;
+    dwt_enable_cycle_counter();
+    DWT_CYCCNT = 0;
+    t->reset_flags = RCC_CSR;
+    t->last_cycles = 0;
+    t->elapsed_us = 0;
+    t->jump_cycles_per_us = 0;
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) { t->phase_us[i] = BOOT_PHASE_NOT_REACHED; }
+    t->magic = BOOT_TIMELINE_MAGIC;
+    boot_timeline_mark(BOOT_PHASE_MAIN);
+}
+
 int main(void) {
-    bool appValid = false;
-#ifdef SKIP_BOOTLOADER
-    appValid = validate_application();
-    if (appValid && target_get_force_app()) {
-         jump_to_application();
-         return 0;
+    boot_timeline_start();
+
+    //  An image loaded into SRAM by the last UF2 file runs once, the next reset goes back to the bootloader.
+    if (target_get_boot_command() == BOOT_CMD_RUN_RAM && validate_ram_image()) {
+        boot_timeline_mark(BOOT_PHASE_DECIDED);
+        boot_timeline_mark(BOOT_PHASE_JUMP);
+        jump_to_image(RAM_IMAGE_START);
+        return 0;
     }
-#endif  //  SKIP_BOOTLOADER         
+
+    //  Fast path: decide before any clock, GPIO or USB setup, running on the 8 MHz HSI.
+    bool appValid = validate_application();
+    if (appValid && target_get_fast_boot()) {
+        boot_timeline_mark(BOOT_PHASE_DECIDED);
+        boot_timeline_mark(BOOT_PHASE_JUMP);
+        jump_to_application();
+        return 0;
+    }
+    boot_timeline_mark(BOOT_PHASE_DECIDED);
     
     //  enable_debug();       //  Uncomment to allow display of debug messages in development devices. NOTE: This will hang if no debugger is attached.
     disable_debug();  //  Uncomment to disable display of debug messages.  For use in production devices.
     platform_setup();     //  STM32 platform setup.
-    debug_println("----bootloader");  // debug_flush();
+    boot_timeline_mark(BOOT_PHASE_CLOCK);
+    PROFILE_SAMPLER_START();
+    log_info("----bootloader");
     
     //  target_clock_setup();  //  Clock already setup in platform_setup()
     target_gpio_setup();       //  Initialize GPIO/LEDs if needed
+    flash_stats_init();        //  Load the flash statistics for INFO_UF2.TXT.
     // test_backup();          //  Test backup.
 
-    debug_println("target_get_force_bootloader");  // debug_flush();
+    log_info("target_get_force_bootloader");
     if (target_get_force_bootloader() || !appValid) {        
         {  //  Setup USB
             char serial[USB_SERIAL_NUM_LENGTH+1];
             serial[0] = '\0';
-            debug_println("target_get_serial_number");  // debug_flush();
+            log_info("target_get_serial_number");
             target_get_serial_number(serial, USB_SERIAL_NUM_LENGTH);
 
-            debug_println("usb_set_serial_number");  // debug_flush();
+            log_info("usb_set_serial_number");
             usb_set_serial_number(serial);
         }
-        debug_println("usb_setup");  // debug_flush();
-        usbd_device* usbd_dev = usb_setup();
+        log_info("usb_setup");
+        uint32_t command = target_get_boot_command();
+        usbd_device* usbd_dev = usb_setup(
+            command == BOOT_CMD_MSC_ONLY ? USB_FUNCTIONS_MSC_ONLY :
+            command == BOOT_CMD_DFU_ONLY ? USB_FUNCTIONS_DFU_ONLY :
+            USB_FUNCTIONS_ALL);
         gpio_set(GPIOA, GPIO10);
         gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_10_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO10);
 
-        debug_println("usbd polling...");  debug_flush();  ////
-        uint32_t cycleCount = 0;        
-        while (1) {
-            cycleCount++;
-            if (cycleCount >= 700) {
-                msTimer++;
-                cycleCount = 0;
-
-                int v = msTimer % 500;
-                target_set_led(v < 50);
-
-                ghostfat_1ms();
-
-                if (appValid && !msc_started && msTimer > 1000) {
-                    debug_println("target_manifest_app");  debug_flush();
-                    target_manifest_app();
-                }
-            }
-
-            usbd_poll(usbd_dev);
-        }
+        boot_timeline_mark(BOOT_PHASE_USB);
+        log_info("usbd polling...");  log_flush();  ////
+        bootloader_poll(usbd_dev, appValid);
     } else {
-        debug_println("jump_to_application");  debug_flush();
+        log_info("jump_to_application");  log_flush();
+        boot_timeline_mark(BOOT_PHASE_JUMP);
         jump_to_application();
     }    
     return 0;
@@ -19,6 +19,10 @@
 #ifndef DAPBOOT_H_INCLUDED
 #define DAPBOOT_H_INCLUDED
 
+#include <stdbool.h>
+#include <libopencm3/usb/usbd.h>
+
 extern bool validate_application(void);
+extern void bootloader_poll(usbd_device* usbd_dev, bool appValid) __attribute__ ((noreturn));
 
 #endif
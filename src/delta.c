@@ -0,0 +1,37 @@
+//  Delta patches, see delta.h.  The instructions, like VCDIFF's:
+//    ADD   0x00-0x7f: n = op + 1 bytes follow, copied to the output.
+//    COPY  0x80-0xbf: n = ((op & 0x3f) << 8 | next byte) + 1 bytes copied from the flash, at the 16-bit
+//          little-endian offset from USER_FLASH_START that follows.
+//  The host tool, uf2conv.py --patch-from, sends the pages in order: the pages before the one being
+//  rebuilt hold their new contents, the others their old contents.
+#include <string.h>
+#include "uf2.h"
+#include "delta.h"
+
+_Static_assert(USER_FLASH_END - USER_FLASH_START <= 0x10000, "COPY offsets are 16 bits");
+
+int delta_apply(const uint8_t *patch, uint32_t len, uint8_t *dst, uint32_t dst_len) {
+    const uint8_t *ip = patch, *end = patch + len;
+    uint32_t out = 0;
+    while (ip < end) {
+        uint8_t op = *ip++;
+        if (op < 0x80) {
+            uint32_t n = op + 1u;
+            if (n > (uint32_t)(end - ip) || n > dst_len - out) { return -1; }
+            memcpy(dst + out, ip, n);
+            ip += n;
+            out += n;
+        } else if (op < 0xc0) {
+            if (end - ip < 3) { return -1; }
+            uint32_t n = (((op & 0x3fu) << 8) | ip[0]) + 1;
+            uint32_t from = USER_FLASH_START + (ip[1] | (ip[2] << 8));
+            ip += 3;
+            if (n > dst_len - out || from + n > USER_FLASH_END) { return -1; }
+            memcpy(dst + out, (const void *) from, n);
+            out += n;
+        } else {
+            return -1;
+        }
+    }
+    return (int) out;
+}
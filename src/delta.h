@@ -0,0 +1,13 @@
+//  Delta patches for the UF2_FLAG_PATCH blocks, see uf2.h: a new flash page rebuilt from the current
+//  flash and the patch.
+#ifndef DELTA_H_INCLUDED
+#define DELTA_H_INCLUDED
+
+#include <stdint.h>
+
+//  Runs the patch instructions into dst and returns the bytes written, or -1 if the patch is corrupt or
+//  would overflow dst.  COPY reads the flash as it is now, so the page being rebuilt still reads as its
+//  old contents until the page cache is flushed.
+extern int delta_apply(const uint8_t *patch, uint32_t len, uint8_t *dst, uint32_t dst_len);
+
+#endif  //  DELTA_H_INCLUDED
@@ -79,7 +79,7 @@ static inline void dfu_set_status(enum dfu_status status) {
             dfu_set_state(STATE_DFU_IDLE);
         }
     } else {
-        debug_println("STATE_DFU_ERROR"); debug_flush(); ////
+        log_warn("STATE_DFU_ERROR"); log_flush(); ////
         dfu_set_state(STATE_DFU_ERROR);
     }
     current_dfu_status = status;
@@ -111,7 +111,7 @@ static void dfu_on_download_request(usbd_device* usbd_dev, struct usb_setup_data
            we would have to remember that we already programmed this block */
         dfu_set_state(STATE_DFU_DNLOAD_IDLE);
     } else {
-        debug_println("DFU_STATUS_ERR_VERIFY"); debug_flush(); ////
+        log_warn("DFU_STATUS_ERR_VERIFY"); log_flush(); ////
         dfu_set_status(DFU_STATUS_ERR_VERIFY);
     }
 }
@@ -122,7 +122,7 @@ static void dfu_on_manifest_request(usbd_device* usbd_dev, struct usb_setup_data
     if (dfu_manifest_request_callback) {
         dfu_manifest_request_callback();
     } else {
-        debug_println("DFU_STATUS_ERR_UNKNOWN"); debug_flush(); ////
+        log_warn("DFU_STATUS_ERR_UNKNOWN"); log_flush(); ////
         dfu_set_status(DFU_STATUS_ERR_UNKNOWN);
     }
 }
@@ -161,7 +161,7 @@ static int dfu_control_class_request(usbd_device *usbd_dev,
                         dfu_set_state(STATE_DFU_MANIFEST);
                         *complete = &dfu_on_manifest_request;
                     } else {
-                        debug_println("DFU_STATUS_ERR_FIRMWARE"); debug_flush(); ////
+                        log_warn("DFU_STATUS_ERR_FIRMWARE"); log_flush(); ////
                         dfu_set_status(DFU_STATUS_ERR_FIRMWARE);
                     }
                     break;
@@ -194,7 +194,7 @@ static int dfu_control_class_request(usbd_device *usbd_dev,
                         memcpy(dfu_download_buffer, *buf, dfu_download_size);
                         dfu_set_state(STATE_DFU_DNLOAD_SYNC);
                     } else {
-                        debug_println("DFU_STATUS_ERR_STALLEDPKT"); debug_flush(); ////
+                        log_warn("DFU_STATUS_ERR_STALLEDPKT"); log_flush(); ////
                         dfu_set_status(DFU_STATUS_ERR_STALLEDPKT);
                         usbd_ep_stall_set(usbd_dev, 0x00, 1);
                     }
@@ -264,7 +264,7 @@ static int dfu_control_class_request(usbd_device *usbd_dev,
         case DFU_DETACH:
         default: {
             /* Stall the control pipe */
-            debug_println("DFU_STATUS_ERR_STALLEDPKT"); debug_flush(); ////
+            log_warn("DFU_STATUS_ERR_STALLEDPKT"); log_flush(); ////
             dfu_set_status(DFU_STATUS_ERR_STALLEDPKT);
             usbd_ep_stall_set(usbd_dev, 0x00, 1);
             status = USBD_REQ_NOTSUPP;
@@ -283,7 +283,7 @@ static void dfu_set_config(usbd_device* usbd_dev, uint16_t wValue) {
         CONTROL_CALLBACK_TYPE,
         CONTROL_CALLBACK_MASK,
         dfu_control_class_request);        
-	if (status < 0) { debug_println("*** dfu_set_config failed"); debug_flush(); }
+	if (status < 0) { log_error("*** dfu_set_config failed"); log_flush(); }
 }
 
 void dfu_setup(usbd_device* usbd_dev,
@@ -301,11 +301,11 @@ void dfu_setup(usbd_device* usbd_dev,
         CONTROL_CALLBACK_TYPE,
         CONTROL_CALLBACK_MASK,
         dfu_control_class_request);        
-	if (status < 0) { debug_println("*** dfu_setup failed"); debug_flush(); }
+	if (status < 0) { log_error("*** dfu_setup failed"); log_flush(); }
 
     //  Re-register the callback in case the USB restarts.
     status = aggregate_register_config_callback(usbd_dev, dfu_set_config);
-    if (status < 0) { debug_println("*** dfu_setup failed"); debug_flush(); }
+    if (status < 0) { log_error("*** dfu_setup failed"); log_flush(); }
 
     current_dfu_state = STATE_DFU_IDLE;
     current_dfu_status = DFU_STATUS_OK;
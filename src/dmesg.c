@@ -23,148 +23,30 @@ DEALINGS IN THE SOFTWARE.
 */
 
 #include "dmesg.h"
-#include <string.h>
-#include "libopencm3/cm3/cortex.h"
 
-CodalLogStore codalLogStore;
+#if DEVICE_DMESG_BUFFER_SIZE > 0
 
-static void logwrite(const char *msg);
+CodalLogStore codalLogStore = { .size = DMESG_BUFFER_WORDS };
 
-static void logwriten(const char *msg, int l)
+void codal_dmesg_write(uint32_t header, uint32_t a0, uint32_t a1, uint32_t a2)
 {
-    if (codalLogStore.ptr + l >= sizeof(codalLogStore.buffer))
-    {
-        const int jump = sizeof(codalLogStore.buffer) / 4;
-        codalLogStore.ptr -= jump;
-        memmove(codalLogStore.buffer, codalLogStore.buffer + jump, codalLogStore.ptr);
-        // zero-out the rest so it looks OK in the debugger
-        memset(codalLogStore.buffer + codalLogStore.ptr, 0, sizeof(codalLogStore.buffer) - codalLogStore.ptr);
-    }
-    if (l + codalLogStore.ptr >= sizeof(codalLogStore.buffer))
-    {
-        logwrite("DMESG line too long!\n");
-        return;
-    }
-    memcpy(codalLogStore.buffer + codalLogStore.ptr, msg, l);
-    codalLogStore.ptr += l;
-    codalLogStore.buffer[codalLogStore.ptr] = 0;
+    const uint32_t args[DMESG_MAX_ARGS] = { a0, a1, a2 };
+    const uint32_t nargs = header & 3;
+    uint32_t head = codalLogStore.head;
+    uint32_t tail = codalLogStore.tail;
+
+    // drop the oldest records that the new one will overwrite
+    while (head + 1 + nargs - tail > DMESG_BUFFER_WORDS)
+        tail += 1 + (codalLogStore.buffer[tail % DMESG_BUFFER_WORDS] & 3);
+    codalLogStore.tail = tail;
+
+    codalLogStore.buffer[head++ % DMESG_BUFFER_WORDS] = header;
+    for (uint32_t i = 0; i < nargs; i++)
+        codalLogStore.buffer[head++ % DMESG_BUFFER_WORDS] = args[i];
+
+    // publish the record only after it's complete
+    __asm__ volatile("" ::: "memory");
+    codalLogStore.head = head;
 }
 
-static void logwrite(const char *msg)
-{
-    logwriten(msg, strlen(msg));
-}
-
-static void writeDecNum(char *buf, int32_t n)
-{
-    if (n < 0) {
-        *buf++ = '-';
-        n = -n;
-    }
-
-    if (n == 0) {
-        *buf++ = '0';
-        *buf++ = 0;
-        return;
-    }
-
-    char tmp[20];
-    int i = 0;
-    while (n > 0) {
-        tmp[i++] = (n % 10) + '0';
-        n /= 10;
-    }
-
-    while (--i > 0) {
-        *buf++ = tmp[i];
-    }
-
-    *buf = 0;
-}
-
-static void writeNum(char *buf, uint32_t n, bool full)
-{
-    int i = 0;
-    int sh = 28;
-    while (sh >= 0)
-    {
-        int d = (n >> sh) & 0xf;
-        if (full || d || sh == 0 || i)
-        {
-            buf[i++] = d > 9 ? 'A' + d - 10 : '0' + d;
-        }
-        sh -= 4;
-    }
-    buf[i] = 0;
-}
-
-static void logwritenum(uint32_t n, bool full, bool hex)
-{
-    char buff[20];
-
-    if (hex)
-    {
-        writeNum(buff, n, full);
-        logwrite("0x");
-    }
-    else
-    {
-        writeDecNum(buff, n);
-    }
-
-    logwrite(buff);
-}
-
-void codal_dmesg(const char *format, ...)
-{
-    va_list arg;
-    va_start(arg, format);
-    codal_vdmesg(format, arg);
-    va_end(arg);
-}
-
-void codal_vdmesg(const char *format, va_list ap)
-{
-    const char *end = format;
-
-    CM_ATOMIC_BLOCK() {
-
-        while (*end)
-        {
-            if (*end++ == '%')
-            {
-                logwriten(format, end - format - 1);
-                uint32_t val = va_arg(ap, uint32_t);
-                switch (*end++)
-                {
-                case 'c':
-                    logwriten((const char *)&val, 1);
-                    break;
-                case 'd':
-                    logwritenum(val, false, false);
-                    break;
-                case 'x':
-                    logwritenum(val, false, true);
-                    break;
-                case 'p':
-                case 'X':
-                    logwritenum(val, true, true);
-                    break;
-                case 's':
-                    logwrite((char *)(void *)val);
-                    break;
-                case '%':
-                    logwrite("%");
-                    break;
-                default:
-                    logwrite("???");
-                    break;
-                }
-                format = end;
-            }
-        }
-        logwriten(format, end - format);
-        logwrite("\n");
-
-    }
-}
+#endif
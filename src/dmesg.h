@@ -30,21 +30,49 @@ DEALINGS IN THE SOFTWARE.
 #if DEVICE_DMESG_BUFFER_SIZE > 0
 
 #include <stdint.h>
-#include <stdarg.h>
 
 #if DEVICE_DMESG_BUFFER_SIZE < 256
 #error "Too small DMESG buffer"
 #endif
 
+#if (DEVICE_DMESG_BUFFER_SIZE & (DEVICE_DMESG_BUFFER_SIZE - 1)) != 0
+#error "DMESG buffer size must be a power of 2"
+#endif
+
+#define DMESG_BUFFER_WORDS (DEVICE_DMESG_BUFFER_SIZE / 4)
+#define DMESG_MAX_ARGS 3
+
+/**
+  * Ring of binary log records.  Each record is one header word followed by
+  * its raw 32-bit arguments.  The header is the ID of the format string
+  * (its address in the .dmesg_fmt section, which is not loaded into flash)
+  * with the argument count in the low 2 bits.
+  *
+  * There is a single producer (the main loop) so no interrupt masking is
+  * needed: the record is written first and published by advancing head.
+  * tail always points at the oldest complete record.  Both are free-running
+  * word counts, the buffer index is (count % DMESG_BUFFER_WORDS).
+  */
 typedef struct CodalLogStore
 {
-    uint32_t ptr;
-    char buffer[DEVICE_DMESG_BUFFER_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t size;
+    uint32_t buffer[DMESG_BUFFER_WORDS];
 } CodalLogStore;
 extern CodalLogStore codalLogStore;
 
+void codal_dmesg_write(uint32_t header, uint32_t a0, uint32_t a1, uint32_t a2);
+
+#define DMESG_NARGS(...) DMESG_NARGS_(0, ##__VA_ARGS__, 3, 2, 1, 0)
+#define DMESG_NARGS_(_0, _1, _2, _3, n, ...) n
+#define DMESG_ARGS(...) DMESG_ARGS_(0, ##__VA_ARGS__, 0, 0, 0, 0)
+#define DMESG_ARGS_(_0, a0, a1, a2, ...) (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2)
+
 /**
-  * Log formatted message to an internal buffer.
+  * Log a message to the internal ring without formatting it on the device.
+  * The format string only exists in the ELF file and is rendered by the
+  * host, see scripts/dmesg_decode.py.  At most 3 arguments.
   *
   * Supported format strings:
   *    %c - single character
@@ -52,11 +80,8 @@ extern CodalLogStore codalLogStore;
   *    %x - hexadecimal number (with 0x)
   *    %p - hexadecimal number padded with zeros (and with 0x)
   *    %X - hexadecimal number padded with zeros (and with 0x)
-  *    %s - '\0'-terminated string
+  *    %s - '\0'-terminated string, only if it's in flash
   *    %% - literal %
-  * Typically used via the DMESG() macro.
-  *
-  * @param format Format string
   *
   * @code
   * uint32_t k;
@@ -65,10 +90,11 @@ extern CodalLogStore codalLogStore;
   * DMESG("USB: Error #%d at %X", k, ptr);
   * @endcode
   */
-void codal_dmesg(const char *format, ...);
-void codal_vdmesg(const char *format, va_list ap);
-
-#define DMESG  codal_dmesg
+#define DMESG(fmt, ...) do { \
+        static const char dmesg_fmt[] __attribute__((section(".dmesg_fmt"), aligned(4), used)) = fmt; \
+        _Static_assert(DMESG_NARGS(__VA_ARGS__) <= DMESG_MAX_ARGS, "Too many DMESG arguments"); \
+        codal_dmesg_write((uint32_t)dmesg_fmt | DMESG_NARGS(__VA_ARGS__), DMESG_ARGS(__VA_ARGS__)); \
+    } while (0)
 
 #else
 
@@ -0,0 +1,115 @@
+//  Flash services for applications, see flash_services.h.  They run on the application's stack after the
+//  bootloader has jumped to the application, so they must not touch the bootloader's RAM: no statics, no
+//  flash statistics and no logging.
+#include <stdbool.h>
+#include <libopencm3/stm32/flash.h>
+#include "app_header.h"
+#include "flash_services.h"
+#include "target.h"
+#include "uf2cfg.h"
+
+static bool in_app_flash(uint32_t address, size_t length) {
+    return address >= USER_FLASH_START && address <= USER_FLASH_END && length <= USER_FLASH_END - address;
+}
+
+//  Like target_flash_unlock(), but keep the app valid cache unless the range overlaps the image the header
+//  covers: an application writing its own data pages must not cost a full CRC check on the next boot.
+static void unlock_range(uint32_t address, size_t length) {
+    const AppHeader *header = (const AppHeader *) (APP_BASE_ADDRESS + APP_HEADER_OFFSET);
+    //  in_app_flash() has checked address >= APP_BASE_ADDRESS.
+    if (length > 0 && header->magic == APP_HEADER_MAGIC && address - APP_BASE_ADDRESS < header->length) {
+        target_set_app_valid_cache(0);
+    }
+    flash_unlock();
+}
+
+static int program_half_words(uint16_t *dest, const uint16_t *data, size_t count) {
+    for (; count > 0; dest++, data++, count--) {
+        if (*dest == *data) { continue; }
+        if (*dest != 0xffff) { return FLASH_SERVICES_ERR_ERASED; }
+        flash_program_half_word((uint32_t) dest, *data);
+        if (*dest != *data) { return FLASH_SERVICES_ERR_VERIFY; }
+    }
+    return FLASH_SERVICES_OK;
+}
+
+static int svc_flash_erase_page(uint32_t page) {
+    if ((page % FLASH_PAGE_SIZE) || !in_app_flash(page, FLASH_PAGE_SIZE)) { return FLASH_SERVICES_ERR_RANGE; }
+    unlock_range(page, FLASH_PAGE_SIZE);
+    flash_erase_page(page);
+    flash_lock();
+    const uint32_t *p = (const uint32_t *) page;
+    for (size_t i = 0; i < FLASH_PAGE_SIZE / 4; i++) {
+        if (p[i] != 0xffffffff) { return FLASH_SERVICES_ERR_VERIFY; }
+    }
+    return FLASH_SERVICES_OK;
+}
+
+static int svc_flash_program(uint32_t address, const void *data, size_t length) {
+    if ((address & 1) || (length & 1) || ((uint32_t) data & 1) || !in_app_flash(address, length)) {
+        return FLASH_SERVICES_ERR_RANGE;
+    }
+    unlock_range(address, length);
+    int result = program_half_words((uint16_t *) address, data, length / 2);
+    flash_lock();
+    return result;
+}
+
+static int svc_flash_write_page(uint32_t page, const void *data) {
+    if ((page % FLASH_PAGE_SIZE) || ((uint32_t) data & 1) || !in_app_flash(page, FLASH_PAGE_SIZE)) {
+        return FLASH_SERVICES_ERR_RANGE;
+    }
+    const uint16_t *current = (const uint16_t *) page;
+    const uint16_t *wanted = data;
+    bool changed = false, erase = false;
+    for (size_t i = 0; i < FLASH_PAGE_SIZE / 2; i++) {
+        if (current[i] == wanted[i]) { continue; }
+        changed = true;
+        if (current[i] != 0xffff) { erase = true; break; }
+    }
+    if (!changed) { return FLASH_SERVICES_OK; }
+    unlock_range(page, FLASH_PAGE_SIZE);
+    if (erase) { flash_erase_page(page); }
+    int result = program_half_words((uint16_t *) page, wanted, FLASH_PAGE_SIZE / 2);
+    flash_lock();
+    return result;
+}
+
+static uint32_t svc_crc32(const uint32_t *data, size_t word_count) {
+    return target_crc32(data, word_count);
+}
+
+static uint32_t svc_crc32_update(const uint32_t *data, size_t word_count) {
+    return target_crc32_update(data, word_count);
+}
+
+static void svc_reboot_to_bootloader(void) {
+    target_manifest_bootloader();
+}
+
+static void svc_reboot_with_command(uint32_t command, uint32_t session) {
+    target_manifest_command(command, session);
+}
+
+static uint32_t svc_boot_session(void) {
+    return target_get_boot_session();
+}
+
+//  Placed by the linker script at FLASH_SERVICES.  Only append entries, applications index them by offset.
+const FlashServices flash_services_table __attribute__((section(".flash_services"), used)) = {
+    FLASH_SERVICES_MAGIC,
+    FLASH_SERVICES_VERSION,
+    sizeof(FlashServices),
+    svc_flash_write_page,
+    svc_flash_program,
+    svc_flash_erase_page,
+    svc_crc32,
+    svc_crc32_update,
+    svc_reboot_to_bootloader,
+    kv_open,
+    kv_get,
+    kv_put,
+    kv_delete,
+    svc_reboot_with_command,
+    svc_boot_session,
+};
@@ -0,0 +1,66 @@
+//  Flash services the bootloader exports to applications: a versioned table of functions at a fixed address
+//  below the application, so applications need not carry their own flash code.  See flash_services.c.
+#ifndef FLASH_SERVICES_H_INCLUDED
+#define FLASH_SERVICES_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include "config.h"
+#include "kv_store.h"
+
+#define FLASH_SERVICES_MAGIC   0x53564346  //  "FCVS"
+#define FLASH_SERVICES_VERSION 3           //  Bumped when functions are added at the end.  Never reordered.
+#define FLASH_SERVICES_SIZE    64          //  Room reserved by the linker script, see stm32f103x8.ld.
+
+//  Return codes of the flash functions.
+#define FLASH_SERVICES_OK            0
+#define FLASH_SERVICES_ERR_RANGE    -1  //  Outside the application flash, or not half-word or page aligned.
+#define FLASH_SERVICES_ERR_ERASED   -2  //  A half-word to change is not erased, erase the page first.
+#define FLASH_SERVICES_ERR_VERIFY   -3  //  The flash did not read back the data programmed.
+
+typedef struct {
+    uint32_t magic;    //  FLASH_SERVICES_MAGIC
+    uint16_t version;  //  FLASH_SERVICES_VERSION of the bootloader.
+    uint16_t size;     //  sizeof(FlashServices) in the bootloader.
+
+    //  Version 1.  Flash addresses must be in the application flash, between APP_BASE_ADDRESS and the pages
+    //  the bootloader reserves at the end.
+    //  Write a whole page, differentially: an identical page is left alone and the erase is skipped when the
+    //  half-words that change are still erased.  page and data must be page and half-word aligned.
+    int (*flash_write_page)(uint32_t page, const void *data);
+    //  Program erased flash, e.g. to append to a log.  Half-words that already hold the data are skipped.
+    int (*flash_program)(uint32_t address, const void *data, size_t length);
+    int (*flash_erase_page)(uint32_t page);
+    //  CRC-32/MPEG-2 on the CRC unit, as checked by the bootloader for the app header.
+    uint32_t (*crc32)(const uint32_t *data, size_t word_count);
+    uint32_t (*crc32_update)(const uint32_t *data, size_t word_count);
+    //  Reset into the bootloader's USB drive.  Does not return.
+    void (*reboot_to_bootloader)(void);
+
+    //  Version 2.  The key-value store in the pages the bootloader reserves, see kv_store.h.  The KvStore is
+    //  in the application's RAM, so its layout is part of this interface.
+    int (*kv_open)(KvStore *kv);
+    int (*kv_get)(const KvStore *kv, uint16_t key, void *value, uint16_t size);
+    int (*kv_put)(KvStore *kv, uint16_t key, const void *value, uint16_t length);
+    int (*kv_delete)(KvStore *kv, uint16_t key);
+
+    //  Version 3.  Reset with a command for the bootloader in the boot mailbox, e.g. BOOT_CMD_MSC_ONLY, see
+    //  boot_mailbox.h.  The session is passed back to the application started after the flashing.  Does not return.
+    void (*reboot_with_command)(uint32_t command, uint32_t session);
+    //  Session the application was started with, 0 if none.
+    uint32_t (*boot_session)(void);
+} FlashServices;
+
+_Static_assert(sizeof(FlashServices) <= FLASH_SERVICES_SIZE, "Flash services table too big");
+
+//  Right below UF2_BInfo, see uf2.h.
+#define FLASH_SERVICES ((const FlashServices *)(APP_BASE_ADDRESS - 16 - FLASH_SERVICES_SIZE))
+
+//  Returns the flash services of the bootloader, or NULL if it is older than the version needed.
+static inline const FlashServices *flash_services(uint16_t version) {
+    const FlashServices *services = FLASH_SERVICES;
+    if (services->magic != FLASH_SERVICES_MAGIC || services->version < version) { return NULL; }
+    return services;
+}
+
+#endif  //  FLASH_SERVICES_H_INCLUDED
@@ -0,0 +1,178 @@
+//  Persistent flash wear and flashing statistics.  The stats page is a log: a checkpoint with the
+//  totals, followed by 8-byte entries appended as counts change.  When the page is full it is erased
+//  and a new checkpoint written, so the page is erased once per dozen or so flashing sessions.
+#include <string.h>
+#include <logger.h>
+#include "target.h"
+#include "flash_stats.h"
+
+#define FLASH_STATS_MAGIC 0x54415453  //  "STAT"
+
+//  Entry tag: type in the top byte, argument in the rest.  The tag is programmed after the value,
+//  so an entry interrupted by a reset reads as the end of the log.
+#define ENTRY_SESSION_START 0x01  //  A UF2 session wrote its first block.
+#define ENTRY_SESSION_END   0x02  //  The session completed and the device resets into the app.
+#define ENTRY_BYTES         0x03  //  value: bytes written.
+#define ENTRY_SKIPPED       0x04  //  value: pages skipped.
+#define ENTRY_ERASES        0x05  //  arg: first page, value: erase counts of 4 pages, 8 bits each.
+#define ENTRY_END           0xff  //  Erased flash.
+#define ENTRY_TAG(type, arg) (((uint32_t)(type) << 24) | (arg))
+
+typedef struct {
+    uint32_t tag;
+    uint32_t value;
+} LogEntry;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t session_open;  //  Non-zero if a session was in progress when the checkpoint was written.
+    FlashStats stats;
+} Checkpoint;
+
+#define LOG_START ((sizeof(Checkpoint) + sizeof(LogEntry) - 1) / sizeof(LogEntry) * sizeof(LogEntry))
+#define MAX_ENTRIES (3 + FLASH_STATS_PAGES / 4 + 1)  //  Largest batch written by save_pending().
+
+FlashStats flashStats;
+static uint8_t pendingErases[FLASH_STATS_PAGES];  //  Erases not saved yet, saturates at 255.
+static uint32_t pendingBytes;
+static uint32_t pendingSkipped;
+static bool pending;
+static bool sessionOpen;
+static uint32_t logOffset;  //  Offset of the next free entry in the stats page, 0 if the page has no checkpoint.
+static uint32_t nowMs;
+static uint32_t lastSaveMs;
+
+void flash_stats_init(void) {
+    //  Replay the log in the stats page to get the totals.
+    const Checkpoint *cp = (const Checkpoint *)FLASH_STATS_PAGE;
+    memset(&flashStats, 0, sizeof(flashStats));
+    logOffset = 0;
+    if (cp->magic != FLASH_STATS_MAGIC) { return; }  //  Never written.
+    flashStats = cp->stats;
+    bool open = cp->session_open != 0;
+    uint32_t offset;
+    for (offset = LOG_START; offset + sizeof(LogEntry) <= FLASH_PAGE_SIZE; offset += sizeof(LogEntry)) {
+        const LogEntry *e = (const LogEntry *)(FLASH_STATS_PAGE + offset);
+        uint32_t arg = e->tag & 0xffffff;
+        switch (e->tag >> 24) {
+            case ENTRY_SESSION_START:
+                if (open) { flashStats.aborted_sessions++; }
+                flashStats.sessions++;
+                open = true;
+                break;
+            case ENTRY_SESSION_END: open = false; break;
+            case ENTRY_BYTES: flashStats.bytes_written += e->value; break;
+            case ENTRY_SKIPPED: flashStats.pages_skipped += e->value; break;
+            case ENTRY_ERASES:
+                for (uint32_t i = 0; i < 4 && arg + i < FLASH_STATS_PAGES; i++) {
+                    flashStats.page_erases[arg + i] += (e->value >> (8 * i)) & 0xff;
+                }
+                break;
+        }
+        if ((e->tag >> 24) == ENTRY_END) { break; }
+    }
+    //  The previous boot ended without completing its session.
+    if (open) { flashStats.aborted_sessions++; }
+    logOffset = offset;
+}
+
+void flash_stats_count_erase(uint32_t page_address) {
+    //  Called by the flash driver for every page erase, including the stats page itself.
+    uint32_t page = (page_address - 0x08000000) / FLASH_PAGE_SIZE;
+    if (page >= FLASH_STATS_PAGES) { return; }
+    flashStats.page_erases[page]++;
+    if (pendingErases[page] < 0xff) { pendingErases[page]++; }
+    pending = true;
+}
+
+void flash_stats_count_write(uint32_t bytes) {
+    flashStats.bytes_written += bytes;
+    pendingBytes += bytes;
+    pending = true;
+}
+
+void flash_stats_count_skip(void) {
+    flashStats.pages_skipped++;
+    pendingSkipped++;
+    pending = true;
+}
+
+static void write_checkpoint(void) {
+    //  Start a new log with the current totals.  The erase is counted in the checkpoint itself.
+    Checkpoint cp;
+    target_flash_erase_page((uint16_t *)FLASH_STATS_PAGE);
+    memset(pendingErases, 0, sizeof(pendingErases));
+    pendingBytes = 0;
+    pendingSkipped = 0;
+    pending = false;
+    cp.magic = FLASH_STATS_MAGIC;
+    cp.session_open = sessionOpen;
+    cp.stats = flashStats;
+    //  Magic last, so a checkpoint interrupted by a reset is ignored.
+    target_flash_append_array((uint16_t *)(FLASH_STATS_PAGE + 4), (const uint16_t *)&cp + 2, (sizeof(cp) - 4) / 2);
+    target_flash_append_array((uint16_t *)FLASH_STATS_PAGE, (const uint16_t *)&cp, 2);
+    logOffset = LOG_START;
+}
+
+static void append_entries(const LogEntry *entries, int count) {
+    //  Append the entries to the log, or start a new log if they don't fit.  Counts must already be in flashStats.
+    target_flash_unlock();
+    if (logOffset == 0 || logOffset + count * sizeof(LogEntry) > FLASH_PAGE_SIZE) {
+        write_checkpoint();
+    } else {
+        for (int i = 0; i < count; i++) {
+            uint16_t *dest = (uint16_t *)(FLASH_STATS_PAGE + logOffset);
+            target_flash_append_array(dest + 2, (const uint16_t *)&entries[i].value, 2);
+            target_flash_append_array(dest, (const uint16_t *)&entries[i].tag, 2);
+            logOffset += sizeof(LogEntry);
+        }
+    }
+    target_flash_lock();
+    lastSaveMs = nowMs;
+}
+
+static int pending_entries(LogEntry *entries) {
+    //  Convert the pending counts to log entries and clear them.
+    int count = 0;
+    if (pendingBytes) { entries[count++] = (LogEntry){ ENTRY_TAG(ENTRY_BYTES, 0), pendingBytes }; }
+    if (pendingSkipped) { entries[count++] = (LogEntry){ ENTRY_TAG(ENTRY_SKIPPED, 0), pendingSkipped }; }
+    for (uint32_t page = 0; page < FLASH_STATS_PAGES; page += 4) {
+        uint32_t counts = 0;
+        for (uint32_t i = 0; i < 4 && page + i < FLASH_STATS_PAGES; i++) {
+            counts |= (uint32_t)pendingErases[page + i] << (8 * i);
+        }
+        if (counts) { entries[count++] = (LogEntry){ ENTRY_TAG(ENTRY_ERASES, page), counts }; }
+    }
+    memset(pendingErases, 0, sizeof(pendingErases));
+    pendingBytes = 0;
+    pendingSkipped = 0;
+    pending = false;
+    return count;
+}
+
+void flash_stats_session_start(void) {
+    LogEntry entries[MAX_ENTRIES + 1];
+    int count = pending_entries(entries);
+    flashStats.sessions++;
+    sessionOpen = true;
+    entries[count++] = (LogEntry){ ENTRY_TAG(ENTRY_SESSION_START, 0), 0 };
+    append_entries(entries, count);
+}
+
+void flash_stats_session_end(void) {
+    LogEntry entries[MAX_ENTRIES + 1];
+    int count = pending_entries(entries);
+    sessionOpen = false;
+    entries[count++] = (LogEntry){ ENTRY_TAG(ENTRY_SESSION_END, 0), 0 };
+    append_entries(entries, count);
+}
+
+void flash_stats_idle(uint32_t ms) {
+    //  Save the pending counts, rate-limited so that the stats page doesn't wear out first.
+    //  Called every millisecond.
+    nowMs = ms;
+    if (!pending || ms - lastSaveMs < FLASH_STATS_SAVE_INTERVAL) { return; }
+    LogEntry entries[MAX_ENTRIES];
+    int count = pending_entries(entries);
+    append_entries(entries, count);
+}
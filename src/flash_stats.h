@@ -0,0 +1,30 @@
+//  Persistent flash wear and flashing statistics, kept in the reserved flash page FLASH_STATS_PAGE.
+#ifndef FLASH_STATS_H_INCLUDED
+#define FLASH_STATS_H_INCLUDED
+
+#include <stdint.h>
+#include "uf2cfg.h"
+#include "config.h"
+
+#define FLASH_STATS_PAGES (FLASH_SIZE_OVERRIDE / FLASH_PAGE_SIZE)  //  Number of flash pages tracked.
+#define FLASH_STATS_SAVE_INTERVAL 10000  //  Save pending counts at most every 10 seconds, except at session end.
+
+typedef struct {
+    uint32_t sessions;          //  UF2 flashing sessions started.
+    uint32_t aborted_sessions;  //  Sessions that were interrupted before the device reset into the app.
+    uint32_t bytes_written;     //  Bytes programmed by UF2 sessions.
+    uint32_t pages_skipped;     //  Pages not programmed because the contents were unchanged.
+    uint16_t page_erases[FLASH_STATS_PAGES];  //  Erase count of each page from the start of flash.
+} FlashStats;
+
+extern FlashStats flashStats;  //  Totals including counts not saved yet.
+
+extern void flash_stats_init(void);
+extern void flash_stats_count_erase(uint32_t page_address);
+extern void flash_stats_count_write(uint32_t bytes);
+extern void flash_stats_count_skip(void);
+extern void flash_stats_session_start(void);
+extern void flash_stats_session_end(void);
+extern void flash_stats_idle(uint32_t ms);
+
+#endif  //  FLASH_STATS_H_INCLUDED
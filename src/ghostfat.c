@@ -3,6 +3,13 @@
 #include "uf2.h"
 #include "target.h"
 #include "dmesg.h"
+#include "flash_stats.h"
+#include "lz4.h"
+#include "delta.h"
+#include "md5.h"
+#include "profile.h"
+#include "scsi_stats.h"
+#include "usb_trace.h"
 
 typedef struct {
     uint8_t JumpInstruction[3];
@@ -64,6 +71,13 @@ const char infoUf2File[] = //
     "Model: " PRODUCT_NAME "\r\n"
     "Board-ID: " BOARD_ID "\r\n";
 
+// INFO_UF2.TXT with the flash statistics appended, rendered on the first read
+static char infoUf2Text[sizeof(infoUf2File) + 160];
+
+// STATS.TXT with the SCSI command statistics, rendered when the root directory is read so that
+// the size in the directory entry matches.  The file must fit in its one cluster.
+static char statsText[512 + 1];
+
 const char indexFile[] = //
     "<!doctype html>\n"
     "<html>"
@@ -75,8 +89,9 @@ const char indexFile[] = //
     "</html>\n";
 
 static const struct TextFile info[] = {
-    {.name = "INFO_UF2TXT", .content = infoUf2File},
+    {.name = "INFO_UF2TXT", .content = infoUf2Text},
     {.name = "INDEX   HTM", .content = indexFile},
+    {.name = "STATS   TXT", .content = statsText},
     {.name = "CURRENT UF2"},
 };
 #define NUM_INFO (int)(sizeof(info) / sizeof(info[0]))
@@ -118,13 +133,32 @@ static const FAT_BootBlock BootBlock = {
 
 static uint32_t flashAddr = NO_CACHE;
 static uint8_t flashBuf[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+// the page cache before a patch or an LZ4 block is expanded into it, to undo a block that fails
+static uint8_t undoBuf[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
 static bool firstFlush = true;
 static bool hadWrite = false;
 static uint32_t ms;
 static uint32_t resetTime;
 static uint32_t lastFlush;
+static bool sessionDone;
+static bool mediumRemoved;
+// the region of the last UF2_FLAG_MD5 block checked and whether the flash matched it: a run of blocks
+// usually shares a region
+static UF2_MD5Region md5Region;
+static bool md5Matched;
+static uint32_t md5RangesMatched, md5RangesDiffered;
+static bool ramImage;  // blocks were loaded into the SRAM window, run them once the file is complete
+
+// Once the whole UF2 file is written, TEST UNIT READY reports the medium removed so the host
+// drops the volume cleanly instead of seeing a surprise disconnect.  The REQUEST SENSE that follows
+// resets through ghostfat_eject(); MEDIUM_GONE_MS covers a host that skips it.  Windows and macOS
+// poll every second, Linux every two, so MEDIUM_TIMEOUT_MS outlasts one poll interval and only
+// fires for a host that doesn't poll at all.  The copy costs up to one poll interval more.
+#define MEDIUM_GONE_MS 50
+#define MEDIUM_TIMEOUT_MS 2500
 
 static void flushFlash(void) {
+    PROFILE_SCOPE(SPAN_FLUSH_FLASH);
     lastFlush = ms;
     if (flashAddr == NO_CACHE)
         return;
@@ -144,14 +178,21 @@ static void flushFlash(void) {
         bool ok = target_flash_program_array((void *)flashAddr, (void*)flashBuf, FLASH_PAGE_SIZE / 2);
         target_flash_lock();
         (void)ok;
+        flash_stats_count_write(FLASH_PAGE_SIZE);
+    } else {
+        flash_stats_count_skip();
     }
 
     flashAddr = NO_CACHE;
 }
 
-static void flash_write(uint32_t dst, const uint8_t *src, int len) {
+static uint8_t *flash_cache(uint32_t dst) {
+    // the page cache at dst, after writing out the page cached before
     uint32_t newAddr = dst & ~(FLASH_PAGE_SIZE - 1);
 
+    if (!hadWrite) {
+        flash_stats_session_start();
+    }
     hadWrite = true;
 
     if (newAddr != flashAddr) {
@@ -159,7 +200,66 @@ static void flash_write(uint32_t dst, const uint8_t *src, int len) {
         flashAddr = newAddr;
         memcpy(flashBuf, (void *)newAddr, FLASH_PAGE_SIZE);
     }
-    memcpy(flashBuf + (dst & (FLASH_PAGE_SIZE - 1)), src, len);
+    return flashBuf + (dst & (FLASH_PAGE_SIZE - 1));
+}
+
+static void flash_write(uint32_t dst, const uint8_t *src, int len) {
+    memcpy(flash_cache(dst), src, len);
+}
+
+static void flash_write_patch(uint32_t dst, const uint8_t *src, uint32_t len) {
+    // rebuild the page at dst in the page cache; the page itself reads as its old contents until the
+    // cache is flushed.  A patch applied to the wrong contents, e.g. a block the host sends twice, fails
+    // the CRC and leaves the page cache as it was, including plain blocks already cached for the page.
+    uint32_t crc;
+    memcpy(&crc, src, 4);
+    uint8_t *page = flash_cache(dst);
+    memcpy(undoBuf, page, FLASH_PAGE_SIZE);
+    int n = delta_apply(src + 4, len - 4, page, FLASH_PAGE_SIZE);
+    if (n != FLASH_PAGE_SIZE || target_crc32((const uint32_t *)page, FLASH_PAGE_SIZE / 4) != crc) {
+        DBG("Patch mismatch at %x", dst);
+        memcpy(page, undoBuf, FLASH_PAGE_SIZE);
+    }
+}
+
+static void flash_write_lz4(uint32_t dst, const uint8_t *src, uint32_t len) {
+    // expand straight into the page cache, up to the end of the page.  A corrupt block may have written
+    // part of that before failing, so the span goes back to what was cached, plain blocks included.
+    uint8_t *out = flash_cache(dst);
+    uint32_t room = FLASH_PAGE_SIZE - (dst & (FLASH_PAGE_SIZE - 1));
+    memcpy(undoBuf, out, room);
+    int n = lz4_decompress(src, len, out, room);
+    if (n < 0) {
+        DBG("Corrupt LZ4 block at %x", dst);
+        memcpy(out, undoBuf, room);
+    }
+}
+
+static bool md5_region_matches(const UF2_Block *bl) {
+    UF2_MD5Region region;
+    memcpy(&region, bl->data + sizeof(bl->data) - sizeof(region), sizeof(region));
+    if (region.length == 0 || region.start < USER_FLASH_START || region.start > USER_FLASH_END ||
+        region.length > USER_FLASH_END - region.start)
+        return false;
+    if (memcmp(&region, &md5Region, sizeof(region)) == 0)
+        return md5Matched;
+
+    // hash the flash with any pending writes to the region
+    if (flashAddr != NO_CACHE && flashAddr < region.start + region.length &&
+        region.start < flashAddr + FLASH_PAGE_SIZE)
+        flushFlash();
+    uint8_t digest[16];
+    md5((const void *)region.start, region.length, digest);
+    md5Region = region;
+    md5Matched = memcmp(digest, region.md5, sizeof(digest)) == 0;
+    if (md5Matched) {
+        DBG("MD5 match %x len %d", region.start, region.length);
+        md5RangesMatched++;
+    } else {
+        DBG("MD5 differ %x len %d", region.start, region.length);
+        md5RangesDiffered++;
+    }
+    return md5Matched;
 }
 
 static void uf2_timer_start(int delay) {
@@ -173,15 +273,140 @@ void ghostfat_1ms() {
     if (resetTime && ms >= resetTime) {
         debug_println("ghostfat_1ms target_manifest_app");  debug_flush();  ////
         flushFlash();
+        if (hadWrite) {
+            flash_stats_session_end();
+        }
+        if (ramImage && sessionDone) {
+            target_manifest_ram_image();
+        }
         target_manifest_app();
         while (1);
     }
 
+    flash_stats_idle(ms);
+
     if (lastFlush && ms - lastFlush > 100) {
         flushFlash();
     }
 }
 
+bool ghostfat_medium_present() {
+    if (!sessionDone)
+        return true;
+    flushFlash();
+    if (!mediumRemoved) {
+        mediumRemoved = true;
+        uf2_timer_start(MEDIUM_GONE_MS);
+    }
+    return false;
+}
+
+// SCSI SYNCHRONIZE CACHE: commit the page buffer now instead of after 100ms idle.
+void ghostfat_sync() {
+    flushFlash();
+}
+
+// SCSI START STOP UNIT eject, after the status was sent: the host is done with the drive, so
+// reboot into the application on the next tick instead of waiting for the UF2 timeouts.  Without
+// a UF2 block since reset (no reset timer running) the host only unmounted the drive: stay.
+void ghostfat_eject() {
+    if (!resetTime)
+        return;
+    flushFlash();
+    uf2_timer_start(1);
+}
+
+static char *append_str(char *dst, const char *src) {
+    while (*src)
+        *dst++ = *src++;
+    return dst;
+}
+
+static char *append_num(char *dst, uint32_t n) {
+    char buf[10];
+    int len = 0;
+    do {
+        buf[len++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (len)
+        *dst++ = buf[--len];
+    return dst;
+}
+
+static void render_info(void) {
+    // Append the flash statistics to INFO_UF2.TXT.  Per-page erase counts are too long for this
+    // file, only the most worn page is shown; get them all with VENDOR_REQ_FLASH_STATS.
+    uint32_t worst = 0;
+    for (uint32_t i = 1; i < FLASH_STATS_PAGES; ++i) {
+        if (flashStats.page_erases[i] > flashStats.page_erases[worst])
+            worst = i;
+    }
+    char *p = append_str(infoUf2Text, infoUf2File);
+    p = append_str(p, "Flash-Sessions: ");
+    p = append_num(p, flashStats.sessions);
+    p = append_str(p, " (aborted ");
+    p = append_num(p, flashStats.aborted_sessions);
+    p = append_str(p, ")\r\nFlash-Bytes-Written: ");
+    p = append_num(p, flashStats.bytes_written);
+    p = append_str(p, "\r\nFlash-Pages-Skipped: ");
+    p = append_num(p, flashStats.pages_skipped);
+    p = append_str(p, "\r\nFlash-Max-Erases: ");
+    p = append_num(p, flashStats.page_erases[worst]);
+    p = append_str(p, " (page ");
+    p = append_num(p, worst);
+    p = append_str(p, ")\r\n");
+    *p = 0;
+}
+
+static void render_stats(void) {
+    // One line per SCSI command seen: counts, data bytes, time the endpoint NAKed the host while
+    // the command was processed, and the latency histogram as "n:count" for commands taking 2^n
+    // to 2^(n+1) us.  Lines that don't fit in the cluster are cut short.
+    char *end = statsText + sizeof(statsText) - 1;
+    char *p = append_str(statsText, "Bytes-In: ");
+    p = append_num(p, scsiStats.bytes_in);
+    p = append_str(p, "\r\nBytes-Out: ");
+    p = append_num(p, scsiStats.bytes_out);
+    p = append_str(p, "\r\nControl-Stalls: ");
+    p = append_num(p, scsiStats.ctrl_stalls);
+    p = append_str(p, "\r\nMD5-Ranges: matched=");
+    p = append_num(p, md5RangesMatched);
+    p = append_str(p, " differed=");
+    p = append_num(p, md5RangesDiffered);
+    p = append_str(p, "\r\n");
+    for (uint32_t i = 0; i < scsiStats.op_count; ++i) {
+        const ScsiOpStats *op = &scsiStats.ops[i];
+        if (op->count == 0)
+            continue;
+        if (end - p < 84) {
+            p = append_str(p, "...\r\n");
+            break;
+        }
+        p = append_str(p, op->name);
+        p = append_str(p, ": n=");
+        p = append_num(p, op->count);
+        p = append_str(p, " fail=");
+        p = append_num(p, op->failed);
+        p = append_str(p, " bytes=");
+        p = append_num(p, op->bytes);
+#ifdef SCSI_STATS_BUSY
+        p = append_str(p, " cb-ms=");
+        p = append_num(p, op->busy_us / 1000);
+#endif  // SCSI_STATS_BUSY
+        for (uint32_t n = 0; n < SCSI_STATS_BUCKETS && end - p >= 16; ++n) {
+            if (op->histogram[n] == 0)
+                continue;
+            *p++ = ' ';
+            p = append_num(p, n);
+            *p++ = ':';
+            p = append_num(p, op->histogram[n]);
+        }
+        p = append_str(p, "\r\n");
+    }
+    *p = 0;
+}
+
 static void padded_memcpy(char *dst, const char *src, int len) {
     for (int i = 0; i < len; ++i) {
         if (*src)
@@ -193,6 +418,10 @@ static void padded_memcpy(char *dst, const char *src, int len) {
 }
 
 int read_block(uint32_t block_no, uint8_t *data) {
+    PROFILE_SCOPE(SPAN_READ_BLOCK);
+    USB_TRACE_BLOCK(TRACE_READ_BLOCK, block_no);
+    if (!infoUf2Text[0])
+        render_info();
     memset(data, 0, 512);
     uint32_t sectionIdx = block_no;
 
@@ -220,6 +449,7 @@ int read_block(uint32_t block_no, uint8_t *data) {
     } else if (block_no < START_CLUSTERS) {
         sectionIdx -= START_ROOTDIR;
         if (sectionIdx == 0) {
+            render_stats();
             DirEntry *d = (void *)data;
             padded_memcpy(d->name, (const char *)BootBlock.VolumeLabel, 11);
             d->attrs = 0x28;
@@ -247,7 +477,7 @@ int read_block(uint32_t block_no, uint8_t *data) {
                 bl->numBlocks = flashSize() / 256;
                 bl->targetAddr = addr | 0x8000000;
                 bl->payloadSize = 256;
-                memcpy(bl->data, (void *)addr, bl->payloadSize);
+                memcpy(bl->data, (void *)bl->targetAddr, bl->payloadSize);  // Not the alias at 0, see replay_bench.py
             }
         }
     }
@@ -256,6 +486,7 @@ int read_block(uint32_t block_no, uint8_t *data) {
 }
 
 static void write_block_core(uint32_t block_no, const uint8_t *data, bool quiet, WriteState *state) {
+    PROFILE_SCOPE(SPAN_WRITE_BLOCK_CORE);
     const UF2_Block *bl = (const void *)data;
 
     (void)block_no;
@@ -266,7 +497,23 @@ static void write_block_core(uint32_t block_no, const uint8_t *data, bool quiet,
         return;
     }
 
-    if ((bl->flags & UF2_FLAG_NOFLASH) || bl->payloadSize > 256 || (bl->targetAddr & 0xff) ||
+    if ((bl->flags & UF2_FLAG_LZ4) && bl->payloadSize <= sizeof(bl->data) && !(bl->targetAddr & 0xff) &&
+        bl->targetAddr >= USER_FLASH_START && bl->targetAddr < USER_FLASH_END) {
+        // USER_FLASH_END is page aligned, so is the end of the expanded data
+        DBG("Expand block at %x", bl->targetAddr);
+        flash_write_lz4(bl->targetAddr, bl->data, bl->payloadSize);
+    } else if ((bl->flags & UF2_FLAG_PATCH) && bl->payloadSize >= 4 && bl->payloadSize <= sizeof(bl->data) &&
+               !(bl->targetAddr & (FLASH_PAGE_SIZE - 1)) &&
+               bl->targetAddr >= USER_FLASH_START && bl->targetAddr < USER_FLASH_END) {
+        DBG("Patch page at %x", bl->targetAddr);
+        flash_write_patch(bl->targetAddr, bl->data, bl->payloadSize);
+    } else if (!(bl->flags & UF2_FLAG_NOFLASH) && bl->payloadSize <= 256 && !(bl->targetAddr & 0xff) &&
+        bl->targetAddr >= RAM_IMAGE_START && bl->targetAddr + bl->payloadSize <= RAM_IMAGE_END) {
+        // loaded as is, the bootloader's RAM ends below the window and flash is not touched
+        DBG("Load block at %x", bl->targetAddr);
+        memcpy((void *)bl->targetAddr, bl->data, bl->payloadSize);
+        ramImage = true;
+    } else if ((bl->flags & UF2_FLAG_NOFLASH) || bl->payloadSize > 256 || (bl->targetAddr & 0xff) ||
         bl->targetAddr < USER_FLASH_START || bl->targetAddr + bl->payloadSize > USER_FLASH_END) {
         debug_print("write_block_core skip "); debug_print_unsigned((size_t) bl->targetAddr); debug_println(""); debug_flush();
         DBG("Skip block at %x", bl->targetAddr);
@@ -275,8 +522,12 @@ static void write_block_core(uint32_t block_no, const uint8_t *data, bool quiet,
     } else {
         // logval("write block at", bl->targetAddr);
         debug_print("write_block_core "); debug_print_unsigned((size_t) bl->targetAddr); debug_println(""); debug_flush();
-        DBG("Write block at %x", bl->targetAddr);
-        flash_write(bl->targetAddr, bl->data, bl->payloadSize);
+        if ((bl->flags & UF2_FLAG_MD5) && md5_region_matches(bl)) {
+            DBG("Match block at %x", bl->targetAddr);
+        } else {
+            DBG("Write block at %x", bl->targetAddr);
+            flash_write(bl->targetAddr, bl->data, bl->payloadSize);
+        }
     }
 
     bool isSet = false;
@@ -297,12 +548,14 @@ static void write_block_core(uint32_t block_no, const uint8_t *data, bool quiet,
                 state->numWritten++;
             }
             if (state->numWritten >= state->numBlocks) {
-                // wait a little bit before resetting, to avoid Windows transmit error
+                // don't reset at once, to avoid Windows transmit error
                 // https://github.com/Microsoft/uf2-samd21/issues/11
-                if (!quiet) {
-                    uf2_timer_start(30);
-                    isSet = true;
+                // wait for the host to see the medium removed, see ghostfat_medium_present()
+                if (!quiet && !mediumRemoved) {
+                    sessionDone = true;
+                    uf2_timer_start(MEDIUM_TIMEOUT_MS);
                 }
+                isSet = true;
             }
         }
         //DBG("wr %d=%d (of %d)", state->numWritten, bl->blockNo, bl->numBlocks);
@@ -318,6 +571,7 @@ WriteState wrState;
 
 int write_block(uint32_t lba, const uint8_t *copy_from)
 {
+    USB_TRACE_BLOCK(TRACE_WRITE_BLOCK, lba);
     write_block_core(lba, copy_from, false, &wrState);
     return 0;
 }
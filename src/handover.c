@@ -0,0 +1,151 @@
+//  UF2 handover: an application that exposes its own USB drive passes a UF2 copy to the bootloader, see uf2.h.
+#include <stddef.h>
+#include <string.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/vector.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/usb/usbd.h>
+#include "msc.h"
+#include "dapboot.h"
+#include "target.h"
+#include "usb_conf.h"
+#include "uf2.h"
+#include "flash_stats.h"
+
+#ifdef INTF_MSC
+//  The application's stack must stay clear of the bootloader's RAM, which is initialised again under it.
+#define HANDOVER_STACK_MARGIN 256
+
+typedef struct {
+    UF2_HandoverArgs args;
+    uint8_t block[512];                        //  The UF2 block the application received.
+    uint8_t packet[MAX_USB_PACKET_SIZE];       //  Next packet, if the host had already sent it.
+    uint16_t packet_len;
+    uint16_t ep_regs[2];                       //  Endpoint registers with the data toggles of the IN and OUT endpoints.
+} HandoverState;
+
+static HandoverState handover_state;
+
+extern vector_table_t vector_table;
+extern uint32_t _data_loadaddr, _data, _edata, _ebss, _stack;
+
+static void handover_resume(void) __attribute__ ((noreturn));
+
+static inline void __set_MSP(uint32_t topOfMainStack) {
+    asm("msr msp, %0" : : "r" (topOfMainStack));
+}
+
+static uint16_t read_pending_packet(uint8_t ep, uint8_t *buf) {
+    //  Copy a packet that reached the OUT endpoint after the application re-armed it.  Packet memory is
+    //  16-bit words at a 32-bit stride.
+    if (!(*USB_EP_REG(ep) & USB_EP_RX_CTR)) { return 0; }
+    uint16_t len = USB_GET_EP_RX_COUNT(ep) & 0x3ff;
+    if (len > MAX_USB_PACKET_SIZE) { len = MAX_USB_PACKET_SIZE; }
+    const volatile uint32_t *pm = (const volatile uint32_t *)USB_GET_EP_RX_BUFF(ep);
+    for (uint16_t i = 0; i < len; i += 2) {
+        uint16_t w = (uint16_t) *pm++;
+        buf[i] = (uint8_t) w;
+        if (i + 1 < len) { buf[i + 1] = (uint8_t) (w >> 8); }
+    }
+    USB_CLR_EP_RX_CTR(ep);
+    return len;
+}
+
+static void restore_data_toggles(uint8_t ep, uint16_t saved) {
+    //  usbd_ep_setup() cleared the data toggles but the host continues with the application's.  The toggle
+    //  bits flip when written with 1, the CTR bits are kept when written with 1.
+    uint16_t reg = *USB_EP_REG(ep);
+    uint16_t flip = (reg ^ saved) & (USB_EP_RX_DTOG | USB_EP_TX_DTOG);
+    *USB_EP_REG(ep) = (reg & USB_EP_NTOGGLE_MSK) | USB_EP_RX_CTR | USB_EP_TX_CTR | flip;
+}
+
+void handover_msc(UF2_HandoverArgs *args) {
+    //  Called by the application from its MSC stack when the host writes a UF2 block, on the application's
+    //  stack and clocks.  Returns only if the handover is not possible.
+    uint32_t masked = cm_mask_interrupts(1);
+    uint32_t sp;
+    asm volatile ("mov %0, sp" : "=r" (sp));
+    HandoverState s;
+    if (args->version >= 2) {
+        s.args = *args;
+    } else {
+        //  Version 1 has no CBW: continue with the blocks left after this one, as if they started at LBA 0.
+        memcpy(&s.args, args, offsetof(UF2_HandoverArgs, cbw_lba));
+        s.args.cbw_lba = 0;
+        s.args.cbw_blocks = args->blocks_remaining + 1;
+        s.args.cbw_length = s.args.cbw_blocks << 9;
+    }
+    if (args->version < 1 || s.args.blocks_remaining >= s.args.cbw_blocks || s.args.cbw_blocks > 0xffff ||
+        sp < (uint32_t) &_ebss + HANDOVER_STACK_MARGIN) {
+        cm_mask_interrupts(masked);
+        return;
+    }
+    //  Hold the host off the OUT endpoint, then copy everything out of the application's RAM.
+    USB_SET_EP_RX_STAT(args->ep_out, USB_EP_RX_STAT_NAK);
+    memcpy(s.block, args->buffer, sizeof(s.block));
+    s.packet_len = read_pending_packet(s.args.ep_out, s.packet);
+    s.ep_regs[0] = *USB_EP_REG(s.args.ep_in);
+    s.ep_regs[1] = *USB_EP_REG(s.args.ep_out);
+
+    //  Nothing of the application may run again: its interrupts could fire into the bootloader.
+    systick_interrupt_disable();
+    systick_counter_disable();
+    for (int i = 0; i < NVIC_IRQ_COUNT; i += 32) {
+        NVIC_ICER(i / 32) = 0xffffffff;
+        NVIC_ICPR(i / 32) = 0xffffffff;
+    }
+    SCB_VTOR = (uint32_t) &vector_table;
+
+    //  What the reset handler does before main(), then continue on the bootloader's own stack.
+    memcpy(&_data, &_data_loadaddr, (size_t) ((uint8_t *) &_edata - (uint8_t *) &_data));
+    memset(&_edata, 0, (size_t) ((uint8_t *) &_ebss - (uint8_t *) &_edata));
+    handover_state = s;
+    __set_MSP((uint32_t) &_stack);
+    handover_resume();
+}
+
+static void handover_resume(void) {
+    const HandoverState *s = &handover_state;
+    cm_enable_interrupts();
+    target_gpio_setup();
+    flash_stats_init();
+
+    //  Replay the application's configuration on the bootloader's USB stack, at the same address.
+    usbd_device* usbd_dev = usb_handover_setup(s->args.ep_in, s->args.ep_out);
+    usbd_dev->pm_top = 0x40;  //  After the buffer descriptor table, as after a bus reset.
+    usbd_dev->current_address = *USB_DADDR_REG & USB_DADDR_ADDR;
+    usbd_ep_setup(usbd_dev, 0, USB_ENDPOINT_ATTR_CONTROL, usbd_dev->desc->bMaxPacketSize0, NULL);
+    usbd_dev->driver->ep_reset(usbd_dev);
+    usbd_dev->current_config = usbd_dev->config->bConfigurationValue;
+    for (int i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
+        //  Every registered callback, like SET_CONFIGURATION in the libopencm3 core.
+        if (usbd_dev->user_callback_set_config[i]) {
+            usbd_dev->user_callback_set_config[i](usbd_dev, usbd_dev->current_config);
+        }
+    }
+    restore_data_toggles(s->args.ep_in, s->ep_regs[0]);
+    restore_data_toggles(s->args.ep_out, s->ep_regs[1]);
+
+    //  Flash the block the application got, then take the rest of the transfer.
+    uint32_t blocks_done = s->args.cbw_blocks - s->args.blocks_remaining;
+    write_block(s->args.cbw_lba + blocks_done - 1, s->block);
+    custom_usb_msc_handover(s->args.cbw_tag, s->args.cbw_lba, s->args.cbw_blocks, s->args.cbw_length,
+                            s->args.blocks_remaining, s->packet, s->packet_len);
+    bootloader_poll(usbd_dev, false);
+}
+#endif  //  INTF_MSC
+
+//  Found by applications at APP_BASE_ADDRESS - 16, see the linker script.
+const UF2_BInfo binfo __attribute__((section(".binfo"), used)) = {
+    NULL,
+    NULL,  //  No HID interface, so no HF2 handover.
+#ifdef INTF_MSC
+    handover_msc,
+#else
+    NULL,
+#endif  //  INTF_MSC
+    infoUf2File,
+};
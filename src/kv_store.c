@@ -0,0 +1,193 @@
+//  Key-value store, see kv_store.h.  Also called by applications through the flash services, on their own
+//  stack after the bootloader has jumped to them: no statics and no bootloader RAM, only the caller's KvStore.
+//
+//  A page starts with a header, the sequence then the magic, followed by 4-byte aligned records: the key and
+//  the length, then the value padded with erased bytes.  A record of length 0 deletes the key.  The value is
+//  programmed before the record header, and the page magic after the records copied by a compaction, so a
+//  write interrupted by a reset reads as erased flash: the end of the log, or a page not in use.
+#include <stdbool.h>
+#include <string.h>
+#include <libopencm3/stm32/flash.h>
+#include "config.h"
+#include "kv_store.h"
+#include "uf2cfg.h"
+
+#define KV_MAGIC      0x3153564b  //  "KVS1"
+#define PAGE_HEADER   8
+#define RECORD_HEADER 4
+#define RECORD_SIZE(length) (RECORD_HEADER + (((length) + 3) & ~3u))
+#define ERASED_WORD   0xffffffff
+
+typedef struct {
+    uint32_t sequence;
+    uint32_t magic;
+} PageHeader;
+
+typedef struct {
+    uint16_t key;
+    uint16_t length;
+} RecordHeader;
+
+static const RecordHeader *record_at(const KvStore *kv, uint32_t offset) {
+    return (const RecordHeader *)(kv->page + offset);
+}
+
+static const KvSlot *lookup(const KvStore *kv, uint16_t key) {
+    //  The slot of the key, or the free slot where it goes.  Fibonacci hashing and linear probing: with at
+    //  most 3/4 of the slots in use the probe is short.  Slots are only freed by a compaction.
+    uint32_t i = (uint16_t)(key * 40503u) >> (16 - KV_INDEX_BITS);
+    while (kv->index[i].offset != 0 && kv->index[i].key != key) {
+        i = (i + 1) & (KV_INDEX_SLOTS - 1);
+    }
+    return &kv->index[i];
+}
+
+static uint16_t live_size(const RecordHeader *r) {
+    return r->length ? RECORD_SIZE(r->length) : 0;
+}
+
+static void index_record(KvStore *kv, uint16_t key, uint16_t offset) {
+    KvSlot *slot = (KvSlot *) lookup(kv, key);
+    if (slot->offset) {
+        kv->live -= live_size(record_at(kv, slot->offset));
+    } else {
+        if (kv->keys >= KV_MAX_KEYS) { return; }
+        kv->keys++;
+        slot->key = key;
+    }
+    slot->offset = offset;
+    kv->live += live_size(record_at(kv, offset));
+}
+
+static void scan(KvStore *kv) {
+    //  Build the index from the records of the active page.
+    memset(kv->index, 0, sizeof(kv->index));
+    kv->keys = 0;
+    kv->live = 0;
+    uint32_t offset = PAGE_HEADER;
+    while (offset + RECORD_HEADER <= FLASH_PAGE_SIZE) {
+        const RecordHeader *r = record_at(kv, offset);
+        if (*(const uint32_t *) r == ERASED_WORD) { break; }
+        if (r->key == KV_KEY_INVALID || r->length > KV_MAX_VALUE ||
+            offset + RECORD_SIZE(r->length) > FLASH_PAGE_SIZE) {
+            offset = FLASH_PAGE_SIZE;  //  Not a record, compact before the next write.
+            break;
+        }
+        index_record(kv, r->key, offset);
+        offset += RECORD_SIZE(r->length);
+    }
+    //  A value left by a reset before its record header: also compact before the next write.
+    for (uint32_t o = offset; o < FLASH_PAGE_SIZE; o += 4) {
+        if (*(const uint32_t *)(kv->page + o) != ERASED_WORD) {
+            offset = FLASH_PAGE_SIZE;
+            break;
+        }
+    }
+    kv->end = offset;
+}
+
+static bool program(uint32_t address, const void *data, uint32_t length) {
+    //  The data may be unaligned, an odd last byte is padded with an erased byte.
+    const uint8_t *p = data;
+    for (uint32_t i = 0; i < length; i += 2) {
+        uint16_t half_word = p[i] | ((i + 1 < length ? p[i + 1] : 0xff) << 8);
+        if (half_word != 0xffff) { flash_program_half_word(address + i, half_word); }
+        if (*(const volatile uint16_t *)(address + i) != half_word) { return false; }
+    }
+    return true;
+}
+
+int kv_open(KvStore *kv) {
+    //  The active page is the one with the magic and the latest sequence.
+    const PageHeader *h0 = (const PageHeader *) KV_STORE_PAGE0;
+    const PageHeader *h1 = (const PageHeader *) KV_STORE_PAGE1;
+    bool valid0 = h0->magic == KV_MAGIC, valid1 = h1->magic == KV_MAGIC;
+    memset(kv, 0, sizeof(*kv));
+    if (!valid0 && !valid1) { return KV_OK; }  //  Formatted by the first write.
+    const PageHeader *h = (valid0 && (!valid1 || (int32_t)(h0->sequence - h1->sequence) > 0)) ? h0 : h1;
+    kv->page = (uint32_t) h;
+    kv->sequence = h->sequence;
+    scan(kv);
+    return KV_OK;
+}
+
+static int compact(KvStore *kv, uint16_t skip_key, uint32_t needed) {
+    //  Copy the latest record of each key except skip_key to the other page, then switch to it.  needed is
+    //  the bytes of records the new page must hold.
+    if (PAGE_HEADER + needed > FLASH_PAGE_SIZE) { return KV_ERR_FULL; }
+    uint32_t to = (kv->page == KV_STORE_PAGE0) ? KV_STORE_PAGE1 : KV_STORE_PAGE0;
+    uint32_t sequence = kv->sequence + 1, magic = KV_MAGIC;
+    uint32_t offset = PAGE_HEADER;
+    flash_unlock();
+    flash_erase_page(to);
+    bool ok = program(to, &sequence, sizeof(sequence));
+    for (int i = 0; ok && i < KV_INDEX_SLOTS; i++) {
+        const KvSlot *slot = &kv->index[i];
+        if (!slot->offset || slot->key == skip_key) { continue; }
+        const RecordHeader *r = record_at(kv, slot->offset);
+        if (!r->length) { continue; }
+        ok = program(to + offset + RECORD_HEADER, r + 1, r->length) && program(to + offset, r, RECORD_HEADER);
+        offset += RECORD_SIZE(r->length);
+    }
+    ok = ok && program(to + 4, &magic, sizeof(magic));
+    flash_lock();
+    if (!ok) { return KV_ERR_FLASH; }
+    kv->page = to;
+    kv->sequence = sequence;
+    scan(kv);
+    return KV_OK;
+}
+
+static int append(KvStore *kv, uint16_t key, const void *value, uint16_t length) {
+    const KvSlot *slot = lookup(kv, key);
+    uint16_t replaced = 0;
+    if (slot->offset) {
+        const RecordHeader *r = record_at(kv, slot->offset);
+        if (r->length == length && (length == 0 || memcmp(r + 1, value, length) == 0)) {
+            return length ? KV_OK : KV_ERR_NOT_FOUND;  //  Unchanged, spare the flash.
+        }
+        replaced = live_size(r);
+    } else if (length == 0) {
+        return KV_ERR_NOT_FOUND;
+    } else if (kv->keys >= KV_MAX_KEYS) {
+        return KV_ERR_FULL;
+    }
+    uint32_t size = RECORD_SIZE(length);
+    if (kv->page == 0 || kv->end + size > FLASH_PAGE_SIZE) {
+        int result = compact(kv, key, kv->live - replaced + size);
+        if (result != KV_OK) { return result; }
+        if (length == 0) { return KV_OK; }  //  The compaction dropped the key.
+    }
+    RecordHeader h = { key, length };
+    uint32_t address = kv->page + kv->end;
+    flash_unlock();
+    bool ok = program(address + RECORD_HEADER, value, length) && program(address, &h, RECORD_HEADER);
+    flash_lock();
+    if (!ok) {
+        kv->end = FLASH_PAGE_SIZE;  //  Compact before the next write.
+        return KV_ERR_FLASH;
+    }
+    index_record(kv, key, kv->end);
+    kv->end += size;
+    return KV_OK;
+}
+
+int kv_get(const KvStore *kv, uint16_t key, void *value, uint16_t size) {
+    //  Copies up to size bytes of the value and returns its length.
+    const KvSlot *slot = lookup(kv, key);
+    if (!slot->offset) { return KV_ERR_NOT_FOUND; }
+    const RecordHeader *r = record_at(kv, slot->offset);
+    if (!r->length) { return KV_ERR_NOT_FOUND; }
+    memcpy(value, r + 1, size < r->length ? size : r->length);
+    return r->length;
+}
+
+int kv_put(KvStore *kv, uint16_t key, const void *value, uint16_t length) {
+    if (key == KV_KEY_INVALID || length == 0 || length > KV_MAX_VALUE) { return KV_ERR_RANGE; }
+    return append(kv, key, value, length);
+}
+
+int kv_delete(KvStore *kv, uint16_t key) {
+    if (key == KV_KEY_INVALID) { return KV_ERR_RANGE; }
+    return append(kv, key, NULL, 0);
+}
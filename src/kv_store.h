@@ -0,0 +1,45 @@
+//  Log-structured key-value store in the two flash pages KV_STORE_PAGE0 and KV_STORE_PAGE1, for the settings
+//  and counters of applications.  Records are appended to the active page and the live ones are copied to
+//  the other page when it is full, so a page is erased once per page of writes instead of once per write.
+//  The index is a hash table in the caller's RAM, built by kv_open().  See kv_store.c.
+#ifndef KV_STORE_H_INCLUDED
+#define KV_STORE_H_INCLUDED
+
+#include <stdint.h>
+
+#define KV_INDEX_BITS  6
+#define KV_INDEX_SLOTS (1 << KV_INDEX_BITS)
+#define KV_MAX_KEYS    (KV_INDEX_SLOTS * 3 / 4)  //  Keep the probes short.
+#define KV_MAX_VALUE   128                       //  Bytes.
+#define KV_KEY_INVALID 0xffff
+
+//  Return codes, lengths are returned as non-negative values.
+#define KV_OK             0
+#define KV_ERR_NOT_FOUND -1
+#define KV_ERR_RANGE     -2  //  Invalid key or length.
+#define KV_ERR_FULL      -3  //  Too many keys, or the live records don't fit in a page.
+#define KV_ERR_FLASH     -4  //  The flash did not read back the data programmed.
+
+typedef struct {
+    uint16_t key;
+    uint16_t offset;  //  Of the key's latest record in the active page, 0 if the slot is free.
+} KvSlot;
+
+//  Kept by the caller, in RAM.  Applications pass it to the bootloader through the flash services, so the
+//  layout is fixed: see flash_services.h.
+typedef struct {
+    uint32_t page;      //  Active page, 0 if neither page holds a store yet.
+    uint32_t sequence;  //  Of the active page, incremented by each compaction.
+    uint16_t end;       //  Offset of the next record.
+    uint16_t live;      //  Bytes of the latest record of each key, deleted keys excluded.
+    uint16_t keys;      //  Slots in use.
+    uint16_t reserved;
+    KvSlot index[KV_INDEX_SLOTS];
+} KvStore;
+
+extern int kv_open(KvStore *kv);
+extern int kv_get(const KvStore *kv, uint16_t key, void *value, uint16_t size);
+extern int kv_put(KvStore *kv, uint16_t key, const void *value, uint16_t length);
+extern int kv_delete(KvStore *kv, uint16_t key);
+
+#endif  //  KV_STORE_H_INCLUDED
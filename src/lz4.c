@@ -0,0 +1,43 @@
+//  LZ4 block decompression, see lz4.h.  A sequence is a token, the literal length in its high nibble and
+//  the match length minus 4 in its low nibble, 15 meaning more length bytes follow; then the literals, and
+//  the 2-byte match offset back into the output.  The last sequence has only literals.
+#include <string.h>
+#include "lz4.h"
+
+static int read_length(const uint8_t **ip, const uint8_t *end, uint32_t *length) {
+    //  Length bytes after a nibble of 15, until a byte below 255.
+    uint8_t b;
+    do {
+        if (*ip >= end) { return -1; }
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len) {
+    const uint8_t *ip = src, *src_end = src + src_len;
+    uint8_t *op = dst, *dst_end = dst + dst_len;
+    while (ip < src_end) {
+        uint8_t token = *ip++;
+        uint32_t length = token >> 4;
+        if (length == 15 && read_length(&ip, src_end, &length) < 0) { return -1; }
+        if (length > (uint32_t)(src_end - ip) || length > (uint32_t)(dst_end - op)) { return -1; }
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+        if (ip == src_end) { break; }
+
+        if (src_end - ip < 2) { return -1; }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) { return -1; }
+        length = (token & 15) + 4;
+        if ((token & 15) == 15 && read_length(&ip, src_end, &length) < 0) { return -1; }
+        if (length > (uint32_t)(dst_end - op)) { return -1; }
+        //  Byte by byte, the match may overlap what it produces, e.g. a run of 0xff.
+        const uint8_t *match = op - offset;
+        while (length--) { *op++ = *match++; }
+    }
+    return (int)(op - dst);
+}
@@ -0,0 +1,11 @@
+//  LZ4 block decompression for the compressed UF2 blocks, see UF2_FLAG_LZ4 in uf2.h.
+#ifndef LZ4_H_INCLUDED
+#define LZ4_H_INCLUDED
+
+#include <stdint.h>
+
+//  Expands the LZ4 block src into dst, which is also the window: matches only copy from what this call
+//  has produced.  Returns the bytes written, or -1 if the block is corrupt or would overflow dst.
+extern int lz4_decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len);
+
+#endif  //  LZ4_H_INCLUDED
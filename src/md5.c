@@ -0,0 +1,74 @@
+//  MD5, see md5.h.  Small rather than fast: one round loop, the message read in place and only the
+//  last one or two 64-byte blocks padded on the stack.
+#include <string.h>
+#include "md5.h"
+
+static const uint32_t K[64] = {  //  floor(abs(sin(i + 1)) * 2^32)
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t S[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+static void transform(uint32_t h[4], const uint8_t *p) {
+    uint32_t w[16];
+    for (int i = 0; i < 16; i++) {
+        w[i] = p[4 * i] | (p[4 * i + 1] << 8) | (p[4 * i + 2] << 16) | ((uint32_t) p[4 * i + 3] << 24);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        switch (i >> 4) {
+        case 0:  f = (b & c) | (~b & d); g = i;                break;
+        case 1:  f = (d & b) | (~d & c); g = (5 * i + 1) & 15; break;
+        case 2:  f = b ^ c ^ d;          g = (3 * i + 5) & 15; break;
+        default: f = c ^ (b | ~d);       g = (7 * i) & 15;     break;
+        }
+        uint32_t x = a + f + K[i] + w[g];
+        int s = S[(i >> 4) * 4 + (i & 3)];
+        a = d;
+        d = c;
+        c = b;
+        b += (x << s) | (x >> (32 - s));
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+}
+
+void md5(const void *data, uint32_t len, uint8_t digest[16]) {
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    const uint8_t *p = data;
+    uint32_t left = len;
+    for (; left >= 64; left -= 64, p += 64) { transform(h, p); }
+
+    //  The rest, 0x80, zeros and the length in bits.
+    uint8_t block[64];
+    memset(block, 0, sizeof(block));
+    memcpy(block, p, left);
+    block[left] = 0x80;
+    if (left >= 56) {
+        transform(h, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t) len * 8;
+    for (int i = 0; i < 8; i++) { block[56 + i] = (uint8_t)(bits >> (8 * i)); }
+    transform(h, block);
+    for (int i = 0; i < 16; i++) { digest[i] = (uint8_t)(h[i / 4] >> (8 * (i % 4))); }
+}
@@ -0,0 +1,9 @@
+//  MD5 (RFC 1321) of a memory range, for the UF2 blocks with UF2_FLAG_MD5, see uf2.h.
+#ifndef MD5_H_INCLUDED
+#define MD5_H_INCLUDED
+
+#include <stdint.h>
+
+extern void md5(const void *data, uint32_t len, uint8_t digest[16]);
+
+#endif  //  MD5_H_INCLUDED
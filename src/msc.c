@@ -24,11 +24,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libopencm3/cm3/common.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/usb/msc.h>
 #include <logger.h>
+#include "profile.h"
+#include "scsi_stats.h"
+#include "usb_trace.h"
 #include "msc.h"
 #include "usb_conf.h"
+#ifdef UF2_DEFINE_HANDOVER
+#include "uf2.h"
+#endif  /* UF2_DEFINE_HANDOVER */
 
 /* Definitions of Mass Storage Class from:
  *
@@ -166,6 +173,8 @@ struct usb_msc_trans {
 	uint8_t msd_buf[512];
 
 	bool csw_valid;
+	bool zlp_sent;			/* Short data stage ended */
+	bool csw_after_clear;		/* IN stalled, send the CSW when cleared */
 	uint8_t csw_sent;		/* Write until 13 bytes */
 	union {
 		struct usb_msc_csw csw;
@@ -187,6 +196,11 @@ struct _usbd_mass_storage {
 
 	int (*read_block)(uint32_t lba, uint8_t *copy_to);
 	int (*write_block)(uint32_t lba, const uint8_t *copy_from);
+	void (*sync_cache)(void);
+	void (*eject)(void);
+	bool (*medium_present)(void);
+	bool eject_pending;		/* Call eject once the CSW is sent */
+	bool reset_required;		/* Invalid CBW, stalled until Reset Recovery */
 
 	void (*lock)(void);
 	void (*unlock)(void);
@@ -259,6 +273,32 @@ static uint8_t *get_cbw_buf(struct usb_msc_trans *trans)
 	return &trans->cbw.cbw.CBWCB[0];
 }
 
+static void reset_trans(struct usb_msc_trans *trans)
+{
+	trans->lba_start = 0xffffffff;
+	trans->block_count = 0;
+	trans->current_block = 0;
+	trans->cbw_cnt = 0;
+	trans->bytes_to_read = 0;
+	trans->bytes_to_write = 0;
+	trans->byte_count = 0;
+	trans->csw_sent = 0;
+	trans->csw_valid = false;
+	trans->zlp_sent = false;
+	trans->csw_after_clear = false;
+}
+
+/* Send the first len bytes of msd_buf, cut to the allocation length in the
+ * CDB and to the length in the CBW. */
+static void set_bytes_to_write(struct usb_msc_trans *trans, uint32_t len,
+			       uint32_t allocation_length)
+{
+	len = MIN(len, allocation_length);
+	len = MIN(len, trans->cbw.cbw.dCBWDataTransferLength);
+	trans->bytes_to_write = len;
+	trans->csw.csw.dCSWDataResidue = trans->cbw.cbw.dCBWDataTransferLength - len;
+}
+
 static void scsi_read_6(usbd_mass_storage *ms,
 			struct usb_msc_trans *trans,
 			enum trans_event event)
@@ -393,50 +433,94 @@ static void scsi_request_sense(usbd_mass_storage *ms,
 		trans->msd_buf[2] = ms->sense.key;
 		trans->msd_buf[12] = ms->sense.asc;
 		trans->msd_buf[13] = ms->sense.ascq;
+
+		/* The host now knows the medium is gone, see
+		 * scsi_test_unit_ready(): let go of it like after an eject
+		 * once this CSW is sent. */
+		if (SBC_ASC_MEDIUM_NOT_PRESENT == ms->sense.asc) {
+			ms->eject_pending = (NULL != ms->eject);
+		}
 	}
 }
 
+//  Mode Page 0x08 - Caching (SBC-3 Section 6.4.5).  Writes are cached in ghostfat's page buffer
+//  until SYNCHRONIZE CACHE, an eject or a short idle time, so report WCE: hosts then queue
+//  larger writes and sync at the end instead of writing through.
+#define LENGTH_MODE_PAGE08        20
+static const uint8_t MSC_Page08_Mode_Data[LENGTH_MODE_PAGE08] = {
+		0x08,  //  PS = 0, Page Code
+		(LENGTH_MODE_PAGE08 - 2),  //  Page Length
+		0x04,  //  WCE = 1, RCD = 0
+		0x00,  //  Demand Read / Write Retention Priority
+		0x00, 0x00,  //  Disable Pre-fetch Transfer Length
+		0x00, 0x00,  //  Minimum Pre-fetch
+		0x00, 0x00,  //  Maximum Pre-fetch
+		0x00, 0x00,  //  Maximum Pre-fetch Ceiling
+		0x00,  //  FSW = 0, DRA = 0
+		0x00,  //  Number of Cache Segments
+		0x00, 0x00,  //  Cache Segment Size
+		0x00,  //  Reserved
+		0x00, 0x00, 0x00,  //  Obsolete
+};
+
+/* Copy the mode pages selected by page_code to buf, return their length.
+ * Other pages are reported as empty rather than failed: hosts probe pages
+ * like 0x1C (Informational Exceptions) and give up on errors. */
+static uint32_t mode_sense_pages(uint8_t *buf, uint8_t page_code)
+{
+	if ((0x08 == page_code) || (0x3F == page_code)) {
+		memcpy(buf, MSC_Page08_Mode_Data, LENGTH_MODE_PAGE08);
+		return LENGTH_MODE_PAGE08;
+	}
+	return 0;
+}
+
 static void scsi_mode_sense_6(usbd_mass_storage *ms,
 			      struct usb_msc_trans *trans,
 			      enum trans_event event)
 {
-	(void) ms;
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+		uint32_t len;
 
+		buf = get_cbw_buf(trans);
+		len = mode_sense_pages(&trans->msd_buf[4], 0x3F & buf[2]);
+
+		trans->msd_buf[0] = 3 + len;	/* Num bytes that follow */
+		trans->msd_buf[1] = 0;	/* Medium Type */
+		trans->msd_buf[2] = 0;	/* Device specific param */
+		trans->msd_buf[3] = 0;	/* Block descriptor length */
+		set_bytes_to_write(trans, 4 + len, buf[4]);
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_mode_sense_10(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans,
+			       enum trans_event event)
+{
 	if (EVENT_CBW_VALID == event) {
-#if 0
 		uint8_t *buf;
-		uint8_t page_code;
-		uint8_t allocation_length;
+		uint32_t len;
 
-		buf = &trans->cbw.cbw.CBWCB[0];
-		page_code = buf[2];
-		allocation_length = buf[4];
-
-		if (0x1C == page_code) {	/* Informational Exceptions */
-#endif
-			trans->bytes_to_write = 4;
-
-			trans->msd_buf[0] = 3;	/* Num bytes that follow */
-			trans->msd_buf[1] = 0;	/* Medium Type */
-			trans->msd_buf[2] = 0;	/* Device specific param */
-			trans->csw.csw.dCSWDataResidue = 4;
-#if 0
-		} else if (0x01 == page_code) {	/* Error recovery */
-		} else if (0x3F == page_code) {	/* All */
-		} else {
-			/* Error */
-			trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
-			set_sbc_status(ms,
-				       SBC_SENSE_KEY_ILLEGAL_REQUEST,
-				       SBC_ASC_INVALID_FIELD_IN_CDB,
-				       SBC_ASCQ_NA);
-		}
-#endif
+		buf = get_cbw_buf(trans);
+		len = mode_sense_pages(&trans->msd_buf[8], 0x3F & buf[2]);
+
+		trans->msd_buf[0] = 0;	/* Num bytes that follow */
+		trans->msd_buf[1] = 6 + len;
+		trans->msd_buf[2] = 0;	/* Medium Type */
+		trans->msd_buf[3] = 0;	/* Device specific param */
+		trans->msd_buf[4] = 0;	/* Reserved */
+		trans->msd_buf[5] = 0;
+		trans->msd_buf[6] = 0;	/* Block descriptor length */
+		trans->msd_buf[7] = 0;
+		set_bytes_to_write(trans, 8 + len, (buf[7] << 8) | buf[8]);
+		set_sbc_status_good(ms);
 	}
 }
 
 //  Inquiry Page 0x00 - Supported VPD Pages (Section 5.4.18). From https://github.com/LonelyWolf/stm32/blob/master/cube-usb-msc/msc/usbd_msc_scsi.c
-#define LENGTH_INQUIRY_PAGE00     6  //  Previously 7
+#define LENGTH_INQUIRY_PAGE00     8  //  4-byte header and the 4 pages listed: 0x00, 0x80, 0xB0 and 0xB1
 static const uint8_t MSC_Page00_Inquiry_Data[LENGTH_INQUIRY_PAGE00] = {
 		0x00,  //  PERIPHERAL QUALIFIER and PERIPHERAL DEVICE TYPE
 		0x00,  //  Page Code
@@ -445,6 +529,8 @@ static const uint8_t MSC_Page00_Inquiry_Data[LENGTH_INQUIRY_PAGE00] = {
 		0x00,  //  Supported: Page 0x00 - Supported VPD Pages (Section 5.4.18)
 		0x80,  //  Supported: Page 0x80 - Unit Serial Number (Section 5.4.19)
 		// 0x83   //  Supported: Page 0x83 - Device Identification (Section 5.4.11)
+		0xB0,  //  Supported: Page 0xB0 - Block Limits (SBC-3 Section 6.5.3)
+		0xB1,  //  Supported: Page 0xB1 - Block Device Characteristics (SBC-3 Section 6.5.2)
 };
 
 //  Inquiry Page 0x80 - Unit Serial Number (Section 5.4.19)
@@ -460,6 +546,37 @@ static const uint8_t MSC_Page80_Inquiry_Data[LENGTH_INQUIRY_PAGE80] = {
 		'5', '6', '7', '8',
 };
 
+//  Inquiry Page 0xB0 - Block Limits (SBC-3 Section 6.5.3).  The short SBC-2 form, without the
+//  UNMAP fields.  There is no limit on the transfer length; the optimal length asks the host for
+//  64 KB writes, and the granularity is one 1 KB flash page of UF2 blocks (256 bytes each).
+#define LENGTH_INQUIRY_PAGEB0     0x10
+#define BLOCK_LIMITS_GRANULARITY  4
+#define BLOCK_LIMITS_OPTIMAL      128
+static const uint8_t MSC_PageB0_Inquiry_Data[LENGTH_INQUIRY_PAGEB0] = {
+		0x00,  //  PERIPHERAL QUALIFIER and PERIPHERAL DEVICE TYPE
+		0xB0,  //  Page Code
+		0x00,  //  Reserved
+		(LENGTH_INQUIRY_PAGEB0 - 4),  //  Page Length
+		0x00,  //  WSNZ = 0
+		0x00,  //  Maximum Compare and Write Length
+		0x00, BLOCK_LIMITS_GRANULARITY,  //  Optimal Transfer Length Granularity
+		0x00, 0x00, 0x00, 0x00,  //  Maximum Transfer Length: not reported
+		0x00, 0x00, 0x00, BLOCK_LIMITS_OPTIMAL,  //  Optimal Transfer Length
+};
+
+//  Inquiry Page 0xB1 - Block Device Characteristics (SBC-3 Section 6.5.2).  Only the first
+//  bytes are non-zero, the rest is sent from the zeroed msd_buf.
+#define LENGTH_INQUIRY_PAGEB1     0x40
+static const uint8_t MSC_PageB1_Inquiry_Data[8] = {
+		0x00,  //  PERIPHERAL QUALIFIER and PERIPHERAL DEVICE TYPE
+		0xB1,  //  Page Code
+		0x00,  //  Reserved
+		(LENGTH_INQUIRY_PAGEB1 - 4),  //  Page Length
+		0x00, 0x01,  //  Medium Rotation Rate: non-rotating medium
+		0x00,  //  Product Type
+		0x00,  //  WABEREQ = 0, WACEREQ = 0, Nominal Form Factor: not reported
+};
+
 #ifdef NOTUSED
 //  Inquiry Page 0x83 - Device Identification (Section 5.4.11)
 #define LENGTH_INQUIRY_PAGE83     7
@@ -529,6 +646,19 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 					set_sbc_status_good(ms);
 					break;
 				}
+				case 0xB0: {  //  Page 0xB0 - Block Limits
+					memcpy(trans->msd_buf, MSC_PageB0_Inquiry_Data, LENGTH_INQUIRY_PAGEB0);
+					set_bytes_to_write(trans, LENGTH_INQUIRY_PAGEB0, (buf[3] << 8) | buf[4]);
+					set_sbc_status_good(ms);
+					break;
+				}
+				case 0xB1: {  //  Page 0xB1 - Block Device Characteristics
+					memset(trans->msd_buf, 0, LENGTH_INQUIRY_PAGEB1);
+					memcpy(trans->msd_buf, MSC_PageB1_Inquiry_Data, sizeof(MSC_PageB1_Inquiry_Data));
+					set_bytes_to_write(trans, LENGTH_INQUIRY_PAGEB1, (buf[3] << 8) | buf[4]);
+					set_sbc_status_good(ms);
+					break;
+				}
 #ifdef NOTUSED				
 				case 0x83: {  //  Page 0x83 - Device Identification (Section 5.4.11)
 					uint8_t *pPage = (uint8_t *)MSC_Page83_Inquiry_Data;
@@ -542,7 +672,7 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 				}
 #endif  //  NOTUSED				
 				default:
-					debug_print("scsi_inquiry notsup "); debug_printhex(page_code); debug_println(""); debug_flush(); ////
+					if (LOG_ENABLED(LOG_LEVEL_WARN)) { debug_print("scsi_inquiry notsup "); debug_printhex(page_code); debug_println(""); debug_flush(); } ////
 			}
 		}
 	}
@@ -571,10 +701,61 @@ static void scsi_read_format_capacities(usbd_mass_storage *ms, struct usb_msc_tr
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+static void scsi_test_unit_ready(usbd_mass_storage *ms,
+				 struct usb_msc_trans *trans,
+				 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		if ((NULL != ms->medium_present) && !(*ms->medium_present)()) {
+			trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+			set_sbc_status(ms, SBC_SENSE_KEY_NOT_READY,
+				       SBC_ASC_MEDIUM_NOT_PRESENT,
+				       SBC_ASCQ_NA);
+		} else {
+			set_sbc_status_good(ms);
+		}
+	}
+}
+
+static void scsi_synchronize_cache(usbd_mass_storage *ms,
+				   struct usb_msc_trans *trans,
+				   enum trans_event event)
+{
+	(void) trans;
+	if (EVENT_CBW_VALID == event) {
+		/* Commit the whole cache, the LBA range doesn't matter. */
+		if (NULL != ms->sync_cache) {
+			(*ms->sync_cache)();
+		}
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_start_stop_unit(usbd_mass_storage *ms,
+				 struct usb_msc_trans *trans,
+				 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+		/* LOEJ set and START clear: eject.  The host still expects
+		 * the CSW, so only act on it at the end of the transaction. */
+		if ((0x03 & buf[4]) == 0x02) {
+			if (NULL != ms->sync_cache) {
+				(*ms->sync_cache)();
+			}
+			ms->eject_pending = (NULL != ms->eject);
+		}
+		set_sbc_status_good(ms);
+	}
+}
+
 static void scsi_command(usbd_mass_storage *ms,
 			 struct usb_msc_trans *trans,
 			 enum trans_event event)
 {
+	PROFILE_SCOPE(SPAN_SCSI_COMMAND);
 	if (EVENT_CBW_VALID == event) {
 		/* Setup the default success */
 		trans->csw_sent = 0;
@@ -590,6 +771,8 @@ static void scsi_command(usbd_mass_storage *ms,
 
 	switch (trans->cbw.cbw.CBWCB[0]) {
 	case SCSI_TEST_UNIT_READY:
+		scsi_test_unit_ready(ms, trans, event);
+		break;
 	case SCSI_SEND_DIAGNOSTIC:
 		/* Do nothing, just send the success. */
 		set_sbc_status_good(ms);
@@ -603,6 +786,9 @@ static void scsi_command(usbd_mass_storage *ms,
 	case SCSI_MODE_SENSE_6:
 		scsi_mode_sense_6(ms, trans, event);
 		break;
+	case SCSI_MODE_SENSE_10:
+		scsi_mode_sense_10(ms, trans, event);
+		break;
 	case SCSI_READ_6:
 		scsi_read_6(ms, trans, event);
 		break;
@@ -629,9 +815,15 @@ static void scsi_command(usbd_mass_storage *ms,
 	case SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL:
 		set_sbc_status_good(ms);
 		break;
+	case SCSI_SYNCHRONIZE_CACHE:
+		scsi_synchronize_cache(ms, trans, event);
+		break;
+	case SCSI_START_STOP_UNIT:
+		scsi_start_stop_unit(ms, trans, event);
+		break;
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	default:
-        debug_print("SBC_SENSE_KEY_ILLEGAL_REQUEST "); debug_printhex(trans->cbw.cbw.CBWCB[0]); debug_println(""); debug_flush(); ////
+        if (LOG_ENABLED(LOG_LEVEL_WARN)) { debug_print("SBC_SENSE_KEY_ILLEGAL_REQUEST "); debug_printhex(trans->cbw.cbw.CBWCB[0]); debug_println(""); debug_flush(); } ////
 		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
 					SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
 					SBC_ASCQ_NA);
@@ -645,8 +837,66 @@ static void scsi_command(usbd_mass_storage *ms,
 
 /*-- USB Mass Storage Layer --------------------------------------------------*/
 
+static bool cbw_valid(struct usb_msc_trans *trans)
+{
+	/* Bulk-Only Transport 6.2.1: one 31-byte packet with the signature,
+	 * for LUN 0, with a command block of 1 to 16 bytes. */
+	return (sizeof(struct usb_msc_cbw) == trans->cbw_cnt) &&
+	       (CBW_SIGNATURE == trans->cbw.cbw.dCBWSignature) &&
+	       (0 == trans->cbw.cbw.bCBWLUN) &&
+	       (0 < trans->cbw.cbw.bCBWCBLength) &&
+	       (16 >= trans->cbw.cbw.bCBWCBLength);
+}
+
+/** @brief Stall both bulk endpoints until the host does a Reset Recovery
+ *	   (Bulk-Only Transport 5.3.4 and 6.6.1). */
+static void stall_for_reset(usbd_device *usbd_dev, usbd_mass_storage *ms)
+{
+	ms->reset_required = true;
+	usbd_ep_stall_set(usbd_dev, ms->ep_in, 1);
+	usbd_ep_stall_set(usbd_dev, ms->ep_out, 1);
+}
+
+/** @brief Match the data the command moves against the CBW (Bulk-Only
+ *	   Transport 6.7, the thirteen cases).
+ *
+ * A block transfer in the wrong direction or longer than the host expects is
+ * a phase error.  Other replies are cut to the host's length.  When the host
+ * expects data the command doesn't move, its data pipe is stalled: an OUT
+ * stall comes with the CSW, the CSW after an IN stall is sent once the host
+ * clears the halt.
+ */
+static void check_data_phase(usbd_device *usbd_dev, usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans)
+{
+	uint32_t expected = trans->cbw.cbw.dCBWDataTransferLength;
+	bool to_host = (0 != (0x80 & trans->cbw.cbw.bmCBWFlags));
+
+	if (((0 < trans->bytes_to_write) && !to_host) ||
+	    ((0 < trans->bytes_to_read) && to_host) ||
+	    ((0 < trans->block_count) &&
+	     ((expected < trans->bytes_to_read) || (expected < trans->bytes_to_write)))) {
+		trans->csw.csw.bCSWStatus = CSW_STATUS_PHASE_ERROR;
+		trans->block_count = 0;
+		trans->bytes_to_read = 0;
+		trans->bytes_to_write = 0;
+	}
+	trans->bytes_to_write = MIN(trans->bytes_to_write, expected);
+
+	if ((0 < expected) && (0 == trans->bytes_to_read) &&
+	    (0 == trans->bytes_to_write)) {
+		trans->csw.csw.dCSWDataResidue = expected;
+		if (to_host) {
+			usbd_ep_stall_set(usbd_dev, ms->ep_in, 1);
+			trans->csw_after_clear = true;
+		} else {
+			usbd_ep_stall_set(usbd_dev, ms->ep_out, 1);
+		}
+	}
+}
+
 /** @brief Handle the USB 'OUT' requests. */
-static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+static void msc_data_rx(usbd_device *usbd_dev, uint8_t ep)
 {
     // debug_println("msc_data_rx_cb"); // debug_flush(); ////
 	usbd_mass_storage *ms;
@@ -657,6 +907,10 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 	ms = &_mass_storage;
 	trans = &ms->trans;
 
+	if (ms->reset_required) {
+		return;
+	}
+
 	/* RX only */
 	left = sizeof(struct usb_msc_cbw) - trans->cbw_cnt;
 	if (0 < left) {
@@ -666,8 +920,20 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 		trans->cbw_cnt += len;
         // debug_print("msc_data_rx_cb len "); debug_print_unsigned(len); debug_println(""); debug_flush(); ////
 
+		if (!cbw_valid(trans)) {
+            if (LOG_ENABLED(LOG_LEVEL_WARN)) { debug_print("msc invalid cbw "); debug_print_unsigned(trans->cbw_cnt); debug_println(""); debug_flush(); } ////
+			stall_for_reset(usbd_dev, ms);
+			return;
+		}
+
 		if (sizeof(struct usb_msc_cbw) == trans->cbw_cnt) {
+			scsi_stats_begin(trans->cbw.cbw.CBWCB[0]);
+			USB_TRACE_CBW(&trans->cbw.cbw);
 			scsi_command(ms, trans, EVENT_CBW_VALID);
+			check_data_phase(usbd_dev, ms, trans);
+			if (trans->csw_after_clear) {
+				return;
+			}
 
 #ifdef NOTUSED
             debug_print("msc_data_rx_cb byte_count "); 
@@ -713,9 +979,20 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 				uint32_t lba;
 
 				lba = trans->lba_start + trans->current_block;
+#ifdef UF2_DEFINE_HANDOVER
+				/* In an application: a UF2 block passes the rest of
+				 * the transfer to the bootloader, which does not
+				 * return.  See uf2.h. */
+				check_uf2_handover(trans->msd_buf,
+					trans->block_count - trans->current_block - 1,
+					ms->ep_in & 0x7f, ms->ep_out,
+					trans->cbw.cbw.dCBWTag, trans->lba_start,
+					trans->block_count,
+					trans->cbw.cbw.dCBWDataTransferLength);
+#endif  /* UF2_DEFINE_HANDOVER */
 				if (0 != (*ms->write_block)(lba, trans->msd_buf)) {
 					/* Error */
-                    debug_println("msc_data_rx_cb write error"); debug_flush(); ////
+                    log_error("msc_data_rx_cb write error"); log_flush(); ////
 				}
 				trans->current_block++;
 			}
@@ -749,7 +1026,7 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 				lba = trans->lba_start + trans->current_block;
 				if (0 != (*ms->read_block)(lba, trans->msd_buf)) {
 					/* Error */
-                    debug_println("msc_data_rx_cb read error"); debug_flush(); ////
+                    log_error("msc_data_rx_cb read error"); log_flush(); ////
 				}
 				trans->current_block++;
 			}
@@ -768,7 +1045,7 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 				lba = trans->lba_start + trans->current_block;
 				if (0 != (*ms->write_block)(lba, trans->msd_buf)) {
 					/* Error */
-                    debug_println("msc_data_rx_cb write error 2"); debug_flush(); ////
+                    log_error("msc_data_rx_cb write error 2"); log_flush(); ////
 				}
 
 				trans->current_block = 0;
@@ -794,7 +1071,7 @@ static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 }
 
 /** @brief Handle the USB 'IN' requests. */
-static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+static void msc_data_tx(usbd_device *usbd_dev, uint8_t ep)
 {
     // debug_println("msc_data_tx_cb"); // debug_flush(); ////
 	usbd_mass_storage *ms;
@@ -813,7 +1090,7 @@ static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
 				lba = trans->lba_start + trans->current_block;
 				if (0 != (*ms->read_block)(lba, trans->msd_buf)) {
 					/* Error */
-                    debug_println("msc_data_tx_cb read error"); debug_flush(); ////
+                    log_error("msc_data_tx_cb read error"); log_flush(); ////
 				}
 				trans->current_block++;
 			}
@@ -833,6 +1110,15 @@ static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
 				}
 			}
 		}
+		if ((0 < trans->byte_count) && (0 == trans->byte_count % ms->ep_in_size) &&
+		    (trans->byte_count < trans->cbw.cbw.dCBWDataTransferLength) &&
+		    (false == trans->zlp_sent)) {
+			/* The data ended early on a full packet, end it with a
+			 * short one or the host takes the CSW for data. */
+			usbd_ep_write_packet(usbd_dev, ep, NULL, 0);
+			trans->zlp_sent = true;
+			return;
+		}
 		if (false == trans->csw_valid) {
 			scsi_command(ms, trans, EVENT_NEED_STATUS);
 			trans->csw_valid = true;
@@ -846,19 +1132,47 @@ static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
 			trans->csw_sent += len;
 		} else if (sizeof(struct usb_msc_csw) == trans->csw_sent) {
 			/* End of transaction */
-			trans->lba_start = 0xffffffff;
-			trans->block_count = 0;
-			trans->current_block = 0;
-			trans->cbw_cnt = 0;
-			trans->bytes_to_read = 0;
-			trans->bytes_to_write = 0;
-			trans->byte_count = 0;
-			trans->csw_sent = 0;
-			trans->csw_valid = false;
+			scsi_stats_end(trans->byte_count, 0 < trans->bytes_to_read,
+				       CSW_STATUS_SUCCESS != trans->csw.csw.bCSWStatus);
+			USB_TRACE_CSW(&trans->csw.csw, trans->byte_count);
+			reset_trans(trans);
+			if (ms->eject_pending) {
+				ms->eject_pending = false;
+				(*ms->eject)();
+			}
 		}
 	}
 }
 
+#if defined(SCSI_STATS_BUSY) || defined(USB_TRACE)
+/* Time the callbacks for the SCSI statistics and trace the slow ones.
+ * Without either, the callbacks are registered as they are. */
+static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	uint32_t start = DWT_CYCCNT;
+	uint32_t bytes = _mass_storage.trans.byte_count;
+	msc_data_rx(usbd_dev, ep);
+#ifdef SCSI_STATS_BUSY
+	scsi_stats_busy(DWT_CYCCNT - start);
+#endif  /* SCSI_STATS_BUSY */
+	USB_TRACE_CALLBACK(start, ep, bytes, _mass_storage.trans.byte_count);
+}
+
+static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	uint32_t start = DWT_CYCCNT;
+	uint32_t bytes = _mass_storage.trans.byte_count;
+	msc_data_tx(usbd_dev, ep);
+#ifdef SCSI_STATS_BUSY
+	scsi_stats_busy(DWT_CYCCNT - start);
+#endif  /* SCSI_STATS_BUSY */
+	USB_TRACE_CALLBACK(start, ep, bytes, _mass_storage.trans.byte_count);
+}
+#else
+#define msc_data_rx_cb msc_data_rx
+#define msc_data_tx_cb msc_data_tx
+#endif  /* SCSI_STATS_BUSY || USB_TRACE */
+
 //  Index of MSC interface.
 static uint8_t msc_interface_index = 0;
 
@@ -873,8 +1187,17 @@ static int msc_control_request(usbd_device *usbd_dev,
 	(void)usbd_dev;
 	switch (req->bRequest) {
 	case USB_MSC_REQ_BULK_ONLY_RESET:
-		/* Do any special reset code here. */
+		/* Forget the transaction.  The host clears the endpoint halts
+		 * next, which also drops any packet still waiting on IN. */
 		//  dump_usb_request("msc", req); ////
+		if ((0 != req->wValue) || (0 != req->wLength)) {
+			return USBD_REQ_NOTSUPP;
+		}
+		if ((0 < _mass_storage.trans.block_count) && (NULL != _mass_storage.unlock)) {
+			(*_mass_storage.unlock)();
+		}
+		reset_trans(&_mass_storage.trans);
+		_mass_storage.reset_required = false;
 		return USBD_REQ_HANDLED;
 	case USB_MSC_REQ_GET_MAX_LUN:
 		/* Return the number of LUNs.  We use 0. */
@@ -887,6 +1210,46 @@ static int msc_control_request(usbd_device *usbd_dev,
 	return USBD_REQ_NEXT_CALLBACK;  //  Previously USBD_REQ_NOTSUPP. Allow unknown requests to fall to next callback e.g. CDC.
 }
 
+static void send_held_csw(usbd_device *usbd_dev, struct usb_setup_data *req)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_msc_trans *trans = &ms->trans;
+
+	(void)req;
+	/* The host cleared the stalled data phase, the CSW is next. */
+	trans->csw_after_clear = false;
+	trans->csw_valid = true;
+	trans->csw_sent += usbd_ep_write_packet(usbd_dev, ms->ep_in,
+			trans->csw.buf, sizeof(struct usb_msc_csw));
+}
+
+/** @brief Handle CLEAR_FEATURE(ENDPOINT_HALT) on the bulk endpoints.  The
+ *	   libopencm3 core clears the halt.
+ */
+static int msc_endpoint_request(usbd_device *usbd_dev,
+				struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+				usbd_control_complete_callback *complete)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void)usbd_dev;
+	(void)buf;
+	(void)len;
+	if ((USB_REQ_CLEAR_FEATURE != req->bRequest) ||
+	    (USB_FEAT_ENDPOINT_HALT != req->wValue) ||
+	    ((ms->ep_in != req->wIndex) && (ms->ep_out != req->wIndex))) {
+		return USBD_REQ_NEXT_CALLBACK;
+	}
+	if (ms->reset_required) {
+		/* Stay stalled until the Bulk-Only Mass Storage Reset. */
+		return USBD_REQ_HANDLED;
+	}
+	if ((ms->ep_in == req->wIndex) && ms->trans.csw_after_clear) {
+		*complete = send_held_csw;
+	}
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
 /** @brief Setup the endpoints to be bulk & register the callbacks. */
 static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
@@ -905,8 +1268,15 @@ static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
 				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
 				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
 				msc_control_request);
+	if (status >= 0) {
+		status = aggregate_register_callback(
+				usbd_dev,
+				USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_ENDPOINT,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				msc_endpoint_request);
+	}
 	if (status < 0) {
-    	debug_println("*** msc_set_config failed"); debug_flush(); ////
+    	log_error("*** msc_set_config failed"); log_flush(); ////
 	}
 }
 
@@ -931,6 +1301,12 @@ static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
 		block.  Must _NOT_ be NULL.
 @param[in] write_block The function called when the host requests to write a
 		LBA block.  Must _NOT_ be NULL.
+@param[in] sync_cache The function called when the host requests SYNCHRONIZE
+		CACHE or an eject, to commit any cached writes.  May be NULL.
+@param[in] eject The function called after the host ejected the medium with
+		START STOP UNIT and got the status.  May be NULL.
+@param[in] medium_present The function called on TEST UNIT READY, returns
+		false to report the medium removed.  May be NULL.
 
 @return Pointer to the usbd_mass_storage struct.
 */
@@ -943,6 +1319,9 @@ usbd_mass_storage *custom_usb_msc_init(usbd_device *usbd_dev,
 				 const uint32_t block_count,
 				 int (*read_block)(uint32_t lba, uint8_t *copy_to),
 				 int (*write_block)(uint32_t lba, const uint8_t *copy_from),
+				 void (*sync_cache)(void),
+				 void (*eject)(void),
+				 bool (*medium_present)(void),
 				 uint8_t msc_interface_index0)  //  Index of MSC interface
 {
     //  debug_println("custom_usb_msc_init"); // debug_flush(); ////
@@ -958,25 +1337,76 @@ usbd_mass_storage *custom_usb_msc_init(usbd_device *usbd_dev,
 	_mass_storage.block_count = block_count - 1;
 	_mass_storage.read_block = read_block;
 	_mass_storage.write_block = write_block;
+	_mass_storage.sync_cache = sync_cache;
+	_mass_storage.eject = eject;
+	_mass_storage.medium_present = medium_present;
+	_mass_storage.eject_pending = false;
 	_mass_storage.lock = NULL;
 	_mass_storage.unlock = NULL;
 
-	_mass_storage.trans.lba_start = 0xffffffff;
-	_mass_storage.trans.block_count = 0;
-	_mass_storage.trans.current_block = 0;
-	_mass_storage.trans.cbw_cnt = 0;
-	_mass_storage.trans.bytes_to_read = 0;
-	_mass_storage.trans.bytes_to_write = 0;
-	_mass_storage.trans.byte_count = 0;
-	_mass_storage.trans.csw_valid = false;
-	_mass_storage.trans.csw_sent = 0;
+	_mass_storage.reset_required = false;
+	reset_trans(&_mass_storage.trans);
 
 	set_sbc_status_good(&_mass_storage);
 
 	int status = aggregate_register_config_callback(usbd_dev, msc_set_config);
-	if (status < 0) { debug_println("*** custom_usb_msc_init failed"); debug_flush(); }
+	if (status < 0) { log_error("*** custom_usb_msc_init failed"); log_flush(); }
 
 	return &_mass_storage;
 }
 
+/** @brief Continues a WRITE (10) that the application's MSC stack had started
+	   when it handed over to the bootloader, see handover.c.
+
+@param[in] cbw_tag The tag of the application's CBW, returned in the CSW.
+@param[in] lba The first block of the application's WRITE (10).
+@param[in] block_count The number of blocks in the WRITE (10).
+@param[in] transfer_length The data transfer length of the application's CBW.
+@param[in] blocks_remaining The number of blocks the host has still to send.
+@param[in] packet Data the host had already sent for the next block.
+@param[in] packet_len The length of packet, 0 if none.
+*/
+void custom_usb_msc_handover(uint32_t cbw_tag, uint32_t lba, uint32_t block_count,
+			     uint32_t transfer_length, uint32_t blocks_remaining,
+			     const uint8_t *packet, uint16_t packet_len)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+	struct usb_msc_trans *trans = &ms->trans;
+	uint8_t *buf = get_cbw_buf(trans);
+
+	/* Rebuild the application's CBW, then skip the blocks it had
+	 * received: the caller has written the last of them. */
+	reset_trans(trans);
+	memset(&trans->cbw, 0, sizeof(struct usb_msc_cbw));
+	trans->cbw.cbw.dCBWSignature = CBW_SIGNATURE;
+	trans->cbw.cbw.dCBWTag = cbw_tag;
+	trans->cbw.cbw.dCBWDataTransferLength = transfer_length;
+	trans->cbw.cbw.bCBWCBLength = 10;
+	buf[0] = SCSI_WRITE_10;
+	buf[2] = lba >> 24;
+	buf[3] = lba >> 16;
+	buf[4] = lba >> 8;
+	buf[5] = lba;
+	buf[7] = block_count >> 8;
+	buf[8] = block_count;
+	trans->cbw_cnt = sizeof(struct usb_msc_cbw);
+
+	scsi_stats_begin(SCSI_WRITE_10);
+	scsi_command(ms, trans, EVENT_CBW_VALID);
+	trans->current_block = block_count - blocks_remaining;
+	trans->byte_count = trans->current_block << 9;
+
+	packet_len = MIN(packet_len, trans->bytes_to_read - trans->byte_count);
+	memcpy(trans->msd_buf, packet, packet_len);
+	trans->byte_count += packet_len;
+
+	if (trans->byte_count == trans->bytes_to_read) {
+		/* The handed block was the last one, only the CSW is left. */
+		scsi_command(ms, trans, EVENT_NEED_STATUS);
+		trans->csw_valid = true;
+		trans->csw_sent = usbd_ep_write_packet(ms->usbd_dev, ms->ep_in,
+				trans->csw.buf, sizeof(struct usb_msc_csw));
+	}
+}
+
 /** @} */
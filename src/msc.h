@@ -160,5 +160,26 @@ struct _usbd_driver {
 	uint16_t rx_fifo_size;
 };
 
+/* Defined in msc.c for every interface configuration, so declared here
+ * outside any interface #ifdef. */
+#include <libopencm3/usb/msc.h>
+
+usbd_mass_storage *custom_usb_msc_init(usbd_device *usbd_dev,
+				 uint8_t ep_in, uint8_t ep_in_size,
+				 uint8_t ep_out, uint8_t ep_out_size,
+				 const char *vendor_id,
+				 const char *product_id,
+				 const char *product_revision_level,
+				 const uint32_t block_count,
+				 int (*read_block)(uint32_t lba, uint8_t *copy_to),
+				 int (*write_block)(uint32_t lba, const uint8_t *copy_from),
+				 void (*sync_cache)(void),
+				 void (*eject)(void),
+				 bool (*medium_present)(void),
+				 uint8_t msc_interface_index0);
+void custom_usb_msc_handover(uint32_t cbw_tag, uint32_t lba, uint32_t block_count,
+			     uint32_t transfer_length, uint32_t blocks_remaining,
+			     const uint8_t *packet, uint16_t packet_len);
+
 #endif
 
@@ -0,0 +1,90 @@
+//  Span profiler and PC sampler.  See profile.h.
+#include <string.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/rcc.h>
+#include "config.h"
+#include "profile.h"
+
+#ifdef PROFILE_SPANS
+
+//  The cycle counter is started by boot_timeline_start() in dapboot.c.
+ProfileTable profileTable;
+
+void profile_reset(void) {
+    memset(&profileTable, 0, sizeof(profileTable));
+    profileTable.span_count = SPAN_COUNT;
+    for (int i = 0; i < SPAN_COUNT; i++) {
+        profileTable.spans[i].min = 0xffffffff;
+    }
+}
+
+void profile_record(enum ProfileSpan span, uint32_t cycles) {
+    //  Only called from the main loop, USB is polled, so no locking is needed.
+    ProfileSpanStats *s = &profileTable.spans[span];
+    if (profileTable.span_count == 0) { profile_reset(); }
+    profileTable.cpu_hz = rcc_ahb_frequency;
+    s->count++;
+    if (cycles < s->min) { s->min = cycles; }
+    if (cycles > s->max) { s->max = cycles; }
+    uint32_t lo = s->total_lo + cycles;
+    if (lo < s->total_lo) { s->total_hi++; }
+    s->total_lo = lo;
+}
+
+#endif  //  PROFILE_SPANS
+
+#ifdef PROFILE_SAMPLES
+
+ProfileSamples profileSamples;
+
+void profile_samples_reset(void) {
+    memset(&profileSamples, 0, sizeof(profileSamples));
+    profileSamples.base = PROFILE_SAMPLE_BASE;
+    profileSamples.shift = PROFILE_SAMPLE_SHIFT;
+    profileSamples.bucket_count = PROFILE_SAMPLE_BUCKETS;
+}
+
+void profile_sampler_start(void) {
+    //  Call after the clock setup, the reload value depends on the AHB clock.
+    profile_samples_reset();
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+    systick_set_reload(rcc_ahb_frequency / PROFILE_SAMPLE_HZ - 1);
+    systick_interrupt_enable();
+    systick_counter_enable();
+}
+
+void profile_sampler_stop(void) {
+    //  Don't leave SysTick running for the application.
+    systick_interrupt_disable();
+    systick_counter_disable();
+}
+
+void profile_sample(const uint32_t *frame);
+
+void profile_sample(const uint32_t *frame) {
+    //  frame is the exception stack frame: r0-r3, r12, lr, pc, xpsr.
+    uint32_t pc = frame[6];
+    uint32_t bucket = (pc - PROFILE_SAMPLE_BASE) >> PROFILE_SAMPLE_SHIFT;
+    profileSamples.total++;
+    if (bucket >= PROFILE_SAMPLE_BUCKETS) {
+        profileSamples.other++;
+    } else if (profileSamples.buckets[bucket] != 0xffff) {
+        profileSamples.buckets[bucket]++;
+    }
+}
+
+void sys_tick_handler(void) __attribute__((naked));
+
+void sys_tick_handler(void) {
+    //  Pass the stack frame of the interrupted code to profile_sample().  Naked so that
+    //  no registers are pushed before we read the stack pointer.
+    __asm__ volatile(
+        "tst lr, #4    \n"
+        "ite eq        \n"
+        "mrseq r0, msp \n"
+        "mrsne r0, psp \n"
+        "b profile_sample \n"
+    );
+}
+
+#endif  //  PROFILE_SAMPLES
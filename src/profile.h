@@ -0,0 +1,105 @@
+//  Span profiler: cycle counts of the USB, SCSI and flash hot paths, measured with DWT_CYCCNT.
+//  Build with -D PROFILE_SPANS to enable.  Otherwise the macros below compile to nothing.
+//  Read the table with VENDOR_REQ_PROFILE and scripts/profile_dump.py.
+//
+//  PC sampler: SysTick interrupt that counts the interrupted PC in a histogram of the bootloader
+//  flash, to find hotspots that have no span.  Build with -D PROFILE_SAMPLES to enable.
+//  Read the histogram with VENDOR_REQ_SAMPLES and scripts/pc_profile.py.
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include <stdint.h>
+#include "config.h"
+
+//  Keep in sync with SPAN_NAMES in scripts/profile_dump.py.
+enum ProfileSpan {
+    SPAN_SCSI_COMMAND = 0,
+    SPAN_READ_BLOCK,
+    SPAN_WRITE_BLOCK_CORE,
+    SPAN_FLUSH_FLASH,
+    SPAN_FLASH_PROGRAM,
+    SPAN_AGGREGATE_CALLBACK,
+    SPAN_USBD_POLL,
+    SPAN_COUNT
+};
+
+#ifdef PROFILE_SPANS
+
+#include <libopencm3/cm3/dwt.h>
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;    //  Cycles.
+    uint32_t max;    //  Cycles.
+    uint32_t total_lo;  //  Total cycles, 64 bits.  Split so the layout has no padding.
+    uint32_t total_hi;
+} ProfileSpanStats;
+
+typedef struct {
+    uint32_t span_count;  //  SPAN_COUNT
+    uint32_t cpu_hz;      //  To convert cycles to time.
+    ProfileSpanStats spans[SPAN_COUNT];
+} ProfileTable;
+
+extern ProfileTable profileTable;
+
+extern void profile_record(enum ProfileSpan span, uint32_t cycles);
+extern void profile_reset(void);
+
+typedef struct {
+    uint32_t start;
+    enum ProfileSpan span;
+} ProfileScope;
+
+static inline void profile_scope_end(ProfileScope *scope) {
+    profile_record(scope->span, DWT_CYCCNT - scope->start);
+}
+
+//  Time the rest of the enclosing block, including early returns.
+#define PROFILE_SCOPE(span) \
+    ProfileScope profile_scope __attribute__((cleanup(profile_scope_end))) = { DWT_CYCCNT, span }
+//  Time the statements between PROFILE_BEGIN and PROFILE_END in the same block.
+#define PROFILE_BEGIN(span) uint32_t profile_start_##span = DWT_CYCCNT
+#define PROFILE_END(span)   profile_record(span, DWT_CYCCNT - profile_start_##span)
+
+#else  //  PROFILE_SPANS
+
+#define PROFILE_SCOPE(span) do {} while (0)
+#define PROFILE_BEGIN(span) do {} while (0)
+#define PROFILE_END(span)   do {} while (0)
+
+#endif  //  PROFILE_SPANS
+
+#ifdef PROFILE_SAMPLES
+
+#define PROFILE_SAMPLE_HZ    4001         //  Not a multiple of the 1 ms loop, so periodic work doesn't alias.
+#define PROFILE_SAMPLE_BASE  0x08000000   //  Start of the bootloader flash.
+#define PROFILE_SAMPLE_SHIFT 5            //  32-byte buckets.
+#define PROFILE_SAMPLE_BUCKETS ((APP_BASE_ADDRESS - PROFILE_SAMPLE_BASE) >> PROFILE_SAMPLE_SHIFT)
+
+typedef struct {
+    uint32_t base;          //  PROFILE_SAMPLE_BASE
+    uint32_t shift;         //  PROFILE_SAMPLE_SHIFT
+    uint32_t bucket_count;  //  PROFILE_SAMPLE_BUCKETS
+    uint32_t total;         //  All samples, including those outside the buckets.
+    uint32_t other;         //  Samples outside the bootloader flash, e.g. code in RAM.
+    uint16_t buckets[PROFILE_SAMPLE_BUCKETS];  //  Saturate at 0xffff.
+} ProfileSamples;
+
+extern ProfileSamples profileSamples;
+
+extern void profile_sampler_start(void);
+extern void profile_sampler_stop(void);
+extern void profile_samples_reset(void);
+
+#define PROFILE_SAMPLER_START() profile_sampler_start()
+#define PROFILE_SAMPLER_STOP()  profile_sampler_stop()
+
+#else  //  PROFILE_SAMPLES
+
+#define PROFILE_SAMPLER_START() do {} while (0)
+#define PROFILE_SAMPLER_STOP()  do {} while (0)
+
+#endif  //  PROFILE_SAMPLES
+
+#endif  //  PROFILE_H_INCLUDED
@@ -0,0 +1,71 @@
+//  SCSI command statistics.  See scsi_stats.h.
+#include <stddef.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include "scsi_stats.h"
+
+//  Only the commands sent by Windows, macOS and Linux while flashing get their own entry.  READ
+//  and WRITE come first, STATS.TXT is cut short if the lines don't fit.
+static ScsiOpStats ops[] = {
+    { .opcode = 0x2a, .name = "WRITE-10" },
+    { .opcode = 0x28, .name = "READ-10" },
+    { .opcode = 0x00, .name = "TEST-UNIT-READY" },
+    { .opcode = 0x03, .name = "REQUEST-SENSE" },
+    { .opcode = 0x12, .name = "INQUIRY" },
+    { .opcode = 0x1a, .name = "MODE-SENSE-6" },
+    { .opcode = 0x1e, .name = "PREVENT-ALLOW" },
+    { .opcode = 0x23, .name = "READ-FORMAT-CAP" },
+    { .opcode = 0x25, .name = "READ-CAPACITY" },
+    { .opcode = SCSI_STATS_OTHER, .name = "OTHER" },
+};
+#define OP_COUNT (sizeof(ops) / sizeof(ops[0]))
+
+ScsiStats scsiStats = { .ops = ops, .op_count = OP_COUNT };
+
+static ScsiOpStats *current;  //  Command in progress, NULL between commands.
+static uint32_t startCycles;
+static uint32_t busyCycles;
+
+static uint32_t cycles_to_us(uint32_t cycles) {
+    return cycles / (rcc_ahb_frequency / 1000000);
+}
+
+void scsi_stats_begin(uint8_t opcode) {
+    //  Called when a complete CBW has been received.  The cycle counter is started by
+    //  boot_timeline_start() in dapboot.c, it wraps after a minute at 72 MHz.
+    uint32_t i;
+    for (i = 0; i < OP_COUNT - 1; i++) {
+        if (ops[i].opcode == opcode) { break; }
+    }
+    current = &ops[i];
+    startCycles = DWT_CYCCNT;
+    busyCycles = 0;
+}
+
+void scsi_stats_busy(uint32_t cycles) {
+    busyCycles += cycles;
+}
+
+void scsi_stats_end(uint32_t bytes, int to_device, int failed) {
+    //  Called when the CSW has been sent.
+    ScsiOpStats *op = current;
+    if (op == NULL) { return; }
+    current = NULL;
+    uint32_t us = cycles_to_us(DWT_CYCCNT - startCycles);
+    uint32_t bucket = 0;
+    while (us > 1 && bucket < SCSI_STATS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    if (op->histogram[bucket] != 0xffff) { op->histogram[bucket]++; }
+    op->count++;
+    if (failed) { op->failed++; }
+    op->bytes += bytes;
+    op->busy_us += cycles_to_us(busyCycles);
+    if (to_device) { scsiStats.bytes_in += bytes; }
+    else { scsiStats.bytes_out += bytes; }
+}
+
+void scsi_stats_ctrl_stall(void) {
+    scsiStats.ctrl_stalls++;
+}
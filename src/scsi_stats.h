@@ -0,0 +1,38 @@
+//  SCSI command statistics: per-opcode latency histograms from CBW received to CSW sent, and the
+//  bytes moved.  Rendered as STATS.TXT on the drive, see ghostfat.c.
+//  Build with -D SCSI_STATS_BUSY to also time the bulk endpoint callbacks, "cb-ms" in STATS.TXT.
+//  That reads DWT_CYCCNT around every packet, so it is off by default.
+#ifndef SCSI_STATS_H_INCLUDED
+#define SCSI_STATS_H_INCLUDED
+
+#include <stdint.h>
+
+#define SCSI_STATS_BUCKETS 16  //  Bucket n counts commands taking 2^n to 2^(n+1) us, the last one also longer.
+#define SCSI_STATS_OTHER   0xff  //  Opcode of the catch-all entry for the opcodes not tracked.
+
+typedef struct {
+    uint8_t opcode;
+    const char *name;
+    uint32_t count;    //  Commands completed.
+    uint32_t failed;   //  Commands that completed with a failed CSW status.
+    uint32_t bytes;    //  Data phase bytes in either direction.
+    uint32_t busy_us;  //  Time spent in the bulk endpoint callbacks, with SCSI_STATS_BUSY only.
+    uint16_t histogram[SCSI_STATS_BUCKETS];  //  Saturating counts.
+} ScsiOpStats;
+
+typedef struct {
+    ScsiOpStats *ops;
+    uint32_t op_count;
+    uint32_t bytes_in;     //  Host to device.
+    uint32_t bytes_out;    //  Device to host.
+    uint32_t ctrl_stalls;  //  Control requests rejected with a stall.
+} ScsiStats;
+
+extern ScsiStats scsiStats;
+
+extern void scsi_stats_begin(uint8_t opcode);
+extern void scsi_stats_busy(uint32_t cycles);
+extern void scsi_stats_end(uint32_t bytes, int to_device, int failed);
+extern void scsi_stats_ctrl_stall(void);
+
+#endif  //  SCSI_STATS_H_INCLUDED
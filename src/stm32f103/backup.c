@@ -36,6 +36,10 @@ void backup_write(enum BackupRegister reg, uint32_t value) {
 }
 
 uint32_t backup_read(enum BackupRegister reg) {
+    //  Also called before platform_setup(), e.g. for the app valid cache: without the clocks BKP reads 0.
+    rcc_periph_clock_enable(RCC_PWR);
+    rcc_periph_clock_enable(RCC_BKP);
+
     //  Previously: (void)reg; return *(volatile uint32_t*)0x2000f000;
     uint32_t value = ((uint32_t)RTC_BKP_DR((int)reg*2+1) << 16)
                    | ((uint32_t)RTC_BKP_DR((int)reg*2) << 0);
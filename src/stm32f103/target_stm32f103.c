@@ -23,11 +23,16 @@
 #include <libopencm3/stm32/st_usbfs.h>
 #include <libopencm3/stm32/flash.h>
 #include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/crc.h>
 #include <libopencm3/cm3/scb.h>
 #include <logger.h>
 #include "target.h"
 #include "config.h"
 #include "backup.h"
+#include "boot_mailbox.h"
+#include "uf2cfg.h"
+#include "flash_stats.h"
+#include "profile.h"
 
 #ifndef USES_GPIOA
 #if (HAVE_USB_PULLUP_CONTROL == 0)
@@ -45,11 +50,19 @@
 #define USES_GPIOC 0
 #endif
 
+//  Build with -D FAST_BOOT=1 to boot straight into a valid app on power on, without the 1 second
+//  bootloader window.  Pressing reset still enters the bootloader.  Off by default, so power on keeps
+//  the bootloader's usual behaviour.
+#ifndef FAST_BOOT
+#define FAST_BOOT 0
+#endif
+
 #ifdef FLASH_SIZE_OVERRIDE
 _Static_assert((FLASH_BASE + FLASH_SIZE_OVERRIDE >= APP_BASE_ADDRESS),
                "Incompatible flash size");
 #endif
 
+/* Commands in BKP0, the fallback of the boot mailbox */
 static const uint32_t CMD_BOOT = 0x544F4F42UL;
 static const uint32_t CMD_APP = 0x3f82722aUL;
 
@@ -172,36 +185,125 @@ const usbd_driver* target_usb_init(void) {
     return &st_usbfs_v1_usb_driver;
 }
 
-void target_manifest_app(void) {
-    backup_write(BKP0, CMD_APP);
+const usbd_driver* target_usb_handover(void) {
+    /* The application left the USB peripheral running: no reset pulse
+       and no reconnect, or the host would enumerate the device again */
+    return &st_usbfs_v1_usb_driver;
+}
+
+/* In section .noinit at BOOT_MAILBOX_BASE, see stm32f103x8.ld */
+volatile BootMailbox boot_mailbox __attribute__((section(".noinit.mailbox")));
+
+/* Command taken from the mailbox or BKP0 at reset, BOOT_CMD_INVALID until then */
+#define BOOT_CMD_INVALID 0xffffffffUL
+static uint32_t boot_command = BOOT_CMD_INVALID;
+
+static uint32_t mailbox_crc(void) {
+    return target_crc32((const uint32_t*)&boot_mailbox, 3);
+}
+
+static bool mailbox_valid(void) {
+    return boot_mailbox.magic == BOOT_MAILBOX_MAGIC && boot_mailbox.crc == mailbox_crc();
+}
+
+void target_manifest_command(uint32_t command, uint32_t session) {
+    /* Also called by applications through the flash services: no RAM but the mailbox */
+    boot_mailbox.magic = BOOT_MAILBOX_MAGIC;
+    boot_mailbox.command = command;
+    boot_mailbox.session = session;
+    boot_mailbox.crc = mailbox_crc();
     scb_reset_system();
 }
 
-bool target_get_force_app(void) {
-    if (backup_read(BKP0) == CMD_APP) {
+uint32_t target_get_boot_session(void) {
+    /* Also called by applications through the flash services */
+    return mailbox_valid() ? boot_mailbox.session : 0;
+}
+
+static uint32_t take_boot_command(void) {
+    /* The mailbox is left valid with BOOT_CMD_NONE, so the application can read the session */
+    if (boot_command != BOOT_CMD_INVALID) {
+        return boot_command;
+    }
+    if (mailbox_valid()) {
+        boot_command = boot_mailbox.command;
+        boot_mailbox.command = BOOT_CMD_NONE;
+        boot_mailbox.crc = mailbox_crc();
+        return boot_command;
+    }
+    /* Fall back to the backup register, only written back when set.  This runs
+     * before platform_setup(): backup_read() turns on the PWR and BKP clocks,
+     * without them BKP0 reads 0 and the command would be lost. */
+    uint32_t cmd = backup_read(BKP0);
+    boot_command = (cmd == CMD_BOOT) ? BOOT_CMD_BOOTLOADER
+                 : (cmd == CMD_APP) ? BOOT_CMD_FAST_BOOT
+                 : BOOT_CMD_NONE;
+    if (cmd != 0) {
         backup_write(BKP0, 0);
-        return true;        
     }
+    return boot_command;
+}
+
+void target_manifest_app(void) {
+    /* Pass the session back to the application */
+    target_manifest_command(BOOT_CMD_FAST_BOOT, target_get_boot_session());
+}
+
+void target_manifest_bootloader(void) {
+    target_manifest_command(BOOT_CMD_BOOTLOADER, 0);
+}
+
+void target_manifest_ram_image(void) {
+    /* SRAM keeps the image across the reset, the bootloader jumps to it first thing */
+    target_manifest_command(BOOT_CMD_RUN_RAM, target_get_boot_session());
+}
+
+uint32_t target_get_boot_command(void) {
+    return take_boot_command();
+}
+
+bool target_get_force_app(void) {
+    return take_boot_command() == BOOT_CMD_FAST_BOOT;
+}
+
+bool target_get_fast_boot(void) {
+    /* Only the mailbox, the backup registers and reset flags are checked: this runs before clock and GPIO setup,
+     * backup_read() turns on the PWR and BKP clocks it needs */
+    uint32_t reset_flags = RCC_CSR;
+    RCC_CSR |= RCC_CSR_RMVF;
+    uint32_t cmd = take_boot_command();
+    if (cmd == BOOT_CMD_FAST_BOOT) {
+        // we were told to reset into app
+        return true;
+    }
+#if FAST_BOOT
+    if (cmd == BOOT_CMD_NONE && (reset_flags & RCC_CSR_PORRSTF)) {
+        return true;
+    }
+#else
+    (void)reset_flags;
+#endif
     return false;
 }
 
 bool target_get_force_bootloader(void) {
     bool force = true;
-    /* Check the RTC backup register */
-    uint32_t cmd = backup_read(BKP0);
-    if (cmd == CMD_BOOT) {
-        // asked to go into bootloader?
-        backup_write(BKP0, 0);
+    uint32_t cmd = take_boot_command();
+    if (cmd == BOOT_CMD_BOOTLOADER || cmd == BOOT_CMD_MSC_ONLY || cmd == BOOT_CMD_DFU_ONLY ||
+        cmd == BOOT_CMD_RUN_RAM) {
+        // asked to go into bootloader, or the RAM image was not valid?
         return true;
     }
-    if (cmd == CMD_APP) {        
+    if (cmd == BOOT_CMD_FAST_BOOT) {
         // we were told to reset into app
-        backup_write(BKP0, 0);
         return false;
     }
 
-    // a reset now should go into app
-    backup_write(BKP0, CMD_APP);
+    // a reset now should go into app, without the backup domain write sequence
+    boot_mailbox.magic = BOOT_MAILBOX_MAGIC;
+    boot_mailbox.command = BOOT_CMD_FAST_BOOT;
+    boot_mailbox.session = 0;
+    boot_mailbox.crc = mailbox_crc();
 
 #if HAVE_BUTTON
     /* Check if the user button is held down */
@@ -234,17 +336,21 @@ static uint16_t* get_flash_end(void) {
 }
 
 size_t target_get_max_firmware_size(void) {
-    uint8_t* flash_end = (uint8_t*)get_flash_end();
+    /* Keep out of the pages reserved by the bootloader at the end of flash */
+    uint8_t* flash_end = (uint8_t*)get_flash_end() - FLASH_RESERVED_SIZE;
     uint8_t* flash_start = (uint8_t*)(APP_BASE_ADDRESS);
 
     return (flash_end >= flash_start) ? (size_t)(flash_end - flash_start) : 0;
 }
 
-void target_relocate_vector_table(void) {
-    SCB_VTOR = APP_BASE_ADDRESS & 0xFFFF;
+void target_relocate_vector_table(uint32_t base) {
+    /* Flash is aliased at 0, an SRAM table needs the TBLBASE bit */
+    SCB_VTOR = (base >= 0x20000000) ? base : (base & 0xFFFF);
 }
 
 void target_flash_unlock(void) {
+    /* The app is about to change, check its CRC again on the next boot */
+    target_set_app_valid_cache(0);
     flash_unlock();
 }
 
@@ -257,6 +363,7 @@ static inline uint16_t* get_flash_page_address(uint16_t* dest) {
 }
 
 bool target_flash_program_array(uint16_t* dest, const uint16_t* data, size_t half_word_count) {
+    PROFILE_SCOPE(SPAN_FLASH_PROGRAM);
     bool verified = true;
 
     /* Remember the bounds of erased data in the current page */
@@ -282,6 +389,7 @@ bool target_flash_program_array(uint16_t* dest, const uint16_t* data, size_t hal
             erase_start = get_flash_page_address(dest);
             erase_end = erase_start + (FLASH_PAGE_SIZE)/sizeof(uint16_t);
             flash_erase_page((uint32_t)erase_start);
+            flash_stats_count_erase((uint32_t)erase_start);
         }
         flash_program_half_word((uint32_t)dest, *data);
         erase_start = dest + 1;
@@ -297,3 +405,50 @@ bool target_flash_program_array(uint16_t* dest, const uint16_t* data, size_t hal
 
     return verified;
 }
+
+void target_flash_erase_page(uint16_t* page) {
+    flash_erase_page((uint32_t)page);
+    flash_stats_count_erase((uint32_t)page);
+}
+
+bool target_flash_append_array(uint16_t* dest, const uint16_t* data, size_t half_word_count) {
+    /* Program flash that is already erased, e.g. to append to a log, without erasing the page */
+    const uint16_t* flash_end = get_flash_end();
+    while (half_word_count > 0) {
+        if (dest >= flash_end) {
+            return false;
+        }
+        flash_program_half_word((uint32_t)dest, *data);
+        if (*dest != *data) {
+            return false;
+        }
+        dest++;
+        data++;
+        half_word_count--;
+    }
+    return true;
+}
+
+uint32_t target_crc32(const uint32_t* data, size_t word_count) {
+    /* Hardware CRC unit: CRC-32/MPEG-2 (poly 0x04C11DB7, init 0xFFFFFFFF,
+       no reflection, no final XOR), fed one 32-bit word at a time */
+    rcc_periph_clock_enable(RCC_CRC);
+    crc_reset();
+    return crc_calculate_block((uint32_t*)data, (int)word_count);
+}
+
+uint32_t target_crc32_update(const uint32_t* data, size_t word_count) {
+    /* Continue the CRC from the last target_crc32() call */
+    return crc_calculate_block((uint32_t*)data, (int)word_count);
+}
+
+bool target_get_app_valid_cache(uint32_t crc) {
+    /* BKP1 holds the CRC of the last app image that passed the full check */
+    return crc != 0 && backup_read(BKP1) == crc;
+}
+
+void target_set_app_valid_cache(uint32_t crc) {
+    if (backup_read(BKP1) != crc) {
+        backup_write(BKP1, crc);
+    }
+}
@@ -26,16 +26,29 @@
 extern void target_clock_setup(void);
 extern void target_gpio_setup(void);
 extern const usbd_driver* target_usb_init(void);
+extern const usbd_driver* target_usb_handover(void);
 extern bool target_get_force_bootloader(void);
 extern bool target_get_force_app(void);
+extern bool target_get_fast_boot(void);
 extern void target_get_serial_number(char* dest, size_t max_chars);
 extern size_t target_get_max_firmware_size(void);
 extern void target_log(const char* str);
-extern void target_relocate_vector_table(void);
+extern void target_relocate_vector_table(uint32_t base);
 extern void target_manifest_app(void);
+extern void target_manifest_bootloader(void);
+extern void target_manifest_ram_image(void);
+extern void target_manifest_command(uint32_t command, uint32_t session);
+extern uint32_t target_get_boot_command(void);
+extern uint32_t target_get_boot_session(void);
 extern void target_flash_unlock(void);
 extern void target_flash_lock(void);
 extern bool target_flash_program_array(uint16_t* dest, const uint16_t* data, size_t half_word_count);
+extern void target_flash_erase_page(uint16_t* page);
+extern bool target_flash_append_array(uint16_t* dest, const uint16_t* data, size_t half_word_count);
+extern uint32_t target_crc32(const uint32_t* data, size_t word_count);
+extern uint32_t target_crc32_update(const uint32_t* data, size_t word_count);
+extern bool target_get_app_valid_cache(uint32_t crc);
+extern void target_set_app_valid_cache(uint32_t crc);
 extern void target_set_led(int on);
 
 extern void target_pre_main(void);
@@ -17,6 +17,15 @@
 // If set, the block is "comment" and should not be flashed to the device
 #define UF2_FLAG_NOFLASH 0x00000001
 #define UF2_FLAG_FAMILYID_PRESENT 0x00002000
+// The last 24 bytes of the data hold a UF2_MD5Region: the block need not be written if the flash
+// already matches the region
+#define UF2_FLAG_MD5 0x00004000
+// Not in the UF2 spec: the payload is an LZ4 block that expands within the flash page of targetAddr,
+// see lz4.h.  Also flagged NOFLASH, so tools and bootloaders that don't know it skip the block.
+#define UF2_FLAG_LZ4 0x00010000
+// Not in the UF2 spec either: the payload rebuilds the whole flash page at targetAddr, a CRC-32 of the
+// new page, see target_crc32(), then delta.h instructions.  Also flagged NOFLASH.
+#define UF2_FLAG_PATCH 0x00020000
 
 #define UF2_IS_MY_FAMILY(bl)                                                                       \
     (((bl)->flags & UF2_FLAG_FAMILYID_PRESENT) == 0 || (bl)->familyID == UF2_FAMILY)
@@ -46,6 +55,12 @@ typedef struct {
     uint32_t magicEnd;
 } UF2_Block;
 
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+    uint8_t md5[16];
+} UF2_MD5Region;
+
 typedef struct {
     uint8_t version;
     uint8_t ep_in;
@@ -54,11 +69,20 @@ typedef struct {
     uint32_t cbw_tag;
     uint32_t blocks_remaining;
     uint8_t *buffer;
+    // version 2: the WRITE(10) the block came in, so the bootloader can continue it as the host sent it
+    uint32_t cbw_lba;
+    uint32_t cbw_blocks;
+    uint32_t cbw_length;  // dCBWDataTransferLength
 } UF2_HandoverArgs;
 
+#define UF2_HANDOVER_VERSION 2
+
 int write_block(uint32_t lba, const uint8_t *copy_from);
 int read_block(uint32_t block_no, uint8_t *data);
 void ghostfat_1ms(void);
+void ghostfat_sync(void);
+void ghostfat_eject(void);
+bool ghostfat_medium_present(void);
 
 typedef void (*UF2_MSC_Handover_Handler)(UF2_HandoverArgs *handover);
 typedef void (*UF2_HID_Handover_Handler)(int ep);
@@ -71,7 +95,14 @@ typedef struct {
     const char *info_uf2;
 } UF2_BInfo;
 
-#define UF2_BINFO ((UF2_BInfo *)(APP_START_ADDRESS - sizeof(UF2_BInfo)))
+// placed by the bootloader's linker script in its last 16 bytes, right below the application
+#define UF2_BINFO ((UF2_BInfo *)(APP_BASE_ADDRESS - sizeof(UF2_BInfo)))
+
+// INFO_UF2.TXT without the statistics, see ghostfat.c
+extern const char infoUf2File[];
+
+// take over the application's USB mass storage transfer, see handover.c
+void handover_msc(UF2_HandoverArgs *handover);
 
 static inline bool is_uf2_block(const void *data) {
     const UF2_Block *bl = (const UF2_Block *)data;
@@ -80,7 +111,8 @@ static inline bool is_uf2_block(const void *data) {
 }
 
 static inline bool in_uf2_bootloader_space(const void *addr) {
-    return USER_FLASH_END <= (uint32_t)addr && (uint32_t)addr < FLASH_SIZE_OVERRIDE;
+    // the bootloader sits at the start of flash, below the application
+    return 0x08000000 <= (uint32_t)addr && (uint32_t)addr < APP_BASE_ADDRESS;
 }
 
 
@@ -103,9 +135,10 @@ static inline void hf2_handover(uint8_t ep) {
 }
 
 // the ep_in/ep_out are without the 0x80 mask
-// cbw_tag is in the same bit format as it came
+// cbw_tag is in the same bit format as it came, cbw_lba, cbw_blocks and cbw_length are from the CDB and CBW
 static inline void check_uf2_handover(uint8_t *buffer, uint32_t blocks_remaining, uint8_t ep_in,
-                                      uint8_t ep_out, uint32_t cbw_tag) {
+                                      uint8_t ep_out, uint32_t cbw_tag, uint32_t cbw_lba,
+                                      uint32_t cbw_blocks, uint32_t cbw_length) {
     if (!is_uf2_block(buffer))
         return;
 
@@ -115,7 +148,8 @@ static inline void check_uf2_handover(uint8_t *buffer, uint32_t blocks_remaining
     if (in_uf2_bootloader_space(board_info) && in_uf2_bootloader_space((const void *)fn) &&
         ((uint32_t)fn & 1)) {
         UF2_HandoverArgs hand = {
-            1, ep_in, ep_out, 0, cbw_tag, blocks_remaining, buffer,
+            UF2_HANDOVER_VERSION, ep_in, ep_out, 0, cbw_tag, blocks_remaining, buffer,
+            cbw_lba, cbw_blocks, cbw_length,
         };
         // Pass control to bootloader; never returns
         fn(&hand);
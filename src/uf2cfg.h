@@ -6,4 +6,15 @@
 #define VOLUME_LABEL "BLUEPILL"
 // where the UF2 files are allowed to write data - we allow MBR, since it seems part of the softdevice .hex file
 #define USER_FLASH_START (uint32_t)(APP_BASE_ADDRESS)
-#define USER_FLASH_END (0x08000000+FLASH_SIZE_OVERRIDE)
+#define USER_FLASH_END (0x08000000+FLASH_SIZE_OVERRIDE-FLASH_RESERVED_SIZE)
+// SRAM window where UF2 files may load an image to run without flashing it, above the bootloader's RAM
+// and below the no-init RAM, see stm32f103x8.ld and boot_timeline.h
+#define RAM_IMAGE_START 0x20002000
+#define RAM_IMAGE_END   0x20004F00
+// flash reserved by the bootloader at the end of flash, not writable by UF2 or DFU
+#define FLASH_RESERVED_SIZE (3 * FLASH_PAGE_SIZE)
+// key-value store for applications, two pages before the statistics, see kv_store.h
+#define KV_STORE_PAGE0 (0x08000000+FLASH_SIZE_OVERRIDE-3*FLASH_PAGE_SIZE)
+#define KV_STORE_PAGE1 (0x08000000+FLASH_SIZE_OVERRIDE-2*FLASH_PAGE_SIZE)
+// flash wear and flashing statistics, see flash_stats.h
+#define FLASH_STATS_PAGE (0x08000000+FLASH_SIZE_OVERRIDE-FLASH_PAGE_SIZE)
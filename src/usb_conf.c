@@ -35,7 +35,11 @@
 #include "winusb.h"
 #include "usb21_standard.h"
 #include "usb_conf.h"
+#include "vendor.h"
 #include "uf2.h"
+#include "profile.h"
+#include "scsi_stats.h"
+#include "usb_trace.h"
 
 static void set_aggregate_callback(
   usbd_device *usbd_dev,
@@ -217,20 +221,23 @@ static const struct usb_interface_descriptor dfu_iface = {
 
 #ifdef INTF_MSC
 //  MSC Interface
-static const struct usb_interface_descriptor msc_iface = {
-	.bLength = USB_DT_INTERFACE_SIZE,
-	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = INTF_MSC,
-	.bAlternateSetting = 0,
-	.bNumEndpoints = 2,
-	.bInterfaceClass = USB_CLASS_MSC,
-	.bInterfaceSubClass = USB_MSC_SUBCLASS_SCSI,
-	.bInterfaceProtocol = USB_MSC_PROTOCOL_BBB,
-    .iInterface = USB_STRINGS_MSC,  //  Name of MSC
-	.endpoint = msc_endp,  //  MSC Endpoints
-	.extra = NULL,
-	.extralen = 0
-};
+#define MSC_IFACE(number) { \
+	.bLength = USB_DT_INTERFACE_SIZE, \
+	.bDescriptorType = USB_DT_INTERFACE, \
+	.bInterfaceNumber = number, \
+	.bAlternateSetting = 0, \
+	.bNumEndpoints = 2, \
+	.bInterfaceClass = USB_CLASS_MSC, \
+	.bInterfaceSubClass = USB_MSC_SUBCLASS_SCSI, \
+	.bInterfaceProtocol = USB_MSC_PROTOCOL_BBB, \
+    .iInterface = USB_STRINGS_MSC,  /*  Name of MSC */ \
+	.endpoint = msc_endp,  /*  MSC Endpoints */ \
+	.extra = NULL, \
+	.extralen = 0 \
+}
+static const struct usb_interface_descriptor msc_iface = MSC_IFACE(INTF_MSC);
+//  The only interface for USB_FUNCTIONS_MSC_ONLY, so numbered 0.
+static const struct usb_interface_descriptor msc_only_iface = MSC_IFACE(0);
 #endif  //  INTF_MSC
 
 #ifdef INTF_COMM
@@ -317,6 +324,41 @@ static const struct usb_config_descriptor config = {
     .interface = interfaces,
 };
 
+#if defined(INTF_MSC) && INTF_MSC != 0
+//  Only the USB drive, after BOOT_CMD_MSC_ONLY, see boot_mailbox.h.
+static const struct usb_interface msc_only_interfaces[] = {{
+    .num_altsetting = 1,
+    .altsetting = &msc_only_iface,
+}};
+
+static const struct usb_config_descriptor msc_only_config = {
+    .bLength = USB_DT_CONFIGURATION_SIZE,
+    .bDescriptorType = USB_DT_CONFIGURATION,
+    .wTotalLength = 0,
+    .bNumInterfaces = 1,
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = 0x80,
+    .bMaxPower = 0xfa,
+    .interface = msc_only_interfaces,
+};
+#endif  //  INTF_MSC != 0
+
+#if defined(INTF_DFU) && defined(INTF_MSC)
+//  Only DFU, after BOOT_CMD_DFU_ONLY.  INTF_DFU is 0, the first interface.
+static const struct usb_config_descriptor dfu_only_config = {
+    .bLength = USB_DT_CONFIGURATION_SIZE,
+    .bDescriptorType = USB_DT_CONFIGURATION,
+    .wTotalLength = 0,
+    .bNumInterfaces = 1,
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = 0x80,
+    .bMaxPower = 0xfa,
+    .interface = interfaces,
+};
+#endif  //  INTF_DFU && INTF_MSC
+
 #ifdef USB21_INTERFACE
 //  BOS Capabilities for WebUSB and Microsoft Platform
 static const struct usb_device_capability_descriptor* capabilities[] = {
@@ -339,35 +381,56 @@ static const struct usb_bos_descriptor bos_descriptor = {
 static uint8_t usbd_control_buffer[USB_CONTROL_BUF_SIZE] __attribute__ ((aligned (2)));
 usbd_device* usbd_dev = NULL;
 
-usbd_device* usb_setup(void) {
+#ifdef INTF_MSC
+//  Interface number of the USB drive, 0 when it is the only one.
+static uint8_t msc_interface = INTF_MSC;
+#endif  //  INTF_MSC
+
+usbd_device* usb_setup(enum UsbFunctions functions) {
     int num_strings = sizeof(usb_strings) / sizeof(const char*);
     // debug_print("usb_setup num_strings "); debug_print_int(num_strings); debug_println(""); // debug_flush(); ////
+    //  Only the interfaces asked for, if the build has the others too.
+    const struct usb_config_descriptor *conf = &config;
+#if defined(INTF_MSC) && INTF_MSC != 0
+    if (functions == USB_FUNCTIONS_MSC_ONLY) {
+        conf = &msc_only_config;
+        msc_interface = 0;
+    }
+#endif  //  INTF_MSC != 0
+#if defined(INTF_DFU) && defined(INTF_MSC)
+    if (functions == USB_FUNCTIONS_DFU_ONLY) { conf = &dfu_only_config; }
+#endif  //  INTF_DFU && INTF_MSC
+    const bool all = (conf == &config);
+    (void) functions;  //  Without DFU and MSC.
     const usbd_driver* driver = target_usb_init();
-    usbd_dev = usbd_init(driver, &dev, &config, 
+    usbd_dev = usbd_init(driver, &dev, conf, 
         usb_strings, num_strings,
         usbd_control_buffer, sizeof(usbd_control_buffer));
 
     //  The following USB setup functions will call aggregate_register_callback() to register callbacks.
 #ifdef INTF_DFU    
-    dfu_setup(usbd_dev, &target_manifest_app, NULL, NULL);
+    if (all || functions == USB_FUNCTIONS_DFU_ONLY) { dfu_setup(usbd_dev, &target_manifest_app, NULL, NULL); }
 #endif  //  INTF_DFU
 #ifdef INTF_MSC    
-    msc_setup(usbd_dev);
+    if (all || functions == USB_FUNCTIONS_MSC_ONLY) { msc_setup(usbd_dev); }
 #endif  //  INTF_MSC
 #ifdef INTF_COMM    
-    cdc_setup(usbd_dev);
+    if (all) { cdc_setup(usbd_dev); }
 #endif  //  INTF_COMM
 
 #ifdef USB21_INTERFACE
     //  Define USB 2.1 BOS interface used by WebUSB.
 	usb21_setup(usbd_dev, &bos_descriptor);
 	webusb_setup(usbd_dev, origin_url);
-	winusb_setup(usbd_dev, INTF_DFU);  //  Previously INTF_DFU
+	if (all || functions == USB_FUNCTIONS_DFU_ONLY) { winusb_setup(usbd_dev, INTF_DFU); }  //  Previously INTF_DFU
 #endif  //  USB21_INTERFACE
 
+    //  Vendor requests for the host flashing tools, e.g. page CRC query.
+    vendor_setup(usbd_dev);
+
     //  Set the aggregate callback.    
 	int status = usbd_register_set_config_callback(usbd_dev, set_aggregate_callback);
-    if (status < 0) { debug_println("*** usb_setup failed"); debug_flush(); }
+    if (status < 0) { log_error("*** usb_setup failed"); log_flush(); }
 
     //  For WinUSB: Windows probes the compatible ID before setting the configuration, so also register the callback now.
     set_aggregate_callback(usbd_dev, (uint16_t) -1);
@@ -375,6 +438,27 @@ usbd_device* usb_setup(void) {
 }
 
 #ifdef INTF_MSC    
+//  Bulk endpoints of the MSC interface.  After a UF2 handover they are the application's, see handover.c.
+static uint8_t msc_ep_in = MSC_IN;
+static uint8_t msc_ep_out = MSC_OUT;
+
+usbd_device* usb_handover_setup(uint8_t ep_in, uint8_t ep_out) {
+    //  Serve the MSC interface on the endpoints the application used.  Unlike usb_setup(), the USB peripheral
+    //  is not reset or disconnected: the host keeps the address and configuration it gave the application.
+    int num_strings = sizeof(usb_strings) / sizeof(const char*);
+    msc_ep_in = 0x80 | ep_in;
+    msc_ep_out = ep_out;
+    usbd_dev = usbd_init(target_usb_handover(), &dev, &config, 
+        usb_strings, num_strings,
+        usbd_control_buffer, sizeof(usbd_control_buffer));
+
+    //  Only the MSC interface: the other interfaces' endpoints may clash with the application's.
+    msc_setup(usbd_dev);
+	int status = usbd_register_set_config_callback(usbd_dev, set_aggregate_callback);
+    if (status < 0) { log_error("*** usb_handover_setup failed"); log_flush(); }
+    return usbd_dev;
+}
+
 extern usbd_mass_storage *custom_usb_msc_init(usbd_device *usbd_dev,
 				 uint8_t ep_in, uint8_t ep_in_size,
 				 uint8_t ep_out, uint8_t ep_out_size,
@@ -384,6 +468,9 @@ extern usbd_mass_storage *custom_usb_msc_init(usbd_device *usbd_dev,
 				 const uint32_t block_count,
 				 int (*read_block)(uint32_t lba, uint8_t *copy_to),
 				 int (*write_block)(uint32_t lba, const uint8_t *copy_from),
+				 void (*sync_cache)(void),
+				 void (*eject)(void),
+				 bool (*medium_present)(void),
 				 uint8_t msc_interface_index0);
 
 void msc_setup(usbd_device* usbd_dev0) {
@@ -392,14 +479,15 @@ void msc_setup(usbd_device* usbd_dev0) {
     ramdisk_init();
 #endif  //  RAM_DISK
     
-    custom_usb_msc_init(usbd_dev0, MSC_IN, MAX_USB_PACKET_SIZE, MSC_OUT, MAX_USB_PACKET_SIZE, 
+    custom_usb_msc_init(usbd_dev0, msc_ep_in, MAX_USB_PACKET_SIZE, msc_ep_out, MAX_USB_PACKET_SIZE, 
         MSC_VENDOR_ID, MSC_PRODUCT_ID, MSC_PRODUCT_REVISION_LEVEL, 
 #ifdef RAM_DISK    
-        ramdisk_blocks(), ramdisk_read, ramdisk_write,
+        ramdisk_blocks(), ramdisk_read, ramdisk_write, NULL, NULL, NULL,
 #else
-        UF2_NUM_BLOCKS, read_block, write_block,
+        UF2_NUM_BLOCKS, read_block, write_block, ghostfat_sync, ghostfat_eject,
+        ghostfat_medium_present,
 #endif  //  RAM_DISK        
-        INTF_MSC
+        msc_interface
     );
 }
 #endif  //  INTF_MSC
@@ -427,7 +515,7 @@ int aggregate_register_config_callback(
 		config_callback[i] = callback;
 		return 0;
 	}
-    debug_println("*** ERROR: Too many config callbacks"); debug_flush();
+    log_error("*** ERROR: Too many config callbacks"); log_flush();
 	return -1;
 }
 
@@ -455,7 +543,7 @@ int aggregate_register_callback(
 		control_callback[i].cb = callback;
 		return 0;
 	}
-    debug_println("*** ERROR: Too many control callbacks"); debug_flush();
+    log_error("*** ERROR: Too many control callbacks"); log_flush();
 	return -1;
 }
 
@@ -476,6 +564,8 @@ static int aggregate_callback(
     uint16_t *len,
 	usbd_control_complete_callback *complete) {
     //  This callback is called whenever a USB request is received.  We route to the right driver callbacks.
+    PROFILE_SCOPE(SPAN_AGGREGATE_CALLBACK);
+    USB_TRACE_SETUP(req);
 	int i, result = 0;
     //  Call the callbacks registered by the drivers.
     for (i = 0; i < MAX_CONTROL_CALLBACK; i++) {
@@ -487,6 +577,7 @@ static int aggregate_callback(
                 buf,
                 len,
                 complete);
+            if (result == USBD_REQ_NOTSUPP) { scsi_stats_ctrl_stall(); }
             if (result == USBD_REQ_HANDLED ||
                 result == USBD_REQ_NOTSUPP) {
                 return result;
@@ -495,7 +586,7 @@ static int aggregate_callback(
     }
     if (!(req->bmRequestType == 0x80 && req->bRequest == 0x06)) {
         //  Dump the packet if not GET_DESCRIPTOR.
-	    dump_usb_request(">> ", req); debug_flush(); ////
+	    if (LOG_ENABLED(LOG_LEVEL_DEBUG)) { dump_usb_request(">> ", req); debug_flush(); } ////
     } 
 	return USBD_REQ_NEXT_CALLBACK;
 }
@@ -506,7 +597,7 @@ static void set_aggregate_callback(
     //  This callback is called when the device is updated.  We set our control callback.
     if (wValue != (uint16_t) -1) {  //  If this is an actual callback, not a call by usb_setup()...
         //  Call the config functions before setting our callback.
-        debug_println("set_aggregate_callback"); ////
+        log_info("set_aggregate_callback"); ////
         int i;
         for (i = 0; i < MAX_CONTROL_CALLBACK; i++) {
             if (!config_callback[i]) { break; }
@@ -520,7 +611,7 @@ static void set_aggregate_callback(
         0,  //  Register for all notifications.
         0,
 		aggregate_callback);
-	if (status < 0) { debug_println("*** ERROR: set_aggregate_callback failed"); debug_flush(); }  
+	if (status < 0) { log_error("*** ERROR: set_aggregate_callback failed"); log_flush(); }  
 }
 
 void usb_set_serial_number(const char* serial) {
@@ -532,6 +623,8 @@ void usb_set_serial_number(const char* serial) {
 }
 
 void dump_usb_request(const char *msg, struct usb_setup_data *req) {
+    (void) msg; (void) req;
+#if LOG_ENABLED(LOG_LEVEL_DEBUG)  //  Drop the descriptor names from flash unless we are debugging USB.
     uint8_t desc_type = usb_descriptor_type(req->wValue);
     uint8_t desc_index = usb_descriptor_index(req->wValue);
     debug_print(msg);
@@ -568,6 +661,7 @@ void dump_usb_request(const char *msg, struct usb_setup_data *req) {
         debug_print(" i "); debug_printhex(desc_index); 	
     }
     debug_println("");
+#endif  //  LOG_ENABLED(LOG_LEVEL_DEBUG)
 }
 
 /* CDC, MSC and DFU OK.  WebUSB failed.
@@ -69,8 +69,17 @@
 #endif  //  NOTUSED
 
 extern void usb_set_serial_number(const char* serial);
-extern usbd_device* usb_setup(void);
+//  USB interfaces served by usb_setup(), see BOOT_CMD_MSC_ONLY and BOOT_CMD_DFU_ONLY in boot_mailbox.h.  Only
+//  builds with the other interfaces too have a difference.
+enum UsbFunctions {
+    USB_FUNCTIONS_ALL = 0,
+    USB_FUNCTIONS_MSC_ONLY,
+    USB_FUNCTIONS_DFU_ONLY,
+};
+
+extern usbd_device* usb_setup(enum UsbFunctions functions);
 extern void msc_setup(usbd_device* usbd_dev0);
+extern usbd_device* usb_handover_setup(uint8_t ep_in, uint8_t ep_out);
 extern uint16_t send_msc_packet(const void *buf, int len);
 extern void dump_usb_request(const char *msg, struct usb_setup_data *req);
 extern int aggregate_register_config_callback(
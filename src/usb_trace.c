@@ -0,0 +1,70 @@
+//  USB transaction tracer.  See usb_trace.h.
+#include <string.h>
+#include <libopencm3/stm32/rcc.h>
+#include "usb_trace.h"
+
+#ifdef USB_TRACE
+
+//  The cycle counter is started by boot_timeline_start() in dapboot.c.
+UsbTrace usbTrace;
+
+void usb_trace_reset(void) {
+    memset(&usbTrace, 0, sizeof(usbTrace));
+    usbTrace.magic = USB_TRACE_MAGIC;
+    usbTrace.entry_count = USB_TRACE_ENTRIES;
+}
+
+UsbTraceEntry *usb_trace_add(uint32_t cycles, enum UsbTraceType type) {
+    //  Only called from the main loop, USB is polled, so no locking is needed.
+    if (usbTrace.magic != USB_TRACE_MAGIC) { usb_trace_reset(); }
+    usbTrace.cpu_hz = rcc_ahb_frequency;
+    UsbTraceEntry *e = &usbTrace.entries[usbTrace.next % USB_TRACE_ENTRIES];
+    usbTrace.next++;
+    memset(e, 0, sizeof(*e));
+    e->cycles = cycles;
+    e->type = type;
+    return e;
+}
+
+void usb_trace_setup(const void *setup) {
+    UsbTraceEntry *e = usb_trace_add(DWT_CYCCNT, TRACE_SETUP);
+    memcpy(e->data, setup, 8);
+}
+
+void usb_trace_cbw(const void *cbw) {
+    //  Fields of struct usb_msc_cbw in msc.c, which is packed.
+    const uint8_t *p = cbw;
+    const uint8_t *cdb = p + 15;
+    UsbTraceEntry *e = usb_trace_add(DWT_CYCCNT, TRACE_CBW);
+    e->flags = p[12];
+    e->arg16 = cdb[0];
+    memcpy(&e->arg[0], p + 4, 4);
+    memcpy(&e->arg[1], p + 8, 4);
+    if (cdb[0] == 0x28 || cdb[0] == 0x2a) {
+        e->arg[2] = ((uint32_t)cdb[2] << 24) | (cdb[3] << 16) | (cdb[4] << 8) | cdb[5];
+    } else if (cdb[0] == 0x08 || cdb[0] == 0x0a) {
+        e->arg[2] = ((cdb[1] & 0x1f) << 16) | (cdb[2] << 8) | cdb[3];
+    }
+}
+
+void usb_trace_csw(const void *csw, uint32_t bytes) {
+    //  Fields of struct usb_msc_csw in msc.c, which is packed.
+    const uint8_t *p = csw;
+    UsbTraceEntry *e = usb_trace_add(DWT_CYCCNT, TRACE_CSW);
+    e->flags = p[12];
+    memcpy(&e->arg[0], p + 4, 4);
+    memcpy(&e->arg[1], p + 8, 4);
+    e->arg[2] = bytes;
+}
+
+void usb_trace_callback(uint32_t start, uint8_t ep, uint32_t bytes_before, uint32_t bytes_after) {
+    uint32_t cycles = DWT_CYCCNT - start;
+    if (cycles < USB_TRACE_SLOW_US * (rcc_ahb_frequency / 1000000)) { return; }
+    UsbTraceEntry *e = usb_trace_add(start, TRACE_CALLBACK);
+    e->flags = ep;
+    e->arg[0] = cycles;
+    e->arg[1] = bytes_before;
+    e->arg[2] = bytes_after;
+}
+
+#endif  //  USB_TRACE
@@ -0,0 +1,92 @@
+//  USB transaction tracer: a RAM ring of setup packets, BOT commands and statuses, block reads and
+//  writes, and slow endpoint callbacks, timestamped with DWT_CYCCNT.  Build with -D USB_TRACE to
+//  enable.  Otherwise the macros below compile to nothing.
+//  Read the ring with VENDOR_REQ_TRACE and convert it to pcapng with scripts/usb_trace.py.
+#ifndef USB_TRACE_H_INCLUDED
+#define USB_TRACE_H_INCLUDED
+
+#include <stdint.h>
+
+//  Keep in sync with scripts/usb_trace.py.
+enum UsbTraceType {
+    TRACE_SETUP = 1,     //  data: the 8-byte setup packet.
+    TRACE_CBW,           //  flags: bmCBWFlags, arg16: opcode, arg: tag, data length, LBA.
+    TRACE_CSW,           //  flags: bCSWStatus, arg: tag, residue, bytes transferred.
+    TRACE_READ_BLOCK,    //  arg: LBA, cycles taken.
+    TRACE_WRITE_BLOCK,   //  arg: LBA, cycles taken.
+    TRACE_CALLBACK,      //  flags: endpoint, arg: cycles taken, data phase bytes before and after.
+};
+
+#ifdef USB_TRACE
+
+#include <libopencm3/cm3/dwt.h>
+
+#ifndef USB_TRACE_ENTRIES
+#define USB_TRACE_ENTRIES 128
+#endif  //  USB_TRACE_ENTRIES
+#ifndef USB_TRACE_SLOW_US
+#define USB_TRACE_SLOW_US 50  //  Only endpoint callbacks taking at least this long are recorded.
+#endif  //  USB_TRACE_SLOW_US
+
+#define USB_TRACE_MAGIC 0x43525455  //  "UTRC"
+
+typedef struct {
+    uint32_t cycles;  //  DWT_CYCCNT at the start of the event.
+    uint8_t type;     //  enum UsbTraceType
+    uint8_t flags;
+    uint16_t arg16;
+    union {
+        uint32_t arg[3];
+        uint8_t data[12];
+    };
+} UsbTraceEntry;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t cpu_hz;
+    uint32_t now;          //  DWT_CYCCNT when the host read the header, to align with host time.
+    uint32_t entry_count;  //  USB_TRACE_ENTRIES
+    uint32_t next;         //  Events recorded so far.  The ring holds the last entry_count.
+    UsbTraceEntry entries[USB_TRACE_ENTRIES];
+} UsbTrace;
+
+extern UsbTrace usbTrace;
+
+extern void usb_trace_reset(void);
+extern UsbTraceEntry *usb_trace_add(uint32_t cycles, enum UsbTraceType type);
+extern void usb_trace_setup(const void *setup);
+extern void usb_trace_cbw(const void *cbw);
+extern void usb_trace_csw(const void *csw, uint32_t bytes);
+extern void usb_trace_callback(uint32_t start, uint8_t ep, uint32_t bytes_before, uint32_t bytes_after);
+
+typedef struct {
+    uint32_t start;
+    enum UsbTraceType type;
+    uint32_t lba;
+} UsbTraceScope;
+
+static inline void usb_trace_scope_end(UsbTraceScope *scope) {
+    UsbTraceEntry *e = usb_trace_add(scope->start, scope->type);
+    e->arg[0] = scope->lba;
+    e->arg[1] = DWT_CYCCNT - scope->start;
+}
+
+//  Record a block read or write taking the rest of the enclosing block.
+#define USB_TRACE_BLOCK(type, lba) \
+    UsbTraceScope usb_trace_scope __attribute__((cleanup(usb_trace_scope_end))) = { DWT_CYCCNT, type, lba }
+#define USB_TRACE_SETUP(setup) usb_trace_setup(setup)
+#define USB_TRACE_CBW(cbw) usb_trace_cbw(cbw)
+#define USB_TRACE_CSW(csw, bytes) usb_trace_csw(csw, bytes)
+#define USB_TRACE_CALLBACK(start, ep, before, after) usb_trace_callback(start, ep, before, after)
+
+#else  //  USB_TRACE
+
+#define USB_TRACE_BLOCK(type, lba) do {} while (0)
+#define USB_TRACE_SETUP(setup) do {} while (0)
+#define USB_TRACE_CBW(cbw) do {} while (0)
+#define USB_TRACE_CSW(csw, bytes) do {} while (0)
+#define USB_TRACE_CALLBACK(start, ep, before, after) do { (void)(start); (void)(before); } while (0)
+
+#endif  //  USB_TRACE
+
+#endif  //  USB_TRACE_H_INCLUDED
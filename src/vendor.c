@@ -0,0 +1,166 @@
+//  Vendor control requests used by host-side flashing tools, e.g. uf2conv.py
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include <logger.h>
+#include "target.h"
+#include "config.h"
+#include "usb_conf.h"
+#include "vendor.h"
+#include "dmesg.h"
+#include "flash_stats.h"
+#include "profile.h"
+#include "usb_trace.h"
+
+#define CONTROL_CALLBACK_TYPE (USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE)
+#define CONTROL_CALLBACK_MASK (USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT)
+
+#define FLASH_START 0x08000000
+
+static int vendor_page_crc(struct usb_setup_data *req, uint8_t **buf, uint16_t *len) {
+	//  Return the CRC32 of each flash page in the requested range, so the host
+	//  can skip sending pages that are already flashed with the same contents.
+	uint32_t first_page = req->wValue;
+	uint32_t page_count = req->wLength / sizeof(uint32_t);
+	uint32_t flash_pages = (APP_BASE_ADDRESS - FLASH_START + target_get_max_firmware_size()) / FLASH_PAGE_SIZE;
+
+	if (page_count == 0 || page_count > USB_CONTROL_BUF_SIZE / sizeof(uint32_t) ||
+		first_page + page_count > flash_pages) {
+		log_warn("*** vendor page crc out of range");
+		return USBD_REQ_NOTSUPP;
+	}
+	uint8_t *out = *buf;
+	for (uint32_t i = 0; i < page_count; i++) {
+		const uint32_t *page = (const uint32_t *)(FLASH_START + (first_page + i) * FLASH_PAGE_SIZE);
+		uint32_t crc = target_crc32(page, FLASH_PAGE_SIZE / sizeof(uint32_t));
+		memcpy(out + i * sizeof(uint32_t), &crc, sizeof(uint32_t));
+	}
+	*len = page_count * sizeof(uint32_t);
+	return USBD_REQ_HANDLED;
+}
+
+#if DEVICE_DMESG_BUFFER_SIZE > 0
+static int vendor_dmesg(struct usb_setup_data *req, uint8_t **buf, uint16_t *len) {
+	//  Return a window of the binary log ring.  The host formats the messages.
+	if (req->wValue + req->wLength > sizeof(codalLogStore)) {
+		return USBD_REQ_NOTSUPP;
+	}
+	*buf = (uint8_t *)&codalLogStore + req->wValue;
+	*len = req->wLength;
+	return USBD_REQ_HANDLED;
+}
+#endif  //  DEVICE_DMESG_BUFFER_SIZE
+
+static int vendor_flash_stats(struct usb_setup_data *req, uint8_t **buf, uint16_t *len) {
+	//  Return a window of the flash statistics, including counts not saved to flash yet.
+	if (req->wValue + req->wLength > sizeof(flashStats)) {
+		return USBD_REQ_NOTSUPP;
+	}
+	*buf = (uint8_t *)&flashStats + req->wValue;
+	*len = req->wLength;
+	return USBD_REQ_HANDLED;
+}
+
+#ifdef PROFILE_SPANS
+static int vendor_profile(struct usb_setup_data *req, uint8_t **buf, uint16_t *len) {
+	//  Return a window of the span profiler table.
+	if (req->wValue + req->wLength > sizeof(profileTable)) {
+		return USBD_REQ_NOTSUPP;
+	}
+	*buf = (uint8_t *)&profileTable + req->wValue;
+	*len = req->wLength;
+	return USBD_REQ_HANDLED;
+}
+#endif  //  PROFILE_SPANS
+
+#ifdef PROFILE_SAMPLES
+static int vendor_samples(struct usb_setup_data *req, uint8_t **buf, uint16_t *len) {
+	//  Return a window of the PC sample histogram.
+	if (req->wValue + req->wLength > sizeof(profileSamples)) {
+		return USBD_REQ_NOTSUPP;
+	}
+	*buf = (uint8_t *)&profileSamples + req->wValue;
+	*len = req->wLength;
+	return USBD_REQ_HANDLED;
+}
+#endif  //  PROFILE_SAMPLES
+
+#ifdef USB_TRACE
+static int vendor_trace(struct usb_setup_data *req, uint8_t **buf, uint16_t *len) {
+	//  Return a window of the USB trace ring.  The host reads the header first, so the cycle
+	//  count latched here maps the entry timestamps to host time.
+	if (req->wValue + req->wLength > sizeof(usbTrace)) {
+		return USBD_REQ_NOTSUPP;
+	}
+	if (req->wValue == 0) {
+		if (usbTrace.magic != USB_TRACE_MAGIC) { usb_trace_reset(); }
+		usbTrace.now = DWT_CYCCNT;
+	}
+	*buf = (uint8_t *)&usbTrace + req->wValue;
+	*len = req->wLength;
+	return USBD_REQ_HANDLED;
+}
+#endif  //  USB_TRACE
+
+static int vendor_control_request(usbd_device *usbd_dev,
+								  struct usb_setup_data *req,
+								  uint8_t **buf, uint16_t *len,
+								  usbd_control_complete_callback* complete) {
+	(void)complete;
+	(void)usbd_dev;
+#ifdef PROFILE_SPANS
+	if (req->bmRequestType == 0x40 && req->bRequest == VENDOR_REQ_PROFILE) {
+		profile_reset();
+		return USBD_REQ_HANDLED;
+	}
+#endif  //  PROFILE_SPANS
+#ifdef PROFILE_SAMPLES
+	if (req->bmRequestType == 0x40 && req->bRequest == VENDOR_REQ_SAMPLES) {
+		profile_samples_reset();
+		return USBD_REQ_HANDLED;
+	}
+#endif  //  PROFILE_SAMPLES
+#ifdef USB_TRACE
+	if (req->bmRequestType == 0x40 && req->bRequest == VENDOR_REQ_TRACE) {
+		usb_trace_reset();
+		return USBD_REQ_HANDLED;
+	}
+#endif  //  USB_TRACE
+	//  Only device-to-host requests to the device (C0) are ours.
+	if (req->bmRequestType != 0xc0) { return USBD_REQ_NEXT_CALLBACK; }
+	switch (req->bRequest) {
+		case VENDOR_REQ_PAGE_CRC: return vendor_page_crc(req, buf, len);
+		case VENDOR_REQ_FLASH_STATS: return vendor_flash_stats(req, buf, len);
+#ifdef PROFILE_SPANS
+		case VENDOR_REQ_PROFILE: return vendor_profile(req, buf, len);
+#endif  //  PROFILE_SPANS
+#ifdef PROFILE_SAMPLES
+		case VENDOR_REQ_SAMPLES: return vendor_samples(req, buf, len);
+#endif  //  PROFILE_SAMPLES
+#ifdef USB_TRACE
+		case VENDOR_REQ_TRACE: return vendor_trace(req, buf, len);
+#endif  //  USB_TRACE
+#if DEVICE_DMESG_BUFFER_SIZE > 0
+		case VENDOR_REQ_DMESG: return vendor_dmesg(req, buf, len);
+#endif  //  DEVICE_DMESG_BUFFER_SIZE
+	}
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
+static void vendor_set_config(usbd_device* usbd_dev, uint16_t wValue) {
+	(void)wValue;
+	int status = aggregate_register_callback(
+		usbd_dev,
+		CONTROL_CALLBACK_TYPE,
+		CONTROL_CALLBACK_MASK,
+		vendor_control_request);
+	if (status < 0) { debug_println("*** vendor_set_config failed"); debug_flush(); }
+}
+
+void vendor_setup(usbd_device* usbd_dev) {
+	//  Register the callback now so the host tools may query before the configuration is set.
+	vendor_set_config(usbd_dev, 0);
+
+	//  Re-register the callback in case the USB restarts.
+	int status = aggregate_register_config_callback(usbd_dev, vendor_set_config);
+	if (status < 0) { debug_println("*** vendor_setup failed"); debug_flush(); }
+}
@@ -0,0 +1,34 @@
+//  Vendor control requests used by host-side flashing tools, e.g. uf2conv.py
+#ifndef VENDOR_H_INCLUDED
+#define VENDOR_H_INCLUDED
+
+#include <libopencm3/usb/usbd.h>
+
+//  Request codes.  Don't use 0x21 (WinUSB) or 0x22 (WebUSB).
+//  Page CRC: typ c0, req 30, val <first flash page>, idx 0000, len <4 * page count>
+//  Returns one little-endian CRC32 per page, computed by the hardware CRC unit.
+//  Pages are numbered from the start of flash (0x08000000), FLASH_PAGE_SIZE bytes each.
+#define VENDOR_REQ_PAGE_CRC     0x30
+//  DMESG log: typ c0, req 31, val <byte offset>, idx 0000, len <bytes>
+//  Returns the raw bytes of codalLogStore, decoded on the host by scripts/dmesg_decode.py.
+#define VENDOR_REQ_DMESG        0x31
+//  Flash statistics: typ c0, req 32, val <byte offset>, idx 0000, len <bytes>
+//  Returns the FlashStats struct in flash_stats.h: session counters and per-page erase counts.
+#define VENDOR_REQ_FLASH_STATS  0x32
+//  Span profiler: typ c0, req 33, val <byte offset>, idx 0000, len <bytes>
+//  Returns the ProfileTable struct in profile.h, dumped by scripts/profile_dump.py.
+//  typ 40, req 33, len 0000 clears the table.  Only with -D PROFILE_SPANS.
+#define VENDOR_REQ_PROFILE      0x33
+//  PC sampler: typ c0, req 34, val <byte offset>, idx 0000, len <bytes>
+//  Returns the ProfileSamples struct in profile.h, symbolized by scripts/pc_profile.py.
+//  typ 40, req 34, len 0000 clears the histogram.  Only with -D PROFILE_SAMPLES.
+#define VENDOR_REQ_SAMPLES      0x34
+//  USB trace: typ c0, req 35, val <byte offset>, idx 0000, len <bytes>
+//  Returns the UsbTrace struct in usb_trace.h, converted to pcapng by scripts/usb_trace.py.
+//  Reading offset 0 latches the current cycle count.  typ 40, req 35, len 0000 clears the
+//  ring.  Only with -D USB_TRACE.
+#define VENDOR_REQ_TRACE        0x35
+
+extern void vendor_setup(usbd_device* usbd_dev);
+
+#endif  //  VENDOR_H_INCLUDED
@@ -1,17 +1,55 @@
 #ifdef DEBUG
 
-//  Log messages to the debug console.  We use ARM Semihosting to display messages.
+//  Log messages to the debug console.  We use ARM Semihosting to display messages, or the ITM
+//  stimulus port (SWO pin) if DEBUG_ITM is defined.
 #include "logger.h"
 #include <string.h>
+#ifdef DEBUG_ITM
+#include <libopencm3/cm3/itm.h>
+#endif
 
 #define DEBUG_BUFFER_SIZE 80
 static char debugBuffer[DEBUG_BUFFER_SIZE + 1];  //  Buffer to hold output before flushing.
+static unsigned int debugLength = 0;             //  Number of chars in debugBuffer, so we don't need strlen().
 //static bool logEnabled = false;  //  Logging is off by default.  Developer must switch it on with enable_debug().
 #define logEnabled		((*(volatile uint32_t*)0xE000EDF0) & 1)
 
 
-void enable_log(void) { /*logEnabled = true;*/ debugBuffer[0] = 0; }
-void disable_log(void) { /*logEnabled = false;*/ debugBuffer[0] = 0; }
+void enable_log(void) { /*logEnabled = true;*/ debugBuffer[0] = 0; debugLength = 0; }
+void disable_log(void) { /*logEnabled = false;*/ debugBuffer[0] = 0; debugLength = 0; }
+
+#ifdef DEBUG_ITM
+
+//  ITM stimulus port that receives the log.  The debugger must enable tracing on this port, e.g.
+//    openocd -f interface/stlink-v2.cfg -f target/stm32f1x.cfg -f scripts/connect_itm.ocd
+//  and the output is decoded by scripts/itm_decode.py.
+#ifndef DEBUG_ITM_PORT
+#define DEBUG_ITM_PORT 0
+#endif
+
+//  Number of bytes dropped because the ITM FIFO was full.  Inspect with the debugger.
+volatile uint32_t itmDropped = 0;
+
+static void log_write(const char *buffer, unsigned int length) {
+    //  Write "length" number of bytes from "buffer" to the ITM stimulus port.  Unlike semihosting this
+    //  never halts the core: if the FIFO is full we drop the rest of the message instead of waiting.
+    if (!(ITM_TCR & ITM_TCR_ITMENA) || !(ITM_TER[0] & (1 << DEBUG_ITM_PORT))) { return; }  //  Tracing not enabled by debugger.
+    while (length > 0) {
+        if (!(ITM_STIM32(DEBUG_ITM_PORT) & ITM_STIM_FIFOREADY)) { itmDropped += length; return; }
+        if (length >= 4) {
+            //  Send 4 bytes per stimulus write to make the most of the SWO bandwidth.
+            uint32_t word;
+            memcpy(&word, buffer, 4);
+            ITM_STIM32(DEBUG_ITM_PORT) = word;
+            buffer += 4; length -= 4;
+        } else {
+            ITM_STIM8(DEBUG_ITM_PORT) = (uint8_t) *buffer;
+            buffer++; length--;
+        }
+    }
+}
+
+#else  //  DEBUG_ITM
 
 //  ARM Semihosting code from 
 //  http://www.keil.com/support/man/docs/ARMCC/armcc_pge1358787046598.htm
@@ -71,25 +109,33 @@ static int semihost_write(uint32_t fh, const unsigned char *buffer, unsigned int
     return __semihost(SYS_WRITE, args);
 }
 
+static void log_write(const char *buffer, unsigned int length) {
+    //  Write "length" number of bytes from "buffer" to the debugger log.  This will be slow.
+    semihost_write(SEMIHOST_HANDLE, (const unsigned char *) buffer, length);
+}
+
+#endif  //  DEBUG_ITM
+
 static void debug_append(const char *buffer, unsigned int length) {
     //  Append "length" number of bytes from "buffer" to the debug buffer.
-    const int debugBufferLength = strlen(debugBuffer);
     //  If can't fit into buffer, just send to the debugger log now.
-    if (debugBufferLength + length >= DEBUG_BUFFER_SIZE) {
+    if (debugLength + length >= DEBUG_BUFFER_SIZE) {
         debug_flush();
-        semihost_write(SEMIHOST_HANDLE, (const unsigned char *) buffer, length);
+        log_write(buffer, length);
         return;
     }
     //  Else append to the buffer.
-    strncat(debugBuffer, buffer, length);
-    debugBuffer[debugBufferLength + length] = 0;  //  Terminate the string.
+    memcpy(debugBuffer + debugLength, buffer, length);
+    debugLength += length;
+    debugBuffer[debugLength] = 0;  //  Terminate the string.
 }
 
 void debug_flush(void) {
-    //  Flush the debug buffer to the debugger log.  This will be slow.
-    if (debugBuffer[0] == 0) { return; }  //  Debug buffer is empty, nothing to write.
-	semihost_write(SEMIHOST_HANDLE, (const unsigned char *) debugBuffer, strlen(debugBuffer));
+    //  Flush the debug buffer to the debugger log.  This will be slow with semihosting.
+    if (debugLength == 0) { return; }  //  Debug buffer is empty, nothing to write.
+    log_write(debugBuffer, debugLength);
     debugBuffer[0] = 0;
+    debugLength = 0;
 }
 
 void debug_print(size_t l) {
@@ -118,7 +164,7 @@ void debug_print(size_t l) {
     if (length < size) buffer[length] = 0;
     buffer[size - 1] = 0;  //  Terminate in case of overflow.
 
-    debug_append(buffer, strlen(buffer));
+    debug_append(buffer, length);
 }
 
 void debug_print(int i) {
@@ -217,7 +263,7 @@ void debug_printhex(uint8_t v) {
     if (length < size) buffer[length] = 0;
     buffer[size - 1] = 0;  //  Terminate in case of overflow.
 
-    debug_append(buffer, strlen(buffer));
+    debug_append(buffer, length);
 }
 
 #endif /*DEBUG*/
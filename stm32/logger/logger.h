@@ -5,6 +5,39 @@
 #include <stdint.h>  //  For uint8_t
 #include <stdlib.h>  //  For size_t
 
+//  Compile-time log levels.  Messages logged with log_error() ... log_debug() above the threshold
+//  are removed together with their string literals, so they take no flash and no cycles.
+//  The threshold is LOG_LEVEL (set with -D LOG_LEVEL=...) unless a module overrides it by
+//  defining LOG_MODULE_LEVEL before including logger.h, e.g.
+//    #define LOG_MODULE_LEVEL LOG_LEVEL_DEBUG  //  Show everything from this module.
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO  //  Keeps the boot progress messages, see log_info().
+#endif
+
+#ifndef LOG_MODULE_LEVEL
+#define LOG_MODULE_LEVEL LOG_LEVEL
+#endif
+
+#ifdef DEBUG
+#define LOG_ENABLED(level) (LOG_MODULE_LEVEL >= (level))  //  Also usable in #if.
+#else
+#define LOG_ENABLED(level) 0
+#endif
+
+//  Write a string plus newline to the buffered debug log if the level is enabled for this module.
+#define log_error(s) do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) { debug_println(s); } } while (0)
+#define log_warn(s)  do { if (LOG_ENABLED(LOG_LEVEL_WARN))  { debug_println(s); } } while (0)
+#define log_info(s)  do { if (LOG_ENABLED(LOG_LEVEL_INFO))  { debug_println(s); } } while (0)
+#define log_debug(s) do { if (LOG_ENABLED(LOG_LEVEL_DEBUG)) { debug_println(s); } } while (0)
+//  Flush the debug log, unless all logging is disabled for this module.
+#define log_flush()  do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) { debug_flush(); } } while (0)
+
 #ifdef DEBUG
 
 #ifdef __cplusplus